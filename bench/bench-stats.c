@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "bench-stats.h"
+
+double
+bench_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile */
+static double
+percentile(const double *sorted, unsigned int n, unsigned int pct)
+{
+	unsigned int rank = (pct * n + 99) / 100;
+
+	return sorted[rank? rank - 1 : 0];
+}
+
+void
+bench_print_stats(FILE *fp, double *samples, unsigned int n)
+{
+	double sum = 0;
+	unsigned int i;
+
+	if (n == 0) {
+		fprintf(fp, "\"runs\":0");
+		return;
+	}
+
+	qsort(samples, n, sizeof(samples[0]), compare_double);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	fprintf(fp, "\"runs\":%u,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f",
+			n, sum / n,
+			percentile(samples, n, 50),
+			percentile(samples, n, 90),
+			percentile(samples, n, 99),
+			samples[n - 1]);
+}
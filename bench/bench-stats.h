@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FDE_BENCH_STATS_H
+#define FDE_BENCH_STATS_H
+
+#include <stdio.h>
+
+/* Milliseconds on the monotonic clock */
+double	bench_now_ms(void);
+
+/*
+ * Print the sample count and latency statistics as JSON members,
+ * "runs":N,"mean_ms":...,"max_ms":... (without braces). Sorts samples.
+ */
+void	bench_print_stats(FILE *fp, double *samples, unsigned int n);
+
+#endif /* FDE_BENCH_STATS_H */
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Run each fde-token verb against the virtual authenticator a number of
+ * times, and report latency percentiles as one JSON object per line.
+ * fde-token is linked in, with its main() renamed to fde_token_main().
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "bench-stats.h"
+#include "vauth.h"
+
+#define BENCH_MAX_ARGS		32
+#define BENCH_BATCH_VOLUMES	8
+#define BENCH_UUID		"6a1cbcd4-6a3e-4f9c-a3a4-6c1d1b7b7c2e"
+#define BENCH_SALT		"5fc1f2b5a0d2bf6b0c4e4cf0b1be7d2d8a5f41d67f5ab0be1c3ba2aa5e3d4c11"
+
+extern int	fde_token_main(int argc, char **argv);
+
+static int	opt_runs = 50;
+static int	opt_devices = 4;
+static bool	opt_verbose = false;
+static struct vauth_config vauth_config = {
+	.pin		= "123456",
+	.latency_ms	= 2,
+	.touch_ms	= 0,
+};
+
+static FILE *	report;
+static int	null_fd = -1;
+static int	saved_fds[2] = { -1, -1 };
+static const char *running_verb;
+
+/* Without --device, fde-token finds opt_devices virtual devices */
+static bool	discover_devices = false;
+
+/* Called by fde-token for every FIDO device it opens */
+void
+fde_token_dev_setup(fido_dev_t *dev, const char *path)
+{
+	if (!strncmp(path, VAUTH_PATH_PREFIX, strlen(VAUTH_PATH_PREFIX)) && vauth_attach(dev) != FIDO_OK) {
+		fprintf(stderr, "Unable to attach virtual authenticator\n");
+		exit(2);
+	}
+}
+
+/* Called by fde-token in place of fido_dev_info_manifest() */
+int
+fde_token_dev_manifest(fido_dev_info_t *devlist, size_t ilen, size_t *olen)
+{
+	char path[32];
+	size_t i;
+	int r;
+
+	if (!discover_devices)
+		return fido_dev_info_manifest(devlist, ilen, olen);
+
+	for (i = 0; i < (size_t) opt_devices && i < ilen; i++) {
+		snprintf(path, sizeof(path), VAUTH_PATH_PREFIX "%zu", i);
+		if ((r = vauth_dev_info_set(devlist, i, path)) != FIDO_OK)
+			return r;
+	}
+
+	*olen = i;
+	return FIDO_OK;
+}
+
+static void
+usage(int exitval)
+{
+	fprintf(stderr,
+		"Usage: fde-token-bench [-n RUNS] [-d DEVICES] [-l LATENCY_MS] [-t TOUCH_MS] [-p PIN | -N] [-v]\n"
+		"  -n RUNS        Number of runs per verb (default 50)\n"
+		"  -d DEVICES     Number of devices found without --device (default 4)\n"
+		"  -l LATENCY_MS  Delay added to every authenticator response (default 2)\n"
+		"  -t TOUCH_MS    Time the user takes to confirm presence (default 0)\n"
+		"  -p PIN         PIN of the virtual authenticator (default 123456)\n"
+		"  -N             The virtual authenticator has no PIN\n"
+		"  -v             Do not hide fde-token's output\n");
+	exit(exitval);
+}
+
+/* Silence fde-token, which prints keys and chatter on stdout and stderr */
+static void
+quiet_begin(void)
+{
+	if (opt_verbose)
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(null_fd, 1);
+	dup2(null_fd, 2);
+}
+
+static void
+quiet_end(void)
+{
+	if (opt_verbose)
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_fds[0], 1);
+	dup2(saved_fds[1], 2);
+}
+
+/*
+ * Invoke fde-token with the given arguments, appending the options
+ * common to all verbs. Returns its exit status.
+ */
+static int
+run_fde_token(const char **args)
+{
+	const char *verb = args[0];
+	char *argv[BENCH_MAX_ARGS + 1];
+	int argc = 0, rv;
+
+	argv[argc++] = "fde-token";
+	if (!discover_devices) {
+		argv[argc++] = "--device";
+		argv[argc++] = VAUTH_DEVICE_PATH;
+	}
+	if (vauth_config.pin) {
+		argv[argc++] = "--pin";
+		argv[argc++] = (char *) vauth_config.pin;
+	}
+	while (*args && argc < BENCH_MAX_ARGS)
+		argv[argc++] = (char *) *args++;
+	argv[argc] = NULL;
+
+	/* getopt keeps state across calls; zero makes it start over */
+	optind = 0;
+
+	quiet_begin();
+	running_verb = verb;
+	rv = fde_token_main(argc, argv);
+	running_verb = NULL;
+	quiet_end();
+
+	return rv;
+}
+
+/* fde-token calls exit() on fatal errors */
+static void
+bench_exit(void)
+{
+	if (running_verb == NULL)
+		return;
+
+	quiet_end();
+	fprintf(stderr, "fde-token %s exited unexpectedly%s\n", running_verb,
+			opt_verbose? "" : "; run with -v to see why");
+}
+
+static void
+bench_report(const char *verb, double *samples, unsigned int n)
+{
+	fprintf(report, "{\"bench\":\"fde-token\",\"verb\":\"%s\",\"latency_ms\":%d,\"touch_ms\":%d,\"pin\":%s,",
+			verb, vauth_config.latency_ms, vauth_config.touch_ms,
+			vauth_config.pin? "true" : "false");
+	bench_print_stats(report, samples, n);
+	fprintf(report, "}\n");
+	fflush(report);
+}
+
+/*
+ * Time opt_runs invocations of fde-token. If reset is set, the virtual
+ * authenticator is wiped before each run (outside of the timed section).
+ */
+static bool
+bench_verb(const char *verb, const char **args, bool reset)
+{
+	double *samples, t0;
+	unsigned int i;
+	int rv;
+
+	if (!(samples = calloc(opt_runs, sizeof(double)))) {
+		fprintf(report, "Out of memory\n");
+		return false;
+	}
+
+	for (i = 0; i < opt_runs; i++) {
+		if (reset)
+			vauth_reset();
+
+		t0 = bench_now_ms();
+		rv = run_fde_token(args);
+		samples[i] = bench_now_ms() - t0;
+
+		if (rv != 0) {
+			fprintf(stderr, "fde-token %s failed with status %d (run %u)\n", verb, rv, i);
+			free(samples);
+			return false;
+		}
+	}
+
+	bench_report(verb, samples, opt_runs);
+	free(samples);
+	return true;
+}
+
+static bool
+read_key(const char *path, unsigned char *buf, size_t size, size_t *len)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return false;
+	*len = fread(buf, 1, size, fp);
+	fclose(fp);
+	return *len != 0;
+}
+
+/*
+ * The key must not depend on how fde-token found the credential.
+ */
+static bool
+check_consistency(const char *cred_id)
+{
+	char path1[] = "/tmp/fde-token-bench.XXXXXX";
+	char path2[] = "/tmp/fde-token-bench.XXXXXX";
+	const char *discover[] = { "get-secret", "-o", path1, BENCH_UUID, NULL };
+	const char *direct[] = { "get-secret", "--credential", cred_id, "-o", path2, BENCH_UUID, NULL };
+	unsigned char key1[128], key2[128];
+	size_t len1 = 0, len2 = 0;
+	bool ok = false;
+	int fd1, fd2;
+
+	if ((fd1 = mkstemp(path1)) < 0)
+		return false;
+	if ((fd2 = mkstemp(path2)) < 0) {
+		close(fd1);
+		unlink(path1);
+		return false;
+	}
+	close(fd1);
+	close(fd2);
+
+	if (run_fde_token(discover) == 0 && run_fde_token(direct) == 0
+	 && read_key(path1, key1, sizeof(key1), &len1)
+	 && read_key(path2, key2, sizeof(key2), &len2))
+		ok = len1 == len2 && !memcmp(key1, key2, len1);
+
+	if (!ok)
+		fprintf(stderr, "get-secret returns different keys with and without --credential\n");
+
+	memset(key1, 0, sizeof(key1));
+	memset(key2, 0, sizeof(key2));
+	unlink(path1);
+	unlink(path2);
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *detect[] = { "detect", NULL };
+	const char *check[] = { "check", NULL };
+	const char *enroll[] = { "enroll", NULL };
+	const char *discover[] = { "get-secret", BENCH_UUID, NULL };
+	const char *direct[] = { "get-secret", "--credential", NULL, "--salt", BENCH_SALT, BENCH_UUID, NULL };
+	const char *batch[BENCH_BATCH_VOLUMES + 8];
+	char uuids[BENCH_BATCH_VOLUMES][40];
+	char cred_id[128];
+	unsigned int i, n;
+	bool ok = true;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:hl:n:Np:t:v")) != -1) {
+		switch (c) {
+		case 'd':
+			opt_devices = atoi(optarg);
+			break;
+		case 'l':
+			vauth_config.latency_ms = atoi(optarg);
+			break;
+		case 'n':
+			opt_runs = atoi(optarg);
+			break;
+		case 'N':
+			vauth_config.pin = NULL;
+			break;
+		case 'p':
+			vauth_config.pin = optarg;
+			break;
+		case 't':
+			vauth_config.touch_ms = atoi(optarg);
+			break;
+		case 'v':
+			opt_verbose = true;
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(2);
+		}
+	}
+
+	if (opt_runs <= 0 || opt_devices <= 0)
+		usage(2);
+
+	if ((null_fd = open("/dev/null", O_WRONLY)) < 0
+	 || (saved_fds[0] = dup(1)) < 0
+	 || (saved_fds[1] = dup(2)) < 0
+	 || !(report = fdopen(saved_fds[0], "w"))) {
+		perror("fde-token-bench");
+		return 2;
+	}
+
+	vauth_init(&vauth_config);
+	atexit(bench_exit);
+
+	ok = bench_verb("detect", detect, false)
+	  && bench_verb("check", check, false)
+	  && bench_verb("enroll", enroll, true);
+
+	/* the last enrollment left one credential behind */
+	if (ok && !vauth_cred_id_hex(0, cred_id, sizeof(cred_id))) {
+		fprintf(stderr, "enroll did not create a credential\n");
+		ok = false;
+	}
+
+	if (ok) {
+		direct[2] = cred_id;
+
+		n = 0;
+		batch[n++] = "get-secret";
+		batch[n++] = "--batch";
+		batch[n++] = "--credential";
+		batch[n++] = cred_id;
+		batch[n++] = "--salt";
+		batch[n++] = BENCH_SALT;
+		for (i = 0; i < BENCH_BATCH_VOLUMES; i++) {
+			snprintf(uuids[i], sizeof(uuids[i]), "6a1cbcd4-6a3e-4f9c-a3a4-%012x", i);
+			batch[n++] = uuids[i];
+		}
+		batch[n] = NULL;
+
+		/* Without a PIN, credential management is not available, and
+		 * get-secret only works with --credential */
+		if (vauth_config.pin)
+			ok = check_consistency(cred_id)
+			  && bench_verb("get-secret", discover, false);
+
+		ok = ok && bench_verb("get-secret --credential", direct, false)
+		  && bench_verb("get-secret --batch", batch, false);
+	}
+
+	/* Again without --device: fde-token probes all devices in
+	 * parallel, using its cache of their capabilities. The virtual
+	 * devices all lead to the same authenticator. */
+	if (ok) {
+		discover_devices = true;
+		ok = bench_verb("detect, all devices", detect, false)
+		  && bench_verb("get-secret --credential, all devices", direct, false);
+		if (vauth_config.pin)
+			ok = ok && bench_verb("get-secret, all devices", discover, false);
+		discover_devices = false;
+	}
+
+	fclose(report);
+	return ok? 0 : 1;
+}
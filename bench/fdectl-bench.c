@@ -0,0 +1,525 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Time fdectl-grub-tpm2 and the token plugins on LUKS2 image files with
+ * many keyslots and tokens of several types, and report latency
+ * percentiles as one JSON object per line.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libcryptsetup.h>
+#include "bench-stats.h"
+
+#define BENCH_MAX_KEYSLOTS	32
+#define BENCH_MAX_TOKENS	32
+#define BENCH_EMPTY_TOKENS	4
+#define BENCH_IMAGE_SIZE	(64 << 20)
+#define BENCH_METADATA_SIZE	(64 * 1024)
+#define BENCH_KEYSLOTS_SIZE	(16 << 20)
+#define BENCH_PASSPHRASE	"fde-bench"
+#define BENCH_TIMESTAMP		"2023-01-01 00:00:00 UTC"
+
+/* These are not in any header; see cryptsetup/libcryptsetup-token.sym */
+typedef int	(*token_validate_fn)(struct crypt_device *cd, const char *json);
+typedef void	(*token_dump_fn)(struct crypt_device *cd, const char *json);
+
+static int	opt_runs = 20;
+static int	opt_keyslots = BENCH_MAX_KEYSLOTS;
+static int	opt_foreign_tokens = 8;
+static const char *opt_fdectl = "./fdectl-grub-tpm2";
+static const char *opt_plugin_dir = ".";
+static const char *opt_work_dir;
+
+static char	template_path[PATH_MAX];
+static char	image_path[PATH_MAX];
+static char	journal_path[PATH_MAX];
+static char	fido2_params_path[PATH_MAX];
+static uint64_t	header_size;
+static int	ntokens;
+
+static void
+usage(int exitval)
+{
+	fprintf(stderr,
+		"Usage: fdectl-bench [-n RUNS] [-k KEYSLOTS] [-t TOKENS] [-C FDECTL] [-L PLUGIN_DIR] [-d DIR]\n"
+		"  -n RUNS        Number of runs per operation (default 20)\n"
+		"  -k KEYSLOTS    Keyslots in the image, 8 to 32 (default 32)\n"
+		"  -t TOKENS      Tokens of foreign type, besides grub-tpm2 and fde-fido2 (default 8)\n"
+		"  -C FDECTL      Path of fdectl-grub-tpm2 (default ./fdectl-grub-tpm2)\n"
+		"  -L PLUGIN_DIR  Directory holding the token plugins (default .)\n"
+		"  -d DIR         Create the image files in DIR (default: a new directory in /tmp)\n");
+	exit(exitval);
+}
+
+static void
+quiet_log(int level, const char *msg, void *usrptr)
+{
+}
+
+/*
+ * Keyslot layout of the template image, for K keyslots:
+ *   [0, K/4)		grub-tpm2 tokens
+ *   [K/4, K/2)		fde-fido2 tokens
+ *   [K/2, 3K/4)	foreign tokens, round robin
+ *   [3K/4, K)		no token; the add benchmark uses these
+ * plus a few grub-tpm2 tokens without keyslot, for clean to remove.
+ */
+#define GRUB_TPM2_FIRST		0
+#define FIDO2_FIRST		(opt_keyslots / 4)
+#define FOREIGN_FIRST		(opt_keyslots / 2)
+#define FREE_FIRST		(3 * opt_keyslots / 4)
+
+static bool
+add_token(struct crypt_device *cd, const char *type, int keyslot, const char *extra)
+{
+	char json[512], slots[16] = "";
+	int r;
+
+	if (keyslot >= 0)
+		snprintf(slots, sizeof(slots), "\"%d\"", keyslot);
+
+	snprintf(json, sizeof(json),
+		"{\"type\":\"%s\",\"keyslots\":[%s],\"timestamp\":\"" BENCH_TIMESTAMP "\"%s}",
+		type, slots, extra? extra : "");
+
+	if ((r = crypt_token_json_set(cd, CRYPT_ANY_TOKEN, json)) < 0) {
+		fprintf(stderr, "Unable to add %s token: %s\n", type, strerror(-r));
+		return false;
+	}
+
+	ntokens++;
+	return true;
+}
+
+static bool
+create_template(void)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+		.iterations	= 1000,
+		.flags		= CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	struct crypt_params_luks2 params = {
+		.pbkdf		= &pbkdf,
+		.sector_size	= 512,
+	};
+	/* Types without a token plugin; the systemd plugins, when installed,
+	 * would insist on well formed tokens of their own. */
+	static const char *foreign_types[] = { "clevis", "fde-bench-foreign" };
+	char fido2[256];
+	struct crypt_device *cd = NULL;
+	bool ok = false;
+	int fd, r, i;
+
+	if ((fd = open(template_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0
+	 || ftruncate(fd, BENCH_IMAGE_SIZE) < 0) {
+		fprintf(stderr, "Unable to create %s: %m\n", template_path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	close(fd);
+
+	if ((r = crypt_init(&cd, template_path)) < 0)
+		goto failed;
+	crypt_set_log_callback(cd, quiet_log, NULL);
+
+	if ((r = crypt_set_metadata_size(cd, BENCH_METADATA_SIZE, BENCH_KEYSLOTS_SIZE)) < 0
+	 || (r = crypt_set_pbkdf_type(cd, &pbkdf)) < 0
+	 || (r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 64, &params)) < 0)
+		goto failed;
+
+	for (i = 0; i < opt_keyslots; i++) {
+		r = crypt_keyslot_add_by_volume_key(cd, i, NULL, 0,
+				BENCH_PASSPHRASE, strlen(BENCH_PASSPHRASE));
+		if (r < 0)
+			goto failed;
+	}
+
+	for (i = GRUB_TPM2_FIRST; i < FIDO2_FIRST; i++) {
+		if (!add_token(cd, "grub-tpm2", i, NULL))
+			goto out;
+	}
+
+	for (i = FIDO2_FIRST; i < FOREIGN_FIRST; i++) {
+		snprintf(fido2, sizeof(fido2),
+			",\"fido2-credential\":\"%064x\",\"fido2-salt\":\"%064x\",\"fido2-aaguid\":\"%032x\"",
+			i, i, i);
+		if (!add_token(cd, "fde-fido2", i, fido2))
+			goto out;
+	}
+
+	for (i = 0; i < opt_foreign_tokens; i++) {
+		if (!add_token(cd, foreign_types[i % 2], FOREIGN_FIRST + i % (FREE_FIRST - FOREIGN_FIRST), NULL))
+			goto out;
+	}
+
+	for (i = 0; i < BENCH_EMPTY_TOKENS; i++) {
+		if (!add_token(cd, "grub-tpm2", -1, NULL))
+			goto out;
+	}
+
+	header_size = crypt_get_data_offset(cd) * 512;
+	ok = true;
+	goto out;
+
+failed:
+	fprintf(stderr, "Unable to set up LUKS2 image %s: %s\n", template_path, strerror(-r));
+out:
+	crypt_free(cd);
+	return ok;
+}
+
+/*
+ * Reset the work image to the template. Only the LUKS2 header and the
+ * keyslot area can change, so that is all we copy.
+ */
+static bool
+restore_image(void)
+{
+	char buf[65536];
+	uint64_t done = 0;
+	int in, out;
+	ssize_t n;
+	bool ok = false;
+
+	if ((in = open(template_path, O_RDONLY)) < 0)
+		return false;
+	if ((out = open(image_path, O_WRONLY | O_CREAT, 0600)) < 0) {
+		close(in);
+		return false;
+	}
+
+	while (done < header_size) {
+		n = read(in, buf, sizeof(buf));
+		if (n <= 0 || write(out, buf, n) != n)
+			goto out;
+		done += n;
+	}
+
+	ok = ftruncate(out, BENCH_IMAGE_SIZE) == 0;
+
+out:
+	close(in);
+	close(out);
+
+	/* Every update starts out with a fresh journal */
+	unlink(journal_path);
+	return ok;
+}
+
+static bool
+write_fido2_params(void)
+{
+	FILE *fp;
+	int i;
+
+	if (!(fp = fopen(fido2_params_path, "w")))
+		return false;
+
+	/* as many tokens as there are free keyslots, and room for */
+	for (i = FREE_FIRST; i < opt_keyslots && ntokens + i - FREE_FIRST < BENCH_MAX_TOKENS; i++) {
+		fprintf(fp, "FIDO2_KEYSLOT=%d\n", i);
+		fprintf(fp, "FIDO2_CREDENTIAL=%064x\n", 0x100 + i);
+		fprintf(fp, "FIDO2_AAGUID=%032x\n", 0x100 + i);
+		fprintf(fp, "FIDO2_SALT=%064x\n\n", 0x100 + i);
+	}
+
+	return fclose(fp) == 0;
+}
+
+/* Run fdectl-grub-tpm2 with the given arguments. Returns its exit status. */
+static int
+run_fdectl(const char **args)
+{
+	const char *argv[16];
+	int argc = 0, status;
+	pid_t pid;
+
+	argv[argc++] = opt_fdectl;
+	while (*args && argc < 14)
+		argv[argc++] = *args++;
+	argv[argc++] = image_path;
+	argv[argc] = NULL;
+
+	if ((pid = fork()) < 0)
+		return -1;
+
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execv(opt_fdectl, (char **) argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void
+report(const char *op, double *samples, unsigned int n)
+{
+	printf("{\"bench\":\"fdectl-grub-tpm2\",\"op\":\"%s\",\"keyslots\":%d,\"tokens\":%d,",
+			op, opt_keyslots, ntokens);
+	bench_print_stats(stdout, samples, n);
+	printf("}\n");
+	fflush(stdout);
+}
+
+/*
+ * Time opt_runs invocations of fdectl-grub-tpm2. If restore is set,
+ * the image is reset to the template before each run (untimed); the
+ * keyslot argument, if any, is replaced by a free keyslot that changes
+ * from run to run.
+ */
+static bool
+bench_fdectl(const char *op, const char **args, bool restore)
+{
+	const char *argv[16];
+	char keyslot[16];
+	double *samples, t0;
+	int i, j, rv;
+
+	if (!(samples = calloc(opt_runs, sizeof(double))))
+		return false;
+
+	for (i = 0; i < opt_runs; i++) {
+		if (restore && !restore_image()) {
+			fprintf(stderr, "Unable to restore %s\n", image_path);
+			free(samples);
+			return false;
+		}
+
+		snprintf(keyslot, sizeof(keyslot), "%d",
+				FREE_FIRST + i % (opt_keyslots - FREE_FIRST));
+		for (j = 0; args[j] && j < 15; j++)
+			argv[j] = strcmp(args[j], "KEYSLOT")? args[j] : keyslot;
+		argv[j] = NULL;
+
+		t0 = bench_now_ms();
+		rv = run_fdectl(argv);
+		samples[i] = bench_now_ms() - t0;
+
+		if (rv != 0) {
+			fprintf(stderr, "fdectl-grub-tpm2 %s failed with status %d\n", op, rv);
+			free(samples);
+			return false;
+		}
+	}
+
+	report(op, samples, opt_runs);
+	free(samples);
+	return true;
+}
+
+/*
+ * Time the validate and dump entry points of a token plugin, calling
+ * them opt_runs times on each token of its type in the template.
+ */
+static bool
+bench_plugin(struct crypt_device *cd, const char *type)
+{
+	char path[PATH_MAX];
+	token_validate_fn validate;
+	token_dump_fn dump;
+	double *validate_samples, *dump_samples, t0;
+	const char *tokens[BENCH_MAX_TOKENS];
+	unsigned int n = 0, ntype = 0;
+	void *handle;
+	bool ok = false;
+	int i, j, token;
+
+	snprintf(path, sizeof(path), "%s/libcryptsetup-token-%s.so", opt_plugin_dir, type);
+	if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		fprintf(stderr, "Unable to load %s: %s\n", path, dlerror());
+		return false;
+	}
+
+	validate = (token_validate_fn) dlsym(handle, "cryptsetup_token_validate");
+	dump = (token_dump_fn) dlsym(handle, "cryptsetup_token_dump");
+	if (!validate || !dump) {
+		fprintf(stderr, "%s lacks the validate or dump entry point\n", path);
+		dlclose(handle);
+		return false;
+	}
+
+	validate_samples = calloc(opt_runs * BENCH_MAX_TOKENS, sizeof(double));
+	dump_samples = calloc(opt_runs * BENCH_MAX_TOKENS, sizeof(double));
+	if (!validate_samples || !dump_samples)
+		goto out;
+
+	/* the tokens of this type */
+	for (token = 0; token < BENCH_MAX_TOKENS; token++) {
+		const char *token_type;
+		crypt_token_info status;
+
+		status = crypt_token_status(cd, token, &token_type);
+		if (status != CRYPT_TOKEN_EXTERNAL && status != CRYPT_TOKEN_EXTERNAL_UNKNOWN)
+			continue;
+		if (!strcmp(token_type, type) && crypt_token_json_get(cd, token, &tokens[ntype]) >= 0)
+			ntype++;
+	}
+
+	for (i = 0; i < opt_runs; i++) {
+		for (j = 0; j < ntype; j++) {
+			t0 = bench_now_ms();
+			if (validate(cd, tokens[j]) < 0) {
+				fprintf(stderr, "%s plugin rejects token %s\n", type, tokens[j]);
+				goto out;
+			}
+			validate_samples[n] = bench_now_ms() - t0;
+
+			t0 = bench_now_ms();
+			dump(cd, tokens[j]);
+			dump_samples[n] = bench_now_ms() - t0;
+			n++;
+		}
+	}
+
+	printf("{\"bench\":\"token-plugin\",\"plugin\":\"%s\",\"op\":\"validate\",", type);
+	bench_print_stats(stdout, validate_samples, n);
+	printf("}\n");
+	printf("{\"bench\":\"token-plugin\",\"plugin\":\"%s\",\"op\":\"dump\",", type);
+	bench_print_stats(stdout, dump_samples, n);
+	printf("}\n");
+	fflush(stdout);
+	ok = true;
+
+out:
+	free(validate_samples);
+	free(dump_samples);
+	dlclose(handle);
+	return ok;
+}
+
+static bool
+bench_plugins(void)
+{
+	struct crypt_device *cd = NULL;
+	bool ok;
+
+	if (crypt_init(&cd, template_path) < 0 || crypt_load(cd, CRYPT_LUKS2, NULL) < 0) {
+		fprintf(stderr, "Unable to load %s\n", template_path);
+		crypt_free(cd);
+		return false;
+	}
+
+	/* dump prints through the libcryptsetup log */
+	crypt_set_log_callback(cd, quiet_log, NULL);
+
+	ok = bench_plugin(cd, "grub-tpm2")
+	  && bench_plugin(cd, "fde-fido2");
+
+	crypt_free(cd);
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *add[] = { "add", "--journal", journal_path, "--key-slot", "KEYSLOT", NULL };
+	const char *add_fido2[] = { "add", "--journal", journal_path, "--token-type", "fde-fido2",
+				    "--fido2-params", fido2_params_path, NULL };
+	const char *list[] = { "list", NULL };
+	const char *list_key_only[] = { "list", "--key-only", NULL };
+	const char *list_fido2[] = { "list", "--token-type", "fde-fido2", NULL };
+	const char *clean[] = { "clean", "--journal", journal_path, NULL };
+	char dir_template[] = "/tmp/fdectl-bench.XXXXXX";
+	bool ok;
+	int c;
+
+	while ((c = getopt(argc, argv, "C:d:hk:L:n:t:")) != -1) {
+		switch (c) {
+		case 'C':
+			opt_fdectl = optarg;
+			break;
+		case 'd':
+			opt_work_dir = optarg;
+			break;
+		case 'k':
+			opt_keyslots = atoi(optarg);
+			break;
+		case 'L':
+			opt_plugin_dir = optarg;
+			break;
+		case 'n':
+			opt_runs = atoi(optarg);
+			break;
+		case 't':
+			opt_foreign_tokens = atoi(optarg);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(2);
+		}
+	}
+
+	if (opt_runs <= 0 || opt_keyslots < 8 || opt_keyslots > BENCH_MAX_KEYSLOTS || opt_foreign_tokens < 0)
+		usage(2);
+
+	/* LUKS2 has room for 32 tokens */
+	if (opt_keyslots / 2 + opt_foreign_tokens + BENCH_EMPTY_TOKENS > BENCH_MAX_TOKENS) {
+		fprintf(stderr, "Too many tokens, use at most %d foreign tokens\n",
+				BENCH_MAX_TOKENS - opt_keyslots / 2 - BENCH_EMPTY_TOKENS);
+		return 2;
+	}
+
+	if (opt_work_dir == NULL && (opt_work_dir = mkdtemp(dir_template)) == NULL) {
+		perror("fdectl-bench: mkdtemp");
+		return 2;
+	}
+
+	snprintf(template_path, sizeof(template_path), "%s/template.img", opt_work_dir);
+	snprintf(image_path, sizeof(image_path), "%s/luks2.img", opt_work_dir);
+	snprintf(journal_path, sizeof(journal_path), "%s/luks2.journal", opt_work_dir);
+	snprintf(fido2_params_path, sizeof(fido2_params_path), "%s/fido2.params", opt_work_dir);
+
+	ok = create_template()
+	  && write_fido2_params()
+	  && restore_image()
+	  && bench_fdectl("list", list, false)
+	  && bench_fdectl("list --key-only", list_key_only, false)
+	  && bench_fdectl("list --token-type fde-fido2", list_fido2, false)
+	  && bench_fdectl("add", add, true)
+	  && bench_fdectl("add --fido2-params", add_fido2, true)
+	  && bench_fdectl("clean", clean, true)
+	  && bench_plugins();
+
+	unlink(template_path);
+	unlink(image_path);
+	unlink(journal_path);
+	unlink(fido2_params_path);
+	if (opt_work_dir == dir_template)
+		rmdir(opt_work_dir);
+
+	return ok? 0 : 1;
+}
@@ -0,0 +1,1221 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A virtual CTAP2 authenticator for benchmarking fde-token without
+ * hardware. libfido2 hands us complete CTAPHID messages through the
+ * transport hooks; we answer them synchronously, after an optional
+ * delay to model slow USB keys.
+ */
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ec.h>
+#include <openssl/ecdh.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include "vauth.h"
+
+/* CTAPHID commands, without the frame init bit */
+#define CTAPHID_INIT			0x06
+#define CTAPHID_CBOR			0x10
+#define CTAPHID_CANCEL			0x11
+
+#define CTAPHID_CAP_WINK		0x01
+#define CTAPHID_CAP_CBOR		0x04
+#define CTAPHID_CAP_NMSG		0x08
+
+/* CTAP2 commands */
+#define CTAP_MAKE_CREDENTIAL		0x01
+#define CTAP_GET_ASSERTION		0x02
+#define CTAP_GET_INFO			0x04
+#define CTAP_CLIENT_PIN			0x06
+#define CTAP_CRED_MGMT			0x0a
+#define CTAP_CRED_MGMT_PRE		0x41
+
+/* CTAP2 status codes */
+#define CTAP_OK				0x00
+#define CTAP_ERR_INVALID_COMMAND	0x01
+#define CTAP_ERR_INVALID_PARAMETER	0x02
+#define CTAP_ERR_INVALID_LENGTH		0x03
+#define CTAP_ERR_INVALID_CBOR		0x12
+#define CTAP_ERR_MISSING_PARAMETER	0x14
+#define CTAP_ERR_KEY_STORE_FULL		0x28
+#define CTAP_ERR_NO_CREDENTIALS		0x2e
+#define CTAP_ERR_NOT_ALLOWED		0x30
+#define CTAP_ERR_PIN_INVALID		0x31
+#define CTAP_ERR_PIN_AUTH_INVALID	0x33
+#define CTAP_ERR_PIN_NOT_SET		0x35
+#define CTAP_ERR_PIN_REQUIRED		0x36
+#define CTAP_ERR_OTHER			0x7f
+
+/* authenticatorData flags */
+#define AUTHDATA_UP			0x01
+#define AUTHDATA_UV			0x04
+#define AUTHDATA_AT			0x40
+#define AUTHDATA_ED			0x80
+
+#define VAUTH_MAX_CREDS			16
+#define VAUTH_MAX_MSG			2048
+#define VAUTH_PIN_RETRIES		8
+
+/*
+ * Minimal CBOR codec, limited to the definite length encodings used by
+ * libfido2.
+ */
+enum {
+	CB_UINT,
+	CB_NEGINT,
+	CB_BYTES,
+	CB_TEXT,
+	CB_ARRAY,
+	CB_MAP,
+	CB_BOOL,
+	CB_NULL,
+};
+
+struct cb_item {
+	int			type;
+	int64_t			ival;		/* CB_UINT, CB_NEGINT, CB_BOOL */
+	const unsigned char *	ptr;		/* CB_BYTES, CB_TEXT */
+	size_t			len;
+	size_t			count;		/* CB_ARRAY, CB_MAP */
+	struct cb_item *	children;	/* maps: key, value, key, ... */
+	const unsigned char *	raw;		/* encoding of the whole item */
+	size_t			raw_len;
+};
+
+struct cb_buf {
+	unsigned char		data[VAUTH_MAX_MSG];
+	size_t			len;
+	bool			overflow;
+};
+
+static void
+cb_free(struct cb_item *item)
+{
+	size_t i, n;
+
+	if (item->children) {
+		n = item->type == CB_MAP? 2 * item->count : item->count;
+		for (i = 0; i < n; i++)
+			cb_free(&item->children[i]);
+		free(item->children);
+		item->children = NULL;
+	}
+}
+
+static bool
+cb_decode_item(const unsigned char **pp, const unsigned char *end, struct cb_item *item, int depth)
+{
+	const unsigned char *p = *pp;
+	unsigned int major, info;
+	uint64_t val = 0;
+	size_t i, n;
+
+	memset(item, 0, sizeof(*item));
+	if (p >= end || depth > 8)
+		return false;
+
+	item->raw = p;
+	major = *p >> 5;
+	info = *p++ & 0x1f;
+
+	if (info < 24) {
+		val = info;
+	} else if (info <= 27) {
+		n = 1 << (info - 24);
+		if (end - p < n)
+			return false;
+		for (i = 0; i < n; i++)
+			val = (val << 8) | *p++;
+	} else if (!(major == 7 && info >= 20 && info <= 22)) {
+		return false;
+	}
+
+	switch (major) {
+	case 0:
+		item->type = CB_UINT;
+		item->ival = val;
+		break;
+	case 1:
+		item->type = CB_NEGINT;
+		item->ival = -1 - (int64_t) val;
+		break;
+	case 2:
+	case 3:
+		if (end - p < val)
+			return false;
+		item->type = major == 2? CB_BYTES : CB_TEXT;
+		item->ptr = p;
+		item->len = val;
+		p += val;
+		break;
+	case 4:
+	case 5:
+		item->type = major == 4? CB_ARRAY : CB_MAP;
+		item->count = val;
+		n = major == 4? val : 2 * val;
+		if (n > 64)
+			return false;
+		if (n && !(item->children = calloc(n, sizeof(struct cb_item))))
+			return false;
+		for (i = 0; i < n; i++) {
+			if (!cb_decode_item(&p, end, &item->children[i], depth + 1)) {
+				cb_free(item);
+				return false;
+			}
+		}
+		break;
+	case 7:
+		if (info == 20 || info == 21) {
+			item->type = CB_BOOL;
+			item->ival = info == 21;
+		} else {
+			item->type = CB_NULL;
+		}
+		break;
+	default:
+		return false;
+	}
+
+	item->raw_len = p - item->raw;
+	*pp = p;
+	return true;
+}
+
+static bool
+cb_decode(const unsigned char *data, size_t len, struct cb_item *item)
+{
+	const unsigned char *p = data;
+
+	return cb_decode_item(&p, data + len, item, 0);
+}
+
+static struct cb_item *
+cb_map_get_int(const struct cb_item *map, int64_t key)
+{
+	size_t i;
+
+	if (map == NULL || map->type != CB_MAP)
+		return NULL;
+
+	for (i = 0; i < map->count; i++) {
+		struct cb_item *k = &map->children[2 * i];
+
+		if ((k->type == CB_UINT || k->type == CB_NEGINT) && k->ival == key)
+			return &map->children[2 * i + 1];
+	}
+	return NULL;
+}
+
+static struct cb_item *
+cb_map_get_str(const struct cb_item *map, const char *key)
+{
+	size_t i;
+
+	if (map == NULL || map->type != CB_MAP)
+		return NULL;
+
+	for (i = 0; i < map->count; i++) {
+		struct cb_item *k = &map->children[2 * i];
+
+		if (k->type == CB_TEXT && k->len == strlen(key) && !memcmp(k->ptr, key, k->len))
+			return &map->children[2 * i + 1];
+	}
+	return NULL;
+}
+
+static void
+cb_put_raw(struct cb_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > sizeof(buf->data)) {
+		buf->overflow = true;
+		return;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+cb_put_head(struct cb_buf *buf, unsigned int major, uint64_t val)
+{
+	unsigned char head[9];
+	size_t n = 0, i;
+
+	if (val < 24) {
+		head[n++] = major << 5 | val;
+	} else if (val <= 0xff) {
+		head[n++] = major << 5 | 24;
+		head[n++] = val;
+	} else if (val <= 0xffff) {
+		head[n++] = major << 5 | 25;
+		head[n++] = val >> 8;
+		head[n++] = val;
+	} else {
+		head[n++] = major << 5 | 26;
+		for (i = 0; i < 4; i++)
+			head[n++] = val >> (24 - 8 * i);
+	}
+	cb_put_raw(buf, head, n);
+}
+
+static void
+cb_put_int(struct cb_buf *buf, int64_t val)
+{
+	if (val >= 0)
+		cb_put_head(buf, 0, val);
+	else
+		cb_put_head(buf, 1, -1 - val);
+}
+
+static void
+cb_put_bytes(struct cb_buf *buf, const void *data, size_t len)
+{
+	cb_put_head(buf, 2, len);
+	cb_put_raw(buf, data, len);
+}
+
+static void
+cb_put_text(struct cb_buf *buf, const char *text)
+{
+	cb_put_head(buf, 3, strlen(text));
+	cb_put_raw(buf, text, strlen(text));
+}
+
+static void
+cb_put_array(struct cb_buf *buf, size_t count)
+{
+	cb_put_head(buf, 4, count);
+}
+
+static void
+cb_put_map(struct cb_buf *buf, size_t count)
+{
+	cb_put_head(buf, 5, count);
+}
+
+static void
+cb_put_bool(struct cb_buf *buf, bool val)
+{
+	unsigned char b = val? 0xf5 : 0xf4;
+
+	cb_put_raw(buf, &b, 1);
+}
+
+/*
+ * Authenticator state
+ */
+struct vauth_cred {
+	unsigned char		id[32];
+	unsigned char		rp_id_hash[32];
+	unsigned char		user_id[64];
+	size_t			user_id_len;
+	char			user_name[64];
+	EC_KEY *		key;
+	/* hmac-secret uses different secrets with and without UV */
+	unsigned char		cred_random[2][32];
+};
+
+struct vauth_handle {
+	unsigned char		nonce[8];
+	uint8_t			cmd;
+	unsigned char		response[VAUTH_MAX_MSG];
+	size_t			response_len;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct vauth_config	config;
+	unsigned char		aaguid[16];
+	EC_KEY *		agreement_key;
+	unsigned char		pin_token[32];
+	int			pin_retries;
+	uint32_t		sign_count;
+
+	unsigned int		ncreds;
+	struct vauth_cred	creds[VAUTH_MAX_CREDS];
+
+	/* credential management enumeration */
+	unsigned int		rk_list[VAUTH_MAX_CREDS];
+	unsigned int		rk_count;
+	unsigned int		rk_next;
+} vauth = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+vauth_sleep(int ms)
+{
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+static bool
+ec_point_xy(const EC_KEY *key, const EC_POINT *point, unsigned char *x, unsigned char *y)
+{
+	const EC_GROUP *group = EC_KEY_get0_group(key);
+	BIGNUM *bx = BN_new(), *by = BN_new();
+	bool ok;
+
+	if (point == NULL)
+		point = EC_KEY_get0_public_key(key);
+
+	ok = bx && by
+	  && EC_POINT_get_affine_coordinates(group, point, bx, by, NULL)
+	  && BN_bn2binpad(bx, x, 32) == 32
+	  && BN_bn2binpad(by, y, 32) == 32;
+
+	BN_free(bx);
+	BN_free(by);
+	return ok;
+}
+
+static void
+cb_put_cose_key(struct cb_buf *buf, const EC_KEY *key, int alg)
+{
+	unsigned char x[32], y[32];
+
+	ec_point_xy(key, NULL, x, y);
+
+	cb_put_map(buf, 5);
+	cb_put_int(buf, 1);		/* kty: EC2 */
+	cb_put_int(buf, 2);
+	cb_put_int(buf, 3);		/* alg */
+	cb_put_int(buf, alg);
+	cb_put_int(buf, -1);		/* crv: P-256 */
+	cb_put_int(buf, 1);
+	cb_put_int(buf, -2);
+	cb_put_bytes(buf, x, sizeof(x));
+	cb_put_int(buf, -3);
+	cb_put_bytes(buf, y, sizeof(y));
+}
+
+static EC_KEY *
+ec_key_new(void)
+{
+	EC_KEY *key;
+
+	if ((key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) == NULL)
+		return NULL;
+
+	if (!EC_KEY_generate_key(key)) {
+		EC_KEY_free(key);
+		return NULL;
+	}
+	return key;
+}
+
+/*
+ * PIN protocol 1: the shared secret is SHA-256 of the x coordinate of
+ * the ECDH result between our key agreement key and the platform's.
+ */
+static bool
+vauth_shared_secret(const struct cb_item *cose, unsigned char *shared)
+{
+	const EC_GROUP *group = EC_KEY_get0_group(vauth.agreement_key);
+	struct cb_item *x = cb_map_get_int(cose, -2);
+	struct cb_item *y = cb_map_get_int(cose, -3);
+	unsigned char z[32];
+	EC_POINT *point = NULL;
+	BIGNUM *bx = NULL, *by = NULL;
+	bool ok = false;
+
+	if (!x || !y || x->type != CB_BYTES || y->type != CB_BYTES || x->len != 32 || y->len != 32)
+		return false;
+
+	bx = BN_bin2bn(x->ptr, 32, NULL);
+	by = BN_bin2bn(y->ptr, 32, NULL);
+	point = EC_POINT_new(group);
+	if (!bx || !by || !point
+	 || !EC_POINT_set_affine_coordinates(group, point, bx, by, NULL))
+		goto out;
+
+	if (ECDH_compute_key(z, sizeof(z), point, vauth.agreement_key, NULL) != sizeof(z))
+		goto out;
+
+	SHA256(z, sizeof(z), shared);
+	ok = true;
+
+out:
+	EC_POINT_free(point);
+	BN_free(bx);
+	BN_free(by);
+	return ok;
+}
+
+static bool
+aes256_cbc(const unsigned char *key, const unsigned char *in, size_t len, unsigned char *out, int enc)
+{
+	static const unsigned char iv[16] = { 0 };
+	EVP_CIPHER_CTX *ctx;
+	int n, ok;
+
+	if (len % 16 || !(ctx = EVP_CIPHER_CTX_new()))
+		return false;
+
+	ok = EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, enc)
+	  && EVP_CIPHER_CTX_set_padding(ctx, 0)
+	  && EVP_CipherUpdate(ctx, out, &n, in, len);
+	EVP_CIPHER_CTX_free(ctx);
+	return ok;
+}
+
+static void
+hmac_sha256(const unsigned char *key, size_t key_len, const unsigned char *data, size_t len,
+		unsigned char *md)
+{
+	unsigned int md_len = 32;
+
+	HMAC(EVP_sha256(), key, key_len, data, len, md, &md_len);
+}
+
+/*
+ * Check the pinAuth of a request against the data it authenticates.
+ * Returns CTAP_OK, or an error status.
+ */
+static int
+vauth_check_pin_auth(const struct cb_item *pin_auth, const unsigned char *data, size_t len)
+{
+	unsigned char md[32];
+
+	if (pin_auth == NULL)
+		return vauth.config.pin? CTAP_ERR_PIN_REQUIRED : CTAP_OK;
+
+	if (vauth.config.pin == NULL)
+		return CTAP_ERR_PIN_NOT_SET;
+
+	hmac_sha256(vauth.pin_token, sizeof(vauth.pin_token), data, len, md);
+	if (pin_auth->type != CB_BYTES || pin_auth->len != 16 || memcmp(md, pin_auth->ptr, 16))
+		return CTAP_ERR_PIN_AUTH_INVALID;
+
+	return CTAP_OK;
+}
+
+static int
+vauth_get_info(struct cb_buf *out)
+{
+	cb_put_map(out, 6);
+
+	cb_put_int(out, 1);
+	cb_put_array(out, 2);
+	cb_put_text(out, "FIDO_2_0");
+	cb_put_text(out, "FIDO_2_1_PRE");
+
+	cb_put_int(out, 2);
+	cb_put_array(out, 1);
+	cb_put_text(out, "hmac-secret");
+
+	cb_put_int(out, 3);
+	cb_put_bytes(out, vauth.aaguid, sizeof(vauth.aaguid));
+
+	cb_put_int(out, 4);
+	cb_put_map(out, 5);
+	cb_put_text(out, "rk");
+	cb_put_bool(out, true);
+	cb_put_text(out, "up");
+	cb_put_bool(out, true);
+	cb_put_text(out, "plat");
+	cb_put_bool(out, false);
+	cb_put_text(out, "clientPin");
+	cb_put_bool(out, vauth.config.pin != NULL);
+	cb_put_text(out, "credentialMgmtPreview");
+	cb_put_bool(out, true);
+
+	cb_put_int(out, 5);
+	cb_put_int(out, VAUTH_MAX_MSG);
+
+	cb_put_int(out, 6);
+	cb_put_array(out, 1);
+	cb_put_int(out, 1);
+
+	return CTAP_OK;
+}
+
+static int
+vauth_client_pin(const struct cb_item *req, struct cb_buf *out)
+{
+	struct cb_item *protocol = cb_map_get_int(req, 1);
+	struct cb_item *subcmd = cb_map_get_int(req, 2);
+	struct cb_item *key_agreement, *pin_hash_enc;
+	unsigned char shared[32], pin_hash[32], buf[32];
+
+	if (!protocol || !subcmd || protocol->ival != 1)
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	switch (subcmd->ival) {
+	case 1:		/* getPINRetries */
+		cb_put_map(out, 1);
+		cb_put_int(out, 3);
+		cb_put_int(out, vauth.pin_retries);
+		return CTAP_OK;
+
+	case 2:		/* getKeyAgreement */
+		cb_put_map(out, 1);
+		cb_put_int(out, 1);
+		cb_put_cose_key(out, vauth.agreement_key, -25);
+		return CTAP_OK;
+
+	case 5:		/* getPinToken */
+		if (vauth.config.pin == NULL)
+			return CTAP_ERR_PIN_NOT_SET;
+
+		key_agreement = cb_map_get_int(req, 3);
+		pin_hash_enc = cb_map_get_int(req, 6);
+		if (!key_agreement || !pin_hash_enc || pin_hash_enc->type != CB_BYTES || pin_hash_enc->len != 16)
+			return CTAP_ERR_MISSING_PARAMETER;
+
+		if (!vauth_shared_secret(key_agreement, shared))
+			return CTAP_ERR_INVALID_PARAMETER;
+
+		if (vauth.pin_retries == 0)
+			return CTAP_ERR_PIN_INVALID;
+
+		SHA256((const unsigned char *) vauth.config.pin, strlen(vauth.config.pin), pin_hash);
+		if (!aes256_cbc(shared, pin_hash_enc->ptr, 16, buf, 0) || memcmp(buf, pin_hash, 16)) {
+			vauth.pin_retries--;
+			return CTAP_ERR_PIN_INVALID;
+		}
+		vauth.pin_retries = VAUTH_PIN_RETRIES;
+
+		if (!aes256_cbc(shared, vauth.pin_token, sizeof(vauth.pin_token), buf, 1))
+			return CTAP_ERR_OTHER;
+
+		cb_put_map(out, 1);
+		cb_put_int(out, 2);
+		cb_put_bytes(out, buf, sizeof(buf));
+		return CTAP_OK;
+	}
+
+	return CTAP_ERR_INVALID_COMMAND;
+}
+
+static void
+vauth_put_authdata_head(struct cb_buf *buf, const unsigned char *rp_id_hash, uint8_t flags)
+{
+	unsigned char counter[4];
+	uint32_t count = ++vauth.sign_count;
+
+	counter[0] = count >> 24;
+	counter[1] = count >> 16;
+	counter[2] = count >> 8;
+	counter[3] = count;
+
+	cb_put_raw(buf, rp_id_hash, 32);
+	cb_put_raw(buf, &flags, 1);
+	cb_put_raw(buf, counter, sizeof(counter));
+}
+
+static int
+vauth_make_credential(const struct cb_item *req, struct cb_buf *out)
+{
+	struct cb_item *cdh = cb_map_get_int(req, 1);
+	struct cb_item *rp = cb_map_get_int(req, 2);
+	struct cb_item *user = cb_map_get_int(req, 3);
+	struct cb_item *extensions = cb_map_get_int(req, 6);
+	struct cb_item *rp_id, *user_id, *user_name, *ext;
+	struct vauth_cred *cred = NULL;
+	struct cb_buf *authdata;
+	bool hmac_secret = false;
+	uint8_t flags = AUTHDATA_UP | AUTHDATA_AT;
+	uint16_t id_len = sizeof(cred->id);
+	unsigned char id_len_be[2] = { id_len >> 8, id_len };
+	unsigned int i;
+	int status;
+
+	if (!cdh || !rp || !user || cdh->type != CB_BYTES)
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	rp_id = cb_map_get_str(rp, "id");
+	user_id = cb_map_get_str(user, "id");
+	user_name = cb_map_get_str(user, "name");
+	if (!rp_id || !user_id || rp_id->type != CB_TEXT || user_id->type != CB_BYTES
+	 || user_id->len > sizeof(cred->user_id))
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	status = vauth_check_pin_auth(cb_map_get_int(req, 8), cdh->ptr, cdh->len);
+	if (status != CTAP_OK)
+		return status;
+	if (vauth.config.pin)
+		flags |= AUTHDATA_UV;
+
+	if ((ext = cb_map_get_str(extensions, "hmac-secret")) != NULL && ext->type == CB_BOOL && ext->ival) {
+		hmac_secret = true;
+		flags |= AUTHDATA_ED;
+	}
+
+	/* the user touches the key */
+	vauth_sleep(vauth.config.touch_ms);
+
+	/* A new credential replaces the one for the same RP and user */
+	for (i = 0; i < vauth.ncreds; i++) {
+		unsigned char rp_id_hash[32];
+
+		SHA256(rp_id->ptr, rp_id->len, rp_id_hash);
+		if (!memcmp(vauth.creds[i].rp_id_hash, rp_id_hash, 32)
+		 && vauth.creds[i].user_id_len == user_id->len
+		 && !memcmp(vauth.creds[i].user_id, user_id->ptr, user_id->len)) {
+			cred = &vauth.creds[i];
+			EC_KEY_free(cred->key);
+			break;
+		}
+	}
+
+	if (cred == NULL) {
+		if (vauth.ncreds >= VAUTH_MAX_CREDS)
+			return CTAP_ERR_KEY_STORE_FULL;
+		cred = &vauth.creds[vauth.ncreds++];
+	}
+
+	memset(cred, 0, sizeof(*cred));
+	if (!(cred->key = ec_key_new()))
+		return CTAP_ERR_OTHER;
+	RAND_bytes(cred->id, sizeof(cred->id));
+	RAND_bytes(cred->cred_random[0], sizeof(cred->cred_random[0]));
+	RAND_bytes(cred->cred_random[1], sizeof(cred->cred_random[1]));
+	SHA256(rp_id->ptr, rp_id->len, cred->rp_id_hash);
+	memcpy(cred->user_id, user_id->ptr, user_id->len);
+	cred->user_id_len = user_id->len;
+	if (user_name && user_name->type == CB_TEXT)
+		snprintf(cred->user_name, sizeof(cred->user_name), "%.*s", (int) user_name->len, user_name->ptr);
+
+	if (!(authdata = calloc(1, sizeof(*authdata))))
+		return CTAP_ERR_OTHER;
+
+	vauth_put_authdata_head(authdata, cred->rp_id_hash, flags);
+	cb_put_raw(authdata, vauth.aaguid, sizeof(vauth.aaguid));
+	cb_put_raw(authdata, id_len_be, sizeof(id_len_be));
+	cb_put_raw(authdata, cred->id, sizeof(cred->id));
+	cb_put_cose_key(authdata, cred->key, -7);
+	if (hmac_secret) {
+		cb_put_map(authdata, 1);
+		cb_put_text(authdata, "hmac-secret");
+		cb_put_bool(authdata, true);
+	}
+
+	/* "none" attestation */
+	cb_put_map(out, 3);
+	cb_put_int(out, 1);
+	cb_put_text(out, "none");
+	cb_put_int(out, 2);
+	cb_put_bytes(out, authdata->data, authdata->len);
+	cb_put_int(out, 3);
+	cb_put_map(out, 0);
+
+	status = authdata->overflow? CTAP_ERR_OTHER : CTAP_OK;
+	free(authdata);
+	return status;
+}
+
+static struct vauth_cred *
+vauth_find_cred(const unsigned char *rp_id_hash, const struct cb_item *allow_list)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < vauth.ncreds; i++) {
+		struct vauth_cred *cred = &vauth.creds[i];
+
+		if (memcmp(cred->rp_id_hash, rp_id_hash, 32))
+			continue;
+
+		if (allow_list == NULL || allow_list->count == 0)
+			return cred;
+
+		for (j = 0; j < allow_list->count; j++) {
+			struct cb_item *id = cb_map_get_str(&allow_list->children[j], "id");
+
+			if (id && id->type == CB_BYTES && id->len == sizeof(cred->id)
+			 && !memcmp(id->ptr, cred->id, sizeof(cred->id)))
+				return cred;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * hmac-secret: decrypt the salt(s) with the shared secret, and return
+ * HMAC-SHA-256 of each under the credential's random, encrypted again.
+ */
+static int
+vauth_hmac_secret(const struct cb_item *ext, const struct vauth_cred *cred, bool uv,
+		unsigned char *out, size_t *out_len)
+{
+	struct cb_item *key_agreement = cb_map_get_int(ext, 1);
+	struct cb_item *salt_enc = cb_map_get_int(ext, 2);
+	struct cb_item *salt_auth = cb_map_get_int(ext, 3);
+	unsigned char shared[32], md[32], salt[64], output[64];
+	size_t i;
+
+	if (!key_agreement || !salt_enc || !salt_auth
+	 || salt_enc->type != CB_BYTES || salt_auth->type != CB_BYTES
+	 || (salt_enc->len != 32 && salt_enc->len != 64) || salt_auth->len != 16)
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	if (!vauth_shared_secret(key_agreement, shared))
+		return CTAP_ERR_INVALID_PARAMETER;
+
+	hmac_sha256(shared, sizeof(shared), salt_enc->ptr, salt_enc->len, md);
+	if (memcmp(md, salt_auth->ptr, 16))
+		return CTAP_ERR_PIN_AUTH_INVALID;
+
+	if (!aes256_cbc(shared, salt_enc->ptr, salt_enc->len, salt, 0))
+		return CTAP_ERR_OTHER;
+
+	for (i = 0; i < salt_enc->len; i += 32)
+		hmac_sha256(cred->cred_random[uv], 32, salt + i, 32, output + i);
+
+	if (!aes256_cbc(shared, output, salt_enc->len, out, 1))
+		return CTAP_ERR_OTHER;
+
+	*out_len = salt_enc->len;
+	return CTAP_OK;
+}
+
+static int
+vauth_get_assertion(const struct cb_item *req, struct cb_buf *out)
+{
+	struct cb_item *rp_id = cb_map_get_int(req, 1);
+	struct cb_item *cdh = cb_map_get_int(req, 2);
+	struct cb_item *allow_list = cb_map_get_int(req, 3);
+	struct cb_item *ext = cb_map_get_str(cb_map_get_int(req, 4), "hmac-secret");
+	struct cb_item *up = cb_map_get_str(cb_map_get_int(req, 5), "up");
+	struct cb_item *pin_auth = cb_map_get_int(req, 6);
+	unsigned char rp_id_hash[32], hmac_out[64], digest[32];
+	unsigned char sig[80];
+	unsigned int sig_len = sizeof(sig);
+	size_t hmac_out_len = 0;
+	struct vauth_cred *cred;
+	struct cb_buf *authdata;
+	uint8_t flags = 0;
+	SHA256_CTX sha;
+	int status;
+
+	if (!rp_id || !cdh || rp_id->type != CB_TEXT || cdh->type != CB_BYTES)
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	if (pin_auth) {
+		status = vauth_check_pin_auth(pin_auth, cdh->ptr, cdh->len);
+		if (status != CTAP_OK)
+			return status;
+		flags |= AUTHDATA_UV;
+	}
+
+	SHA256(rp_id->ptr, rp_id->len, rp_id_hash);
+	if ((cred = vauth_find_cred(rp_id_hash, allow_list)) == NULL)
+		return CTAP_ERR_NO_CREDENTIALS;
+
+	if (up == NULL || (up->type == CB_BOOL && up->ival)) {
+		vauth_sleep(vauth.config.touch_ms);
+		flags |= AUTHDATA_UP;
+	}
+
+	if (ext) {
+		status = vauth_hmac_secret(ext, cred, flags & AUTHDATA_UV, hmac_out, &hmac_out_len);
+		if (status != CTAP_OK)
+			return status;
+		flags |= AUTHDATA_ED;
+	}
+
+	if (!(authdata = calloc(1, sizeof(*authdata))))
+		return CTAP_ERR_OTHER;
+
+	vauth_put_authdata_head(authdata, rp_id_hash, flags);
+	if (ext) {
+		cb_put_map(authdata, 1);
+		cb_put_text(authdata, "hmac-secret");
+		cb_put_bytes(authdata, hmac_out, hmac_out_len);
+	}
+
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, authdata->data, authdata->len);
+	SHA256_Update(&sha, cdh->ptr, cdh->len);
+	SHA256_Final(digest, &sha);
+	if (!ECDSA_sign(0, digest, sizeof(digest), sig, &sig_len, cred->key)) {
+		free(authdata);
+		return CTAP_ERR_OTHER;
+	}
+
+	cb_put_map(out, 4);
+	cb_put_int(out, 1);
+	cb_put_map(out, 2);
+	cb_put_text(out, "id");
+	cb_put_bytes(out, cred->id, sizeof(cred->id));
+	cb_put_text(out, "type");
+	cb_put_text(out, "public-key");
+	cb_put_int(out, 2);
+	cb_put_bytes(out, authdata->data, authdata->len);
+	cb_put_int(out, 3);
+	cb_put_bytes(out, sig, sig_len);
+	cb_put_int(out, 4);
+	cb_put_map(out, 2);
+	cb_put_text(out, "id");
+	cb_put_bytes(out, cred->user_id, cred->user_id_len);
+	cb_put_text(out, "name");
+	cb_put_text(out, cred->user_name);
+
+	status = authdata->overflow? CTAP_ERR_OTHER : CTAP_OK;
+	free(authdata);
+	return status;
+}
+
+static void
+vauth_put_rk(struct cb_buf *out, const struct vauth_cred *cred, bool with_total)
+{
+	cb_put_map(out, with_total? 4 : 3);
+
+	cb_put_int(out, 6);
+	cb_put_map(out, 2);
+	cb_put_text(out, "id");
+	cb_put_bytes(out, cred->user_id, cred->user_id_len);
+	cb_put_text(out, "name");
+	cb_put_text(out, cred->user_name);
+
+	cb_put_int(out, 7);
+	cb_put_map(out, 2);
+	cb_put_text(out, "id");
+	cb_put_bytes(out, cred->id, sizeof(cred->id));
+	cb_put_text(out, "type");
+	cb_put_text(out, "public-key");
+
+	cb_put_int(out, 8);
+	cb_put_cose_key(out, cred->key, -7);
+
+	if (with_total) {
+		cb_put_int(out, 9);
+		cb_put_int(out, vauth.rk_count);
+	}
+}
+
+static int
+vauth_cred_mgmt(const struct cb_item *req, struct cb_buf *out)
+{
+	struct cb_item *subcmd = cb_map_get_int(req, 1);
+	struct cb_item *params = cb_map_get_int(req, 2);
+	struct cb_item *rp_id_hash;
+	unsigned char auth_data[1 + VAUTH_MAX_MSG];
+	unsigned int i;
+	int status;
+
+	if (!subcmd || subcmd->type != CB_UINT)
+		return CTAP_ERR_MISSING_PARAMETER;
+
+	/* Everything but GetNext needs the PIN; pinAuth covers the
+	 * subcommand and its parameters. */
+	if (subcmd->ival != 5) {
+		if (vauth.config.pin == NULL)
+			return CTAP_ERR_PIN_NOT_SET;
+
+		auth_data[0] = subcmd->ival;
+		if (params)
+			memcpy(auth_data + 1, params->raw, params->raw_len);
+
+		status = vauth_check_pin_auth(cb_map_get_int(req, 4), auth_data,
+				1 + (params? params->raw_len : 0));
+		if (status != CTAP_OK)
+			return status;
+	}
+
+	switch (subcmd->ival) {
+	case 1:		/* getCredsMetadata */
+		cb_put_map(out, 2);
+		cb_put_int(out, 1);
+		cb_put_int(out, vauth.ncreds);
+		cb_put_int(out, 2);
+		cb_put_int(out, VAUTH_MAX_CREDS - vauth.ncreds);
+		return CTAP_OK;
+
+	case 4:		/* enumerateCredentialsBegin */
+		rp_id_hash = cb_map_get_int(params, 1);
+		if (!rp_id_hash || rp_id_hash->type != CB_BYTES || rp_id_hash->len != 32)
+			return CTAP_ERR_MISSING_PARAMETER;
+
+		vauth.rk_count = vauth.rk_next = 0;
+		for (i = 0; i < vauth.ncreds; i++) {
+			if (!memcmp(vauth.creds[i].rp_id_hash, rp_id_hash->ptr, 32))
+				vauth.rk_list[vauth.rk_count++] = i;
+		}
+
+		if (vauth.rk_count == 0)
+			return CTAP_ERR_NO_CREDENTIALS;
+
+		vauth_put_rk(out, &vauth.creds[vauth.rk_list[vauth.rk_next++]], true);
+		return CTAP_OK;
+
+	case 5:		/* enumerateCredentialsGetNextCredential */
+		if (vauth.rk_next >= vauth.rk_count)
+			return CTAP_ERR_NOT_ALLOWED;
+
+		vauth_put_rk(out, &vauth.creds[vauth.rk_list[vauth.rk_next++]], false);
+		return CTAP_OK;
+	}
+
+	return CTAP_ERR_INVALID_COMMAND;
+}
+
+static void
+vauth_process_cbor(struct vauth_handle *h, const unsigned char *buf, size_t len)
+{
+	struct cb_buf *out;
+	struct cb_item req;
+	bool have_req = false;
+	int status;
+
+	if (!(out = calloc(1, sizeof(*out)))) {
+		h->response[0] = CTAP_ERR_OTHER;
+		h->response_len = 1;
+		return;
+	}
+
+	memset(&req, 0, sizeof(req));
+	if (len == 0) {
+		status = CTAP_ERR_INVALID_LENGTH;
+		goto done;
+	}
+
+	if (len > 1) {
+		if (!cb_decode(buf + 1, len - 1, &req) || req.type != CB_MAP) {
+			status = CTAP_ERR_INVALID_CBOR;
+			goto done;
+		}
+		have_req = true;
+	}
+
+	pthread_mutex_lock(&vauth.lock);
+	switch (buf[0]) {
+	case CTAP_GET_INFO:
+		status = vauth_get_info(out);
+		break;
+	case CTAP_CLIENT_PIN:
+		status = vauth_client_pin(&req, out);
+		break;
+	case CTAP_MAKE_CREDENTIAL:
+		status = vauth_make_credential(&req, out);
+		break;
+	case CTAP_GET_ASSERTION:
+		status = vauth_get_assertion(&req, out);
+		break;
+	case CTAP_CRED_MGMT:
+	case CTAP_CRED_MGMT_PRE:
+		status = vauth_cred_mgmt(&req, out);
+		break;
+	default:
+		status = CTAP_ERR_INVALID_COMMAND;
+	}
+	pthread_mutex_unlock(&vauth.lock);
+
+	if (out->overflow)
+		status = CTAP_ERR_OTHER;
+
+done:
+	if (have_req)
+		cb_free(&req);
+
+	h->response[0] = status;
+	h->response_len = 1;
+	if (status == CTAP_OK) {
+		memcpy(h->response + 1, out->data, out->len);
+		h->response_len += out->len;
+	}
+	free(out);
+}
+
+/*
+ * libfido2 hooks. The HID level read/write functions are never called
+ * once transport functions are set, but libfido2 insists on having them.
+ */
+static void *
+vauth_io_open(const char *path)
+{
+	if (strcmp(path, VAUTH_DEVICE_PATH))
+		return NULL;
+
+	return calloc(1, sizeof(struct vauth_handle));
+}
+
+static void
+vauth_io_close(void *handle)
+{
+	free(handle);
+}
+
+static int
+vauth_io_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	return -1;
+}
+
+static int
+vauth_io_write(void *handle, const unsigned char *buf, size_t len)
+{
+	return -1;
+}
+
+static int
+vauth_tx(fido_dev_t *dev, uint8_t cmd, const unsigned char *buf, size_t len)
+{
+	struct vauth_handle *h = fido_dev_io_handle(dev);
+
+	if (h == NULL)
+		return -1;
+
+	h->cmd = cmd & 0x7f;
+	h->response_len = 0;
+
+	switch (h->cmd) {
+	case CTAPHID_INIT:
+		if (len != sizeof(h->nonce))
+			return -1;
+		memcpy(h->nonce, buf, sizeof(h->nonce));
+		break;
+	case CTAPHID_CBOR:
+		vauth_process_cbor(h, buf, len);
+		break;
+	case CTAPHID_CANCEL:
+		break;
+	default:
+		return -1;
+	}
+
+	return len;
+}
+
+static int
+vauth_rx(fido_dev_t *dev, uint8_t cmd, unsigned char *buf, size_t len, int ms)
+{
+	struct vauth_handle *h = fido_dev_io_handle(dev);
+	unsigned char init[17];
+
+	if (h == NULL || (cmd & 0x7f) != h->cmd)
+		return -1;
+
+	vauth_sleep(vauth.config.latency_ms);
+
+	if (h->cmd == CTAPHID_INIT) {
+		memcpy(init, h->nonce, 8);
+		init[8] = 0x00;		/* channel ID */
+		init[9] = 0x00;
+		init[10] = 0x00;
+		init[11] = 0x01;
+		init[12] = 2;		/* CTAPHID protocol version */
+		init[13] = 1;		/* device version */
+		init[14] = 0;
+		init[15] = 0;
+		init[16] = CTAPHID_CAP_WINK | CTAPHID_CAP_CBOR | CTAPHID_CAP_NMSG;
+		if (len < sizeof(init))
+			return -1;
+		memcpy(buf, init, sizeof(init));
+		return sizeof(init);
+	}
+
+	if (len < h->response_len)
+		return -1;
+
+	memcpy(buf, h->response, h->response_len);
+	return h->response_len;
+}
+
+static const fido_dev_io_t vauth_io = {
+	vauth_io_open,
+	vauth_io_close,
+	vauth_io_read,
+	vauth_io_write,
+};
+
+static const fido_dev_transport_t vauth_transport = {
+	vauth_rx,
+	vauth_tx,
+};
+
+int
+vauth_attach(fido_dev_t *dev)
+{
+	int r;
+
+	if ((r = fido_dev_set_io_functions(dev, &vauth_io)) != FIDO_OK)
+		return r;
+	return fido_dev_set_transport_functions(dev, &vauth_transport);
+}
+
+int
+vauth_dev_info_set(fido_dev_info_t *devlist, size_t i, const char *path)
+{
+	return fido_dev_info_set(devlist, i, path, "fde-tools", "virtual authenticator",
+				 &vauth_io, &vauth_transport);
+}
+
+void
+vauth_reset(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&vauth.lock);
+	for (i = 0; i < vauth.ncreds; i++)
+		EC_KEY_free(vauth.creds[i].key);
+	memset(vauth.creds, 0, sizeof(vauth.creds));
+	vauth.ncreds = 0;
+	vauth.rk_count = vauth.rk_next = 0;
+	pthread_mutex_unlock(&vauth.lock);
+}
+
+void
+vauth_init(const struct vauth_config *config)
+{
+	vauth_reset();
+
+	pthread_mutex_lock(&vauth.lock);
+	vauth.config = *config;
+	vauth.pin_retries = VAUTH_PIN_RETRIES;
+	RAND_bytes(vauth.aaguid, sizeof(vauth.aaguid));
+	RAND_bytes(vauth.pin_token, sizeof(vauth.pin_token));
+	EC_KEY_free(vauth.agreement_key);
+	vauth.agreement_key = ec_key_new();
+	pthread_mutex_unlock(&vauth.lock);
+}
+
+bool
+vauth_cred_id_hex(unsigned int n, char *buf, size_t size)
+{
+	bool ok = false;
+	size_t i;
+
+	pthread_mutex_lock(&vauth.lock);
+	if (n < vauth.ncreds && size > 2 * sizeof(vauth.creds[n].id)) {
+		for (i = 0; i < sizeof(vauth.creds[n].id); i++)
+			sprintf(buf + 2 * i, "%02x", vauth.creds[n].id[i]);
+		ok = true;
+	}
+	pthread_mutex_unlock(&vauth.lock);
+	return ok;
+}
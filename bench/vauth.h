@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FDE_BENCH_VAUTH_H
+#define FDE_BENCH_VAUTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <fido.h>
+
+/* Device path that fde-token should be pointed at with --device. Any
+ * path starting with VAUTH_PATH_PREFIX reaches the same authenticator. */
+#define VAUTH_PATH_PREFIX	"vauth:"
+#define VAUTH_DEVICE_PATH	VAUTH_PATH_PREFIX "0"
+
+struct vauth_config {
+	const char *	pin;		/* NULL if no PIN is set */
+	int		latency_ms;	/* added to every response */
+	int		touch_ms;	/* time the "user" needs to touch the key */
+};
+
+/*
+ * A software CTAP2 authenticator, talking to libfido2 through the custom
+ * transport hooks. It supports resident credentials, PIN protocol 1,
+ * credential management and the hmac-secret extension - just what
+ * fde-token needs.
+ */
+void	vauth_init(const struct vauth_config *config);
+
+/* Forget all credentials, as if the token was reset */
+void	vauth_reset(void);
+
+/* Connect a fido_dev_t to the virtual authenticator before opening it */
+int	vauth_attach(fido_dev_t *dev);
+
+/* Make entry i of a device list describe the virtual device at path */
+int	vauth_dev_info_set(fido_dev_info_t *devlist, size_t i, const char *path);
+
+/* Hex encoded ID of the n-th resident credential */
+bool	vauth_cred_id_hex(unsigned int n, char *buf, size_t size);
+
+#endif /* FDE_BENCH_VAUTH_H */
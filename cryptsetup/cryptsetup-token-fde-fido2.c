@@ -0,0 +1,412 @@
+/*
+ * fde-fido2 LUKS2 token handler
+ *
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * The token records the FIDO2 credential created by "fde-token enroll"
+ * (see "fdectl-grub-tpm2 add --token-type fde-fido2"). Unlocking performs
+ * the same hmac-secret assertion as "fde-token get-secret", in process,
+ * and hands the result to cryptsetup as passphrase.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <json-c/json.h>
+#include <libcryptsetup.h>
+#include <openssl/evp.h>
+#include <fido.h>
+
+#define TOKEN_NAME "fde-fido2"
+#define TOKEN_VERSION_MAJOR "1"
+#define TOKEN_VERSION_MINOR "0"
+
+/* These must match src/fde-token.c */
+#define FDE_FIDO2_RELYING_PARTY	"SUSE FULL DISK ENCRYPTION"
+#define FDE_FIDO2_SALT_LEN	32
+
+#define FDE_MAX_DEVICES		64
+#define FDE_MAX_CRED_ID_LEN	1024
+
+#define l_err(cd, x...) crypt_logf(cd, CRYPT_LOG_ERROR, x)
+#define l_dbg(cd, x...) crypt_logf(cd, CRYPT_LOG_DEBUG, x)
+
+struct fido2_params {
+	unsigned char	cred_id[FDE_MAX_CRED_ID_LEN];
+	size_t		cred_id_len;
+	unsigned char	salt[FDE_FIDO2_SALT_LEN];
+};
+
+const char *
+cryptsetup_token_version(void)
+{
+	return TOKEN_VERSION_MAJOR "." TOKEN_VERSION_MINOR;
+}
+
+static int
+hex_to_bin(const char *hex, unsigned char *buf, size_t size, size_t *len)
+{
+	size_t i, hex_len = strlen(hex);
+
+	if (hex_len == 0 || hex_len % 2 || hex_len / 2 > size)
+		return -EINVAL;
+
+	if (strspn(hex, "0123456789abcdefABCDEF") != hex_len)
+		return -EINVAL;
+
+	for (i = 0; i < hex_len / 2; i++) {
+		unsigned int octet;
+
+		sscanf(hex + 2 * i, "%2x", &octet);
+		buf[i] = octet;
+	}
+
+	*len = hex_len / 2;
+	return 0;
+}
+
+static int
+parse_token(json_object *jobj_token, struct fido2_params *params)
+{
+	json_object *jobj;
+	size_t len;
+
+	memset(params, 0, sizeof(*params));
+
+	if (!json_object_object_get_ex(jobj_token, "fido2-credential", &jobj)
+	 || hex_to_bin(json_object_get_string(jobj), params->cred_id,
+		       sizeof(params->cred_id), &params->cred_id_len) < 0)
+		return -EINVAL;
+
+	/* Tokens enrolled before the salt was recorded use all zeroes */
+	if (json_object_object_get_ex(jobj_token, "fido2-salt", &jobj)) {
+		if (hex_to_bin(json_object_get_string(jobj), params->salt,
+			       sizeof(params->salt), &len) < 0
+		 || len != sizeof(params->salt))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+hash_uuid(const char *uuid, unsigned char *md_buf, unsigned int *md_len)
+{
+	EVP_MD_CTX *mdctx;
+	int ok;
+
+	if (!(mdctx = EVP_MD_CTX_new()))
+		return -ENOMEM;
+
+	ok = EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL)
+	  && EVP_DigestUpdate(mdctx, uuid, strlen(uuid))
+	  && EVP_DigestFinal_ex(mdctx, md_buf, md_len);
+	EVP_MD_CTX_free(mdctx);
+
+	return ok? 0 : -EINVAL;
+}
+
+/*
+ * Check whether the device holds the credential, with an assertion that
+ * needs neither PIN nor user presence. Returns false only if the device
+ * says it does not hold the credential.
+ */
+static bool
+holds_credential(fido_dev_t *dev, const struct fido2_params *params,
+		 const unsigned char *cdh, unsigned int cdh_len)
+{
+	fido_assert_t *assert;
+	int r;
+
+	if (!(assert = fido_assert_new()))
+		return true;
+
+	r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_rp(assert, FDE_FIDO2_RELYING_PARTY);
+	if (r == FIDO_OK)
+		r = fido_assert_allow_cred(assert, params->cred_id, params->cred_id_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_up(assert, FIDO_OPT_FALSE);
+	if (r == FIDO_OK)
+		r = fido_dev_get_assert(dev, assert, NULL);
+
+	fido_assert_free(&assert);
+	return r != FIDO_ERR_NO_CREDENTIALS;
+}
+
+/*
+ * Ask one device for the assertion. Returns -ENOENT if the device does
+ * not hold the credential, and -ENOANO if it needs a (different) PIN.
+ */
+static int
+get_assert(struct crypt_device *cd, const char *dev_path, const struct fido2_params *params,
+	   const unsigned char *cdh, unsigned int cdh_len, const char *pin,
+	   char **password, size_t *password_len)
+{
+	fido_assert_t *assert = NULL;
+	fido_dev_t *dev;
+	int r;
+
+	if (!(dev = fido_dev_new()))
+		return -ENOMEM;
+
+	if ((r = fido_dev_open(dev, dev_path)) != FIDO_OK) {
+		l_dbg(cd, "Unable to open %s: %s", dev_path, fido_strerr(r));
+		r = -ENOENT;
+		goto out;
+	}
+
+	if (!fido_dev_is_fido2(dev)) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	/* fde-token always unlocks with the PIN on tokens that have one,
+	 * and the hmac-secret differs with and without user verification.
+	 * Ask for the PIN before the assertion, which may need a touch, so
+	 * that the user does not have to touch the token twice. */
+	if (pin == NULL && fido_dev_has_pin(dev)) {
+		r = holds_credential(dev, params, cdh, cdh_len)? -ENOANO : -ENOENT;
+		goto out;
+	}
+
+	if (!(assert = fido_assert_new())) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_rp(assert, FDE_FIDO2_RELYING_PARTY);
+	if (r == FIDO_OK)
+		r = fido_assert_allow_cred(assert, params->cred_id, params->cred_id_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_extensions(assert, FIDO_EXT_HMAC_SECRET);
+	if (r == FIDO_OK)
+		r = fido_assert_set_hmac_salt(assert, params->salt, sizeof(params->salt));
+	if (r == FIDO_OK)
+		r = fido_assert_set_up(assert, FIDO_OPT_FALSE);
+	if (r != FIDO_OK) {
+		l_err(cd, "Unable to set up FIDO2 assertion: %s", fido_strerr(r));
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = fido_dev_get_assert(dev, assert, pin);
+	if (r == FIDO_ERR_UP_REQUIRED) {
+		crypt_log(cd, CRYPT_LOG_NORMAL, "Please confirm presence on the FIDO2 token.\n");
+		fido_assert_set_up(assert, FIDO_OPT_TRUE);
+		r = fido_dev_get_assert(dev, assert, pin);
+	}
+
+	switch (r) {
+	case FIDO_OK:
+		break;
+	case FIDO_ERR_NO_CREDENTIALS:
+		l_dbg(cd, "%s does not hold the credential", dev_path);
+		r = -ENOENT;
+		goto out;
+	case FIDO_ERR_PIN_REQUIRED:
+	case FIDO_ERR_PIN_INVALID:
+		r = -ENOANO;
+		goto out;
+	case FIDO_ERR_UV_BLOCKED:
+	case FIDO_ERR_PIN_BLOCKED:
+	case FIDO_ERR_PIN_AUTH_BLOCKED:
+		/* No PIN will do until the token is power cycled or reset */
+		l_err(cd, "The PIN of %s is blocked.", dev_path);
+		r = -EPERM;
+		goto out;
+	default:
+		l_dbg(cd, "Assertion on %s failed: %s", dev_path, fido_strerr(r));
+		r = -EPERM;
+		goto out;
+	}
+
+	if (fido_assert_hmac_secret_len(assert, 0) == 0) {
+		r = -EPERM;
+		goto out;
+	}
+
+	*password_len = fido_assert_hmac_secret_len(assert, 0);
+	if (!(*password = malloc(*password_len))) {
+		r = -ENOMEM;
+		goto out;
+	}
+	memcpy(*password, fido_assert_hmac_secret_ptr(assert, 0), *password_len);
+	r = 0;
+
+out:
+	fido_assert_free(&assert);
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+	return r;
+}
+
+int
+cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pin,
+			  size_t pin_size, char **password, size_t *password_len,
+			  void *usrptr __attribute__((unused)))
+{
+	struct fido2_params params;
+	fido_dev_info_t *devlist = NULL;
+	json_object *jobj_token = NULL;
+	unsigned char cdh[EVP_MAX_MD_SIZE];
+	unsigned int cdh_len;
+	char *pin_str = NULL;
+	const char *json, *uuid;
+	size_t i, ndevs = 0;
+	int r;
+
+	r = crypt_token_json_get(cd, token, &json);
+	if (r < 0)
+		return r;
+
+	if (!(jobj_token = json_tokener_parse(json)))
+		return -EINVAL;
+
+	r = parse_token(jobj_token, &params);
+	json_object_put(jobj_token);
+	if (r < 0) {
+		l_err(cd, "Token %d has malformed FIDO2 parameters.", token);
+		return r;
+	}
+
+	/* fde-token get-secret hashes the UUID as client data */
+	if (!(uuid = crypt_get_uuid(cd))) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if ((r = hash_uuid(uuid, cdh, &cdh_len)) < 0)
+		goto out;
+
+	/* the PIN passed in need not be NUL terminated */
+	if (pin) {
+		if (!(pin_str = malloc(pin_size + 1))) {
+			r = -ENOMEM;
+			goto out;
+		}
+		memcpy(pin_str, pin, pin_size);
+		pin_str[pin_size] = '\0';
+	}
+
+	fido_init(0);
+
+	if (!(devlist = fido_dev_info_new(FDE_MAX_DEVICES))) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (fido_dev_info_manifest(devlist, FDE_MAX_DEVICES, &ndevs) != FIDO_OK) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	/* No device holding the credential means there is nothing to try */
+	r = -ENOENT;
+	for (i = 0; i < ndevs; i++) {
+		const char *dev_path = fido_dev_info_path(fido_dev_info_ptr(devlist, i));
+		int rv;
+
+		rv = get_assert(cd, dev_path, &params, cdh, cdh_len, pin_str,
+				password, password_len);
+		if (rv == -ENOENT)
+			continue;
+
+		r = rv;
+		if (r == 0 || r == -ENOANO)
+			break;
+	}
+
+out:
+	if (devlist)
+		fido_dev_info_free(&devlist, ndevs);
+	if (pin_str) {
+		explicit_bzero(pin_str, pin_size);
+		free(pin_str);
+	}
+	explicit_bzero(&params, sizeof(params));
+	return r;
+}
+
+int
+cryptsetup_token_open(struct crypt_device *cd, int token, char **password,
+		      size_t *password_len, void *usrptr)
+{
+	return cryptsetup_token_open_pin(cd, token, NULL, 0, password,
+					 password_len, usrptr);
+}
+
+void
+cryptsetup_token_dump(struct crypt_device *cd, const char *json)
+{
+	json_object *jobj_token;
+	json_object *jobj;
+	char buf[1024];
+
+	jobj_token = json_tokener_parse(json);
+	if (!jobj_token)
+		return;
+
+	if (json_object_object_get_ex(jobj_token, "fido2-credential", &jobj)
+	 && snprintf(buf, sizeof(buf) - 1, "\tfido2-credential: %s\n",
+		     json_object_get_string(jobj)) > 0)
+		crypt_log(cd, CRYPT_LOG_NORMAL, buf);
+
+	if (json_object_object_get_ex(jobj_token, "fido2-aaguid", &jobj)
+	 && snprintf(buf, sizeof(buf) - 1, "\tfido2-aaguid: %s\n",
+		     json_object_get_string(jobj)) > 0)
+		crypt_log(cd, CRYPT_LOG_NORMAL, buf);
+
+	if (json_object_object_get_ex(jobj_token, "timestamp", &jobj)
+	 && snprintf(buf, sizeof(buf) - 1, "\ttimestamp:  %s\n",
+		     json_object_get_string(jobj)) > 0)
+		crypt_log(cd, CRYPT_LOG_NORMAL, buf);
+
+	json_object_put(jobj_token);
+}
+
+int
+cryptsetup_token_validate(struct crypt_device *cd __attribute__((unused)),
+			  const char *json)
+{
+	enum json_tokener_error jerr;
+	struct fido2_params params;
+	json_object *jobj_token;
+	int r;
+
+	jobj_token = json_tokener_parse_verbose(json, &jerr);
+	if (!jobj_token)
+		return -EINVAL;
+
+	r = parse_token(jobj_token, &params);
+	json_object_put(jobj_token);
+	return r;
+}
+
+void
+cryptsetup_token_buffer_free(void *buffer, size_t buffer_len)
+{
+	if (buffer) {
+		explicit_bzero(buffer, buffer_len);
+		free(buffer);
+	}
+}
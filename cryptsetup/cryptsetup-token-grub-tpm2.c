@@ -16,12 +16,25 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this file; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * After grub has unsealed the key of a grub-tpm2 keyslot and unlocked the
+ * device with it, it can hand the key to the initrd in a volatile EFI
+ * variable named FdeUnlockKey-<LUKS UUID>, so that the device is not
+ * unlocked with a second TPM unseal or a prompt. Unlocking consumes the
+ * variable: it is deleted once the key has been found to open a keyslot
+ * of the token being opened.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include <json-c/json.h>
 #include <libcryptsetup.h>
 
@@ -29,22 +42,173 @@
 #define TOKEN_VERSION_MAJOR "1"
 #define TOKEN_VERSION_MINOR "0"
 
+#define EFIVARFS_PATH		"/sys/firmware/efi/efivars"
+/* Vendor GUID of the key handoff variables; grub must use the same */
+#define FDE_HANDOFF_GUID	"c2b8f2a7-5d51-4f2b-9d2e-5f3e1a8b6c04"
+#define FDE_HANDOFF_NAME	"FdeUnlockKey"
+/* The largest key fdectl-grub-tpm2 genkey creates */
+#define FDE_HANDOFF_MAX_KEY	256
+
+#define EFI_VARIABLE_NON_VOLATILE	0x00000001
+#define EFI_VARIABLE_BOOTSERVICE_ACCESS	0x00000002
+#define EFI_VARIABLE_RUNTIME_ACCESS	0x00000004
+
+#define l_err(cd, x...) crypt_logf(cd, CRYPT_LOG_ERROR, x)
+#define l_dbg(cd, x...) crypt_logf(cd, CRYPT_LOG_DEBUG, x)
+
 const char *
 cryptsetup_token_version(void)
 {
 	return TOKEN_VERSION_MAJOR "." TOKEN_VERSION_MINOR;
 }
 
+/*
+ * efivarfs refuses to delete immutable files. Variables of unknown
+ * vendors are not immutable by default, but do not count on it.
+ */
+static int
+efivar_unlink(const char *path)
+{
+	int fd, flags;
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+		if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL)) {
+			flags &= ~FS_IMMUTABLE_FL;
+			(void) ioctl(fd, FS_IOC_SETFLAGS, &flags);
+		}
+		close(fd);
+	}
+
+	return unlink(path) < 0? -errno : 0;
+}
+
+/*
+ * Check whether key opens one of the keyslots assigned to token. The
+ * keyslots of grub-tpm2 tokens use the minimal PBKDF, so trying them
+ * all is cheap.
+ */
+static int
+token_keyslot_matches(struct crypt_device *cd, int token, const char *key, size_t key_len)
+{
+	json_object *jobj_token, *jobj_keyslots;
+	const char *json;
+	size_t i;
+	int keyslot, r = -ENOENT;
+
+	if (crypt_token_json_get(cd, token, &json) < 0)
+		return -ENOENT;
+	if (!(jobj_token = json_tokener_parse(json)))
+		return -EINVAL;
+
+	if (json_object_object_get_ex(jobj_token, "keyslots", &jobj_keyslots)) {
+		for (i = 0; i < json_object_array_length(jobj_keyslots); i++) {
+			keyslot = atoi(json_object_get_string(json_object_array_get_idx(jobj_keyslots, i)));
+			if (crypt_activate_by_passphrase(cd, NULL, keyslot, key, key_len, 0) >= 0) {
+				r = keyslot;
+				break;
+			}
+		}
+	}
+
+	json_object_put(jobj_token);
+	return r;
+}
+
+/*
+ * Read the key grub left for this device, and delete the variable if
+ * the key opens a keyslot of token. A key for another grub-tpm2 token
+ * of the device stays for that token. Keys that nobody used, whether
+ * the device was unlocked by other means or the content is not usable,
+ * are deleted by fde-handoff-cleanup.
+ */
+static int
+read_handoff_key(struct crypt_device *cd, int token, char **key, size_t *key_len)
+{
+	/* efivarfs prefixes the data with the 32 bit attributes */
+	unsigned char buf[sizeof(uint32_t) + FDE_HANDOFF_MAX_KEY + 1];
+	const char *uuid;
+	char path[256];
+	uint32_t attrs;
+	ssize_t n;
+	int fd, r;
+
+	if (!(uuid = crypt_get_uuid(cd)))
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), EFIVARFS_PATH "/" FDE_HANDOFF_NAME "-%s-" FDE_HANDOFF_GUID, uuid);
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		r = -errno;
+		if (r != -ENOENT)
+			l_dbg(cd, "Cannot open %s: %s", path, strerror(-r));
+		return -ENOENT;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if (n < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	r = -EINVAL;
+	if (n <= (ssize_t) sizeof(attrs) || n > (ssize_t) (sizeof(attrs) + FDE_HANDOFF_MAX_KEY)) {
+		l_dbg(cd, "Ignoring %s: bad size", path);
+		goto out;
+	}
+
+	/* A key that survives reboots or is invisible to the OS is not ours */
+	memcpy(&attrs, buf, sizeof(attrs));
+	if ((attrs & EFI_VARIABLE_NON_VOLATILE)
+	 || !(attrs & EFI_VARIABLE_BOOTSERVICE_ACCESS)
+	 || !(attrs & EFI_VARIABLE_RUNTIME_ACCESS)) {
+		l_dbg(cd, "Ignoring %s: unexpected attributes 0x%x", path, attrs);
+		goto out;
+	}
+
+	r = token_keyslot_matches(cd, token, (char *) buf + sizeof(attrs), n - sizeof(attrs));
+	if (r < 0) {
+		l_dbg(cd, "Key in %s does not open a keyslot of token %d", path, token);
+		r = -ENOENT;
+		goto out;
+	}
+	l_dbg(cd, "Key in %s opens keyslot %d", path, r);
+
+	if ((r = efivar_unlink(path)) < 0)
+		l_err(cd, "Cannot delete %s: %s", path, strerror(-r));
+
+	*key_len = n - sizeof(attrs);
+	if (!(*key = malloc(*key_len))) {
+		r = -ENOMEM;
+		goto out;
+	}
+	memcpy(*key, buf + sizeof(attrs), *key_len);
+	r = 0;
+
+out:
+	explicit_bzero(buf, sizeof(buf));
+	return r;
+}
+
 int
-cryptsetup_token_open_pin(struct crypt_device *cd __attribute__((unused)),
-			  int token __attribute__((unused)),
+cryptsetup_token_open_pin(struct crypt_device *cd,
+			  int token,
 			  const char *pin __attribute__((unused)),
 			  size_t pin_size __attribute__((unused)),
-			  char **password __attribute__((unused)),
-			  size_t *password_len __attribute__((unused)),
+			  char **password,
+			  size_t *password_len,
 			  void *usrptr __attribute__((unused)))
 {
-	return -ENOTSUP;
+	int r;
+
+	r = read_handoff_key(cd, token, password, password_len);
+	if (r == 0)
+		l_dbg(cd, "Using the key handed over by grub for token %d", token);
+	else if (r == -ENOENT)
+		l_dbg(cd, "No key handed over by grub for token %d", token);
+
+	/* Without a key from grub, the token cannot unlock anything on its own */
+	return r == 0? 0 : -ENOENT;
 }
 
 int
@@ -90,8 +254,10 @@ cryptsetup_token_validate(struct crypt_device *cd __attribute__((unused)),
 }
 
 void
-cryptsetup_token_buffer_free (void *buffer __attribute__((unused)),
-			      size_t buffer_len __attribute__((unused)))
+cryptsetup_token_buffer_free (void *buffer, size_t buffer_len)
 {
-
+	if (buffer) {
+		explicit_bzero(buffer, buffer_len);
+		free(buffer);
+	}
 }
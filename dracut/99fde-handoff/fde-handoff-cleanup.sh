@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+#   Copyright (C) 2022, 2023 SUSE LLC
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+#
+
+##################################################################
+# Delete the keys grub handed over to the initrd. A grub-tpm2
+# token deletes the variable once its key opened a keyslot, but if
+# a device was unlocked by other means, or the key opened nothing,
+# the variable would stay readable for every user until the next
+# reboot.
+##################################################################
+for var in /sys/firmware/efi/efivars/FdeUnlockKey-*-c2b8f2a7-5d51-4f2b-9d2e-5f3e1a8b6c04; do
+    test -e "$var" || continue
+
+    # efivarfs marks most variables immutable
+    chattr -i "$var" 2>/dev/null
+    if ! rm -f "$var"; then
+	echo "Unable to delete $var" >&2
+	exit 1
+    fi
+done
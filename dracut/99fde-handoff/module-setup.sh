@@ -0,0 +1,39 @@
+#!/bin/bash
+#
+#   Copyright (C) 2022, 2023 SUSE LLC
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+#
+
+##################################################################
+# Include this module whenever fde-tools is installed: grub may
+# hand over unlock keys in EFI variables on any system, and they
+# have to go before the real root is running.
+##################################################################
+check() {
+    return 0
+}
+
+depends() {
+    echo systemd
+}
+
+install() {
+    inst_multiple chattr rm
+    inst_script "$moddir/fde-handoff-cleanup.sh" /usr/bin/fde-handoff-cleanup
+    inst_simple "$moddir/fde-handoff-cleanup.service" \
+	"$systemdsystemunitdir/fde-handoff-cleanup.service"
+    $SYSTEMCTL -q --root "$initdir" add-wants initrd.target fde-handoff-cleanup.service
+}
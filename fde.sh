@@ -30,6 +30,8 @@ opt_ui=shell
 opt_keyfile=""
 opt_password=""
 opt_passfile=""
+opt_root=""
+opt_luks_devices=""
 
 ##################################################################
 # Display a usage message.
@@ -51,6 +53,19 @@ Global options:
 	Specify the partition to operate on. Can be a device
 	name or a mount point. Defaults to the current root
 	device.
+  --root
+	Operate on the system image mounted at this directory
+	from the host, rather than by running fdectl in a chroot.
+  --luks-device
+	Specify the LUKS device, image file or detached header
+	to operate on, rather than discovering it. May be given
+	more than once; the first one is the root volume.
+  --image
+	Run the command on the system image ROOT:DEVICE, as with
+	--root ROOT --luks-device DEVICE. May be given more than
+	once; the images are processed in parallel.
+  --jobs
+	Process at most this many images at a time [number of CPUs].
   --bootloader
 	Specify the boot loader being used [grub2].
   --uefi-boot-dir
@@ -123,9 +138,71 @@ function fde_maybe_chroot {
     fi
 }
 
+##################################################################
+# Process several system images with one command line: fork one
+# fdectl --root ROOT --luks-device DEVICE per --image ROOT:DEVICE,
+# with at most --jobs of them running at a time.
+##################################################################
+function fde_maybe_run_images {
+
+    declare -a A images
+    local jobs image root device running=0 failed=0
+
+    jobs=$(nproc)
+    while [ $# -gt 0 ]; do
+	arg=$1; shift
+	if [ "$arg" = "--image" ]; then
+	    images+=("$1"); shift 1
+	elif [ "$arg" = "--jobs" ]; then
+	    jobs=$1; shift 1
+	else
+	    A+=("$arg")
+	fi
+    done
+
+    if [ ${#images[@]} -eq 0 ]; then
+	return 0
+    fi
+
+    for image in "${images[@]}"; do
+	root=${image%%:*}
+	device=${image#*:}
+	if [ "$root" = "$image" -o -z "$root" -o -z "$device" ]; then
+	    echo "Error: --image expects ROOT:DEVICE, not \"$image\"" >&2
+	    exit 2
+	fi
+
+	if [ $running -ge $jobs ]; then
+	    wait -n || ((failed++))
+	    ((running--))
+	fi
+
+	# Nobody can answer a prompt for all images at once; pass the
+	# recovery password with --password or --passfile.
+	(
+	    set -o pipefail
+	    "$0" --root "$root" --luks-device "$device" "${A[@]}" < /dev/null 2>&1 |
+		sed -u "s|^|$root: |"
+	) &
+	((running++))
+    done
+
+    while [ $running -gt 0 ]; do
+	wait -n || ((failed++))
+	((running--))
+    done
+
+    if [ $failed -ne 0 ]; then
+	echo "fdectl failed on $failed of ${#images[@]} images" >&2
+	exit 1
+    fi
+    exit 0
+}
+
 fde_maybe_chroot "$@"
+fde_maybe_run_images "$@"
 
-long_options="help,version,bootloader:,device:,use-dialog,keyfile:,uefi-boot-dir:,password:,passfile:"
+long_options="help,version,bootloader:,device:,use-dialog,keyfile:,uefi-boot-dir:,password:,passfile:,root:,luks-device:,jobs:"
 
 if ! getopt -Q -n fdectl -l "$long_options" -o h -- "$@"; then
     fde_usage
@@ -154,6 +231,9 @@ while [ $# -gt 0 ]; do
 	# We should have handled --device in fde_maybe_chroot above
 	fde_bad_option "The --device option should never show up at this point"
 	shift;;
+    --jobs)
+	# Only meaningful with --image, see fde_maybe_run_images
+	shift;;
     --use-dialog)
     	opt_ui=dialog;;
     --keyfile)
@@ -164,6 +244,10 @@ while [ $# -gt 0 ]; do
 	opt_passfile=$1; shift;;
     --uefi-boot-dir)
 	opt_uefi_bootdir=$1; shift;;
+    --root)
+	opt_root=$1; shift;;
+    --luks-device)
+	opt_luks_devices+="${opt_luks_devices:+ }$1"; shift;;
     *)
     	fde_bad_option "Unsupported option $next";;
     esac
@@ -187,36 +271,64 @@ if [ "$opt_bootloader" != "grub2" -a "$opt_bootloader" != "systemd-boot" ]; then
     fde_bad_argument "Unsupported boot loader \"$opt_bootloader\""
 fi
 
+# Image mode: configuration, keys and the ESP are found below
+# FDE_ROOT rather than in the host system.
+FDE_ROOT=
+if [ -n "$opt_root" ]; then
+    if [ ! -d "$opt_root" ]; then
+	fde_bad_argument "$opt_root is not a directory"
+    fi
+    FDE_ROOT=$(realpath "$opt_root")
+    if [ "$FDE_ROOT" = "/" ]; then
+	FDE_ROOT=
+    fi
+fi
+
 trap fde_clean_tempdir 0 1 2 11 15
 
+# Header journals of fdectl-grub-tpm2 are tied to this run, so that a
+# journal left behind by an interrupted run is never taken for ours
+read -r FDE_JOURNAL_ID < /proc/sys/kernel/random/uuid
+export FDE_JOURNAL_ID
+
 . "$SHAREDIR/luks"
 . "$SHAREDIR/uefi"
 if [ -n "$opt_uefi_bootdir" ]; then
     uefi_set_loader "$opt_uefi_bootdir"
 fi
 
-FDE_CONFIG_DIR=/etc/fde
+FDE_CONFIG_DIR=$FDE_ROOT/etc/fde
 
-. /etc/sysconfig/fde-tools
+. "$FDE_ROOT/etc/sysconfig/fde-tools"
 . "$SHAREDIR/ui/$opt_ui"
 . "$SHAREDIR/util"
 . "$SHAREDIR/tpm"
 . "$SHAREDIR/$opt_bootloader"
 . "$SHAREDIR/commands/$command"
 
-if cmd_requires_luks_device; then
+# Commands define cmd_perform as an alias, which only expands where
+# it is written out, not when fde_span runs it
+function fde_perform {
+
+    cmd_perform "$@"
+}
+
+if cmd_requires_luks_device && [ -n "$opt_luks_devices" ]; then
+    # The caller told us which devices to use; FDE_DEVS names devices
+    # of the system the configuration belongs to, which may not be
+    # this one.
+    luks_dev=${opt_luks_devices%% *}
+    FDE_EXTRA_DEVS=$(tr -s ' ' '\n' <<<"${opt_luks_devices#$luks_dev}" | sed '/^$/d' | sort -u | grep -vxF "$luks_dev")
+
+    fde_span "fdectl $command" fde_perform "$luks_dev"
+elif cmd_requires_luks_device; then
     # Merge FDE_EXTRA_DEVS into FDE_DEVS and unset FDE_EXTRA_DEVS
     FDE_DEVS="${FDE_DEVS} ${FDE_EXTRA_DEVS}"
     FDE_EXTRA_DEVS=""
 
-    fsdev=$(luks_device_for_path /)
-    if [ ! -b "$fsdev" ]; then
-	fde_bad_argument "Unable to determine partition to operate on"
-    fi
-
-    luks_devices=$(luks_get_volume_for_fsdev "$fsdev")
+    luks_devices=$(fde_span "discover LUKS devices" luks_get_volume_for_fsdev "${FDE_ROOT:-/}")
     if [ -z "$luks_devices" ]; then
-	display_errorbox "Cannot find the underlying partition for $fsdev"
+	display_errorbox "Cannot find the underlying partition for the root file system"
 	exit 1
     fi
 
@@ -228,7 +340,7 @@ if cmd_requires_luks_device; then
     luks_dev=$(head -n 1 <<<${luks_devices})
     FDE_EXTRA_DEVS=$(grep -v "${luks_dev}" <<<${luks_devices})
 
-    cmd_perform "$luks_dev"
+    fde_span "fdectl $command" fde_perform "$luks_dev"
 else
-    cmd_perform
+    fde_span "fdectl $command" fde_perform
 fi
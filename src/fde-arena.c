@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * A small locked arena for secrets, see fde-arena.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fde-arena.h"
+
+#define CHUNK_FREE	0x0001
+#define CHUNK_MAPPED	0x0002	/* has a mapping of its own */
+
+#define CHUNK_ALIGN	16
+
+/* Allocations larger than this do not go into the arena */
+#define CHUNK_MAX	(FDE_ARENA_SIZE / 4)
+
+struct chunk {
+	size_t		size;	/* of the payload */
+	size_t		flags;
+} __attribute__((aligned(CHUNK_ALIGN)));
+
+static struct {
+	unsigned char *	base;
+	size_t		size;
+	size_t		page_size;
+} arena;
+
+static size_t
+round_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+static struct chunk *
+next_chunk(struct chunk *c)
+{
+	return (struct chunk *) ((unsigned char *) (c + 1) + c->size);
+}
+
+static bool
+in_arena(const struct chunk *c)
+{
+	return (const unsigned char *) c < arena.base + arena.size;
+}
+
+/*
+ * Map a region with a guard page on either side. The region is locked
+ * into memory if the RLIMIT_MEMLOCK permits; if it does not, we still
+ * keep the secrets out of core dumps.
+ */
+static void *
+map_guarded(size_t size)
+{
+	size_t page_size = arena.page_size;
+	unsigned char *map;
+
+	map = mmap(NULL, size + 2 * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (mprotect(map + page_size, size, PROT_READ | PROT_WRITE) < 0) {
+		munmap(map, size + 2 * page_size);
+		return NULL;
+	}
+
+	(void) mlock(map + page_size, size);
+	(void) madvise(map + page_size, size, MADV_DONTDUMP);
+
+	return map + page_size;
+}
+
+static void
+unmap_guarded(void *ptr, size_t size)
+{
+	munmap((unsigned char *) ptr - arena.page_size, size + 2 * arena.page_size);
+}
+
+static bool
+arena_init(void)
+{
+	struct chunk *c;
+
+	if (arena.base)
+		return true;
+
+	arena.page_size = sysconf(_SC_PAGESIZE);
+	arena.size = round_up(FDE_ARENA_SIZE, arena.page_size);
+
+	arena.base = map_guarded(arena.size);
+	if (arena.base == NULL)
+		return false;
+
+	c = (struct chunk *) arena.base;
+	c->size = arena.size - sizeof(*c);
+	c->flags = CHUNK_FREE;
+	return true;
+}
+
+static void *
+alloc_mapped(size_t size)
+{
+	size_t map_size;
+	struct chunk *c;
+
+	map_size = round_up(sizeof(*c) + size, arena.page_size);
+	if ((c = map_guarded(map_size)) == NULL)
+		return NULL;
+
+	c->size = map_size - sizeof(*c);
+	c->flags = CHUNK_MAPPED;
+	return c + 1;
+}
+
+void *
+fde_arena_alloc(size_t size)
+{
+	struct chunk *c, *rest;
+
+	if (!arena_init())
+		return NULL;
+
+	size = round_up(size ? size : 1, CHUNK_ALIGN);
+	if (size > CHUNK_MAX)
+		return alloc_mapped(size);
+
+	/* first fit */
+	for (c = (struct chunk *) arena.base; in_arena(c); c = next_chunk(c)) {
+		if (!(c->flags & CHUNK_FREE) || c->size < size)
+			continue;
+
+		/* split off the remainder if it is worth it */
+		if (c->size >= size + sizeof(*c) + CHUNK_ALIGN) {
+			rest = (struct chunk *) ((unsigned char *) (c + 1) + size);
+			rest->size = c->size - size - sizeof(*c);
+			rest->flags = CHUNK_FREE;
+			c->size = size;
+		}
+
+		c->flags = 0;
+		return c + 1;
+	}
+
+	/* Arena is full; this should not happen with the handful of
+	 * secrets we deal with, but do not fail either. */
+	return alloc_mapped(size);
+}
+
+char *
+fde_arena_strdup(const char *s)
+{
+	size_t len = strlen(s);
+	char *copy;
+
+	if ((copy = fde_arena_alloc(len + 1)) != NULL)
+		memcpy(copy, s, len + 1);
+	return copy;
+}
+
+void
+fde_arena_free(void *ptr)
+{
+	struct chunk *c, *next;
+
+	if (ptr == NULL)
+		return;
+
+	c = (struct chunk *) ptr - 1;
+	explicit_bzero(ptr, c->size);
+
+	if (c->flags & CHUNK_MAPPED) {
+		unmap_guarded(c, c->size + sizeof(*c));
+		return;
+	}
+
+	c->flags = CHUNK_FREE;
+
+	/* coalesce adjacent free chunks */
+	for (c = (struct chunk *) arena.base; in_arena(c); c = next_chunk(c)) {
+		if (!(c->flags & CHUNK_FREE))
+			continue;
+
+		while (in_arena(next = next_chunk(c)) && (next->flags & CHUNK_FREE)) {
+			c->size += sizeof(*next) + next->size;
+			explicit_bzero(next, sizeof(*next));
+		}
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FDE_ARENA_H
+#define FDE_ARENA_H
+
+#include <stddef.h>
+
+/* Size of the locked region shared by all small allocations */
+#define FDE_ARENA_SIZE		(64 * 1024)
+
+/*
+ * Allocator for key material, PINs and other secrets.
+ *
+ * Small allocations are carved out of a single region per process that
+ * is locked into memory, excluded from core dumps and surrounded by
+ * guard pages. Allocations too large for the arena get a locked,
+ * guarded mapping of their own. Memory is zeroed with explicit_bzero
+ * when it is released.
+ *
+ * The allocator is not thread safe; secrets must be allocated and
+ * released from a single thread.
+ *
+ * fde_arena_alloc returns zero-filled memory, or NULL if no memory is
+ * available.
+ */
+void *	fde_arena_alloc(size_t size);
+char *	fde_arena_strdup(const char *s);
+void	fde_arena_free(void *ptr);
+
+#endif /* FDE_ARENA_H */
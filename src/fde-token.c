@@ -22,23 +22,68 @@
  * Written by Olaf Kirch <okir@suse.com>
  */
 
+#define _GNU_SOURCE
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/keyctl.h>
+#include <sys/random.h>
 #include <fido.h>
 #include <fido/credman.h>
 #include <fido/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include "udev-wait.h"
+#include "fde-arena.h"
+#include "fde-trace.h"
 
 #define FDE_FIDO2_CHALLENGE		"SUSE FDE CHALLENGE"
 #define FDE_FIDO2_RELYING_PARTY		"SUSE FULL DISK ENCRYPTION"
 #define FDE_FIDO2_USER_NAME		"Ruth the Ruthless SysAdmin"
 #define FDE_FIDO2_USER_ID		"root"
 
+/* Where to cache the capabilities of FIDO2 devices */
+#define FDE_TOKEN_CACHE_DIR		"/run/fde-token"
+
+/* How long to wait for a device to respond while probing */
+#define FDE_PROBE_TIMEOUT_MS		2000
+#define FDE_MAX_DEVICES			64
+
+/* HKDF info prefix for per-volume secrets in batch mode */
+#define FDE_VOLUME_KEY_INFO		"SUSE FDE VOLUME KEY "
+#define FDE_VOLUME_KEY_LEN		32
+#define FDE_MAX_BATCH			256
+
+/* Seconds after which keys placed in the kernel keyring expire */
+#define FDE_KEYRING_TIMEOUT		60
+
+/* How often to ask for the PIN before giving up */
+#define FDE_MAX_PIN_PROMPTS		3
+
+/* Size of the salt passed to the hmac-secret extension */
+#define FDE_FIDO2_SALT_LEN		32
+
 enum {
 	OPT_NO_PROMPT,
+	OPT_CREDENTIAL,
+	OPT_SALT,
+	OPT_BATCH,
+	OPT_KEYRING,
+	OPT_KEYRING_TIMEOUT,
+	OPT_MEMFD,
+	OPT_ALL,
 };
 
 static struct option	options[] = {
@@ -46,6 +91,14 @@ static struct option	options[] = {
 	{ "output",	required_argument,	NULL,	'o' },
 	{ "pin",	required_argument,	NULL,	'P' },
 	{ "no-prompt",	no_argument,		NULL,	OPT_NO_PROMPT },
+	{ "wait",	required_argument,	NULL,	'w' },
+	{ "credential",	required_argument,	NULL,	OPT_CREDENTIAL },
+	{ "salt",	required_argument,	NULL,	OPT_SALT },
+	{ "batch",	no_argument,		NULL,	OPT_BATCH },
+	{ "keyring",	required_argument,	NULL,	OPT_KEYRING },
+	{ "keyring-timeout", required_argument,	NULL,	OPT_KEYRING_TIMEOUT },
+	{ "memfd",	required_argument,	NULL,	OPT_MEMFD },
+	{ "all",	no_argument,		NULL,	OPT_ALL },
 	{ "quiet",	no_argument,		NULL,	'q' },
 	{ "debug",	no_argument,		NULL,	'd' },
 	{ "help",	no_argument,		NULL,	'h' },
@@ -63,6 +116,12 @@ struct fde_params {
 	bool			allow_prompt;	/* default true */
 	int			pin_fd;		/* not used yet */
 	char *			pin;
+	int			wait_timeout;	/* seconds; default 0 */
+};
+
+struct fde_dev_info {
+	bool			valid;
+	bool			hmac_secret;
 };
 
 struct fde_token {
@@ -70,10 +129,22 @@ struct fde_token {
 
 	char *			device_path;
 	fido_dev_t *		dev;
+	struct fde_dev_info	info;
+
+	/* The PIN is obtained once per device and kept for the session.
+	 * It is only ever handed to the device it was entered for, since
+	 * a wrong PIN uses up one of the retries of a token. */
 	char *			pin;
+	char *			pin_device;
+	unsigned int		pin_prompts;
 
 	const fido_credman_rk_t *rk;
 	struct fde_blob		cred_id;
+	struct fde_blob		salt;
+
+	/* used when probing devices for a known credential */
+	const char *		uuid;
+	struct fde_blob		secret;
 };
 
 #define debug(msg ...) \
@@ -87,12 +158,27 @@ static void	fatal(const char *fmt, ...);
 static void	fde_token_init(struct fde_token *token);
 static int	fde_token_discover_devices(struct fde_token *token);
 static int	fde_token_check_devices(struct fde_token *token);
-static int	fde_token_enroll(struct fde_token *token);
+static void	fde_token_clear_pin(struct fde_token *token);
+static int	fde_token_enroll(struct fde_token *token, const char *uuid, struct fde_blob *secret);
+static int	fde_token_enroll_all(struct fde_token *token, const char *uuid);
 static bool	fde_token_discover_fresh_device(struct fde_token *token);
 static bool	fde_token_discover_credential(struct fde_token *token);
+static bool	fde_token_discover_secret(struct fde_token *token, const char *uuid, struct fde_blob *secret);
 static bool	fde_token_get_secret(struct fde_token *token, const char *uuid, struct fde_blob *secret);
 static bool	fde_token_write_key(const struct fde_blob *secret, const char *key_file);
+static bool	fde_token_write_keys(const struct fde_blob *secrets, unsigned int count, bool batch, const char *key_file);
+static bool	fde_token_write_keyring(const struct fde_blob *secrets, char * const *uuids, unsigned int count,
+				bool batch, const char *description, int timeout);
+static bool	fde_token_exec_memfd(const struct fde_blob *secrets, unsigned int count, bool batch, const char *command);
+static bool	fde_derive_volume_secret(const struct fde_blob *master, const char *uuid, struct fde_blob *secret);
 static void	fde_blob_clear(struct fde_blob *blob);
+static bool	fde_blob_set_hex(struct fde_blob *blob, const char *hex);
+
+/* A benchmark or test harness may provide these to connect devices to a
+ * virtual authenticator, using fido_dev_set_io_functions(), and to list
+ * virtual devices in place of the real ones */
+extern void	fde_token_dev_setup(fido_dev_t *dev, const char *path) __attribute__((weak));
+extern int	fde_token_dev_manifest(fido_dev_info_t *devlist, size_t ilen, size_t *olen) __attribute__((weak));
 
 static bool	opt_debug = false;
 static bool	opt_quiet = false;
@@ -102,12 +188,18 @@ main(int argc, char **argv)
 {
 	struct fde_token token;
 	char *opt_key_file = NULL;
+	char *opt_keyring = NULL;
+	char *opt_memfd = NULL;
+	int opt_keyring_timeout = FDE_KEYRING_TIMEOUT;
 	const char *verb;
 	struct fde_blob secret;
+	bool opt_batch = false;
+	bool opt_all = false;
 	int c;
 
 	fde_token_init(&token);
-	while ((c = getopt_long(argc, argv, "dhqD:o:P:", options, NULL)) != -1) {
+	memset(&secret, 0, sizeof(secret));
+	while ((c = getopt_long(argc, argv, "dhqD:o:P:w:", options, NULL)) != -1) {
 		switch (c) {
 		case 'D':
 			token.params.device_path = optarg;
@@ -125,6 +217,40 @@ main(int argc, char **argv)
 			token.params.allow_prompt = false;
 			break;
 
+		case 'w':
+			token.params.wait_timeout = atoi(optarg);
+			break;
+
+		case OPT_CREDENTIAL:
+			if (!fde_blob_set_hex(&token.cred_id, optarg))
+				usage("Invalid credential ID", 2);
+			break;
+
+		case OPT_SALT:
+			if (!fde_blob_set_hex(&token.salt, optarg) || token.salt.len != FDE_FIDO2_SALT_LEN)
+				usage("Invalid salt", 2);
+			break;
+
+		case OPT_BATCH:
+			opt_batch = true;
+			break;
+
+		case OPT_KEYRING:
+			opt_keyring = optarg;
+			break;
+
+		case OPT_KEYRING_TIMEOUT:
+			opt_keyring_timeout = atoi(optarg);
+			break;
+
+		case OPT_MEMFD:
+			opt_memfd = optarg;
+			break;
+
+		case OPT_ALL:
+			opt_all = true;
+			break;
+
 		case 'h':
 			usage(NULL, 0);
 
@@ -146,28 +272,104 @@ main(int argc, char **argv)
 		usage("Missing argument(s)", 2);
 	verb = argv[optind++];
 
+	fde_trace_init("fde-token", verb);
+
 	if (!strcmp(verb, "detect"))
 		return fde_token_discover_devices(&token);
 	if (!strcmp(verb, "check"))
 		return fde_token_check_devices(&token);
 	if (!strcmp(verb, "enroll")) {
+		const char *uuid = optind < argc? argv[optind] : NULL;
+		int rv;
+
+		/* With a UUID, each paragraph includes the derived key */
+		if (opt_all)
+			return fde_token_enroll_all(&token, uuid);
+
+		/* The credential goes to standard output */
+		if (uuid && !opt_key_file && !opt_memfd)
+			usage("enroll UUID requires --output or --memfd", 2);
+
 		if (!fde_token_discover_fresh_device(&token))
 			fatal("Failed to discover suitable FIDO2 token\n");
-		return fde_token_enroll(&token);
+		rv = fde_token_enroll(&token, uuid, &secret);
+		fde_token_clear_pin(&token);
+
+		if (rv == 0 && uuid) {
+			fflush(stdout);
+			if (opt_memfd)
+				rv = fde_token_exec_memfd(&secret, 1, false, opt_memfd)? 0 : 1;
+			else
+				rv = fde_token_write_key(&secret, opt_key_file)? 0 : 1;
+		}
+		fde_blob_clear(&secret);
+		return rv;
 	}
 
 	if (!strcmp(verb, "get-secret")) {
+		const char *client_data;
 		bool ok;
 
-		if (!fde_token_discover_credential(&token))
-			fatal("Failed to discover suitable FIDO2 token\n");
+		if (optind >= argc)
+			usage("Missing UUID argument", 2);
+
+		/* In batch mode, a single assertion provides the master secret
+		 * for all volumes. */
+		client_data = opt_batch? FDE_FIDO2_CHALLENGE : argv[optind];
+
+		if (token.cred_id.len != 0) {
+			/* The credential ID was cached in the LUKS header; skip
+			 * enumerating the resident credentials and go straight
+			 * for the assertion. */
+			if (!fde_token_discover_secret(&token, client_data, &secret))
+				fatal("Failed to discover FIDO2 token holding the credential\n");
+		} else {
+			if (!fde_token_discover_credential(&token))
+				fatal("Failed to discover suitable FIDO2 token\n");
+
+			if (!fde_token_get_secret(&token, client_data, &secret))
+				return 1;
+		}
 
-		if (!fde_token_get_secret(&token, argv[optind], &secret))
-			return 1;
+		fde_token_clear_pin(&token);
 
-		ok = fde_token_write_key(&secret, opt_key_file);
+		if (opt_batch) {
+			struct fde_blob secrets[FDE_MAX_BATCH];
+			unsigned int i, count = argc - optind;
+
+			if (count > FDE_MAX_BATCH)
+				fatal("Too many volumes, at most %u are supported\n", FDE_MAX_BATCH);
+
+			memset(secrets, 0, sizeof(secrets));
+
+			ok = true;
+			for (i = 0; ok && i < count; ++i)
+				ok = fde_derive_volume_secret(&secret, argv[optind + i], &secrets[i]);
+			fde_blob_clear(&secret);
+
+			if (!ok)
+				;
+			else if (opt_keyring)
+				ok = fde_token_write_keyring(secrets, argv + optind, count, true,
+						opt_keyring, opt_keyring_timeout);
+			else if (opt_memfd)
+				ok = fde_token_exec_memfd(secrets, count, true, opt_memfd);
+			else
+				ok = fde_token_write_keys(secrets, count, true, opt_key_file);
+
+			for (i = 0; i < count; ++i)
+				fde_blob_clear(&secrets[i]);
+		} else {
+			if (opt_keyring)
+				ok = fde_token_write_keyring(&secret, argv + optind, 1, false,
+						opt_keyring, opt_keyring_timeout);
+			else if (opt_memfd)
+				ok = fde_token_exec_memfd(&secret, 1, false, opt_memfd);
+			else
+				ok = fde_token_write_key(&secret, opt_key_file);
+			fde_blob_clear(&secret);
+		}
 
-		fde_blob_clear(&secret);
 		return ok? 0 : 1;
 	}
 
@@ -188,11 +390,24 @@ usage(const char *msg, int exitval)
 		"        Print token characteristics as a list of IDs.\n"
 		"        \"pin\" indicates that a PIN is required.\n"
 		"  fde-token enroll\n"
-		"        Create FDE credentials on FIDO2 token.\n"
+		"        Create FDE credentials on FIDO2 token, and print the credential\n"
+		"        ID, the token's AAGUID and a fresh salt as shell variables.\n"
+		"  fde-token enroll --output PATH UUID\n"
+		"        Also derive the key for volume UUID with the new credential and\n"
+		"        salt, and write it like get-secret (--memfd works as well).\n"
+		"  fde-token enroll --all [UUID]\n"
+		"        Create FDE credentials on all FIDO2 tokens that do not have one\n"
+		"        yet, concurrently. The variables are printed for each token,\n"
+		"        separated by empty lines. Given a UUID, they include the key\n"
+		"        for the volume as FIDO2_KEY.\n"
 		"  fde-token clear\n"
 		"        Remove existing FDE credentials from FIDO2 token.\n"
-		"  fde-token get-secret\n"
+		"  fde-token get-secret UUID\n"
 		"        Derive symmetric key from existing FDE credential.\n"
+		"  fde-token get-secret --batch UUID...\n"
+		"        Derive one key per volume UUID from a single assertion. The keys\n"
+		"        are written in the order given, each preceded by its length as\n"
+		"        a 32bit big endian number.\n"
 		"\n"
 		"The following options are recognized:\n"
 		"  --pin PIN, -p PIN\n"
@@ -201,9 +416,27 @@ usage(const char *msg, int exitval)
 		"        Specify a HID device by path, rather than scanning for one.\n"
 		"        When enrollment detects several devices, this is needed to\n"
 		"        disambiguate.\n"
+		"  --wait SECS, -w SECS\n"
+		"        If no FIDO2 device is present, wait up to SECS seconds for one\n"
+		"        to be plugged in.\n"
+		"  --credential HEX\n"
+		"        With get-secret, use the FDE credential with this ID, as\n"
+		"        printed by enroll. This avoids enumerating the credentials on\n"
+		"        the device, which usually requires the PIN.\n"
+		"  --salt HEX\n"
+		"        With get-secret, the 32 byte salt printed by enroll.\n"
 		"  --output PATH, -o PATH\n"
-		"        With get-secret, specify the path of a file to write the key to.\n"
+		"        With get-secret or enroll, specify the path of a file to write the key to.\n"
 		"        If no output file is specified, the key is written to standard output.\n"
+		"  --keyring DESC\n"
+		"        With get-secret, add the key to the user keyring as a \"user\" key\n"
+		"        named DESC (DESC:UUID with --batch), for use with cryptsetup's\n"
+		"        --key-description. The key ID is printed on standard output.\n"
+		"  --keyring-timeout SECS\n"
+		"        Let keys added with --keyring expire after SECS seconds (default 60).\n"
+		"  --memfd COMMAND\n"
+		"        With get-secret or enroll, place the key in a sealed memfd and execute\n"
+		"        COMMAND through the shell, with the memfd as its standard input.\n"
 		"  --debug, -d\n"
 		"        Enable debugging messages.\n"
 		"  --help, -h\n"
@@ -241,10 +474,8 @@ static void
 fde_blob_clear(struct fde_blob *blob)
 {
 	if (blob->data) {
-		/* zap contents, they may be confidential */
-		memset(blob->data, 0, blob->len);
-
-		free(blob->data);
+		/* contents may be confidential; the arena zaps them */
+		fde_arena_free(blob->data);
 		blob->data = NULL;
 		blob->len = 0;
 	}
@@ -255,7 +486,7 @@ fde_blob_set(struct fde_blob *blob, const void *data, size_t len)
 {
 	fde_blob_clear(blob);
 
-	blob->data = malloc(len);
+	blob->data = fde_arena_alloc(len);
 	if (blob->data == NULL)
 		fatal("%s: failed to allocate buffer of %u bytes\n", __func__, len);
 
@@ -263,6 +494,45 @@ fde_blob_set(struct fde_blob *blob, const void *data, size_t len)
 	blob->len = len;
 }
 
+static bool
+fde_blob_set_hex(struct fde_blob *blob, const char *hex)
+{
+	size_t i, len = strlen(hex);
+	unsigned char *data;
+
+	if (len == 0 || len % 2)
+		return false;
+
+	if (strspn(hex, "0123456789abcdefABCDEF") != len)
+		return false;
+
+	fde_blob_clear(blob);
+	if ((data = fde_arena_alloc(len / 2)) == NULL)
+		fatal("%s: failed to allocate buffer\n", __func__);
+
+	for (i = 0; i < len / 2; ++i) {
+		unsigned int octet;
+
+		sscanf(hex + 2 * i, "%2x", &octet);
+		data[i] = octet;
+	}
+
+	blob->data = data;
+	blob->len = len / 2;
+	return true;
+}
+
+static void
+fde_print_hex(const char *name, const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	printf("%s=", name);
+	for (i = 0; i < len; ++i)
+		printf("%02x", data[i]);
+	printf("\n");
+}
+
 static void
 fde_token_init(struct fde_token *token)
 {
@@ -275,19 +545,64 @@ static void
 fde_token_clear_pin(struct fde_token *token)
 {
 	if (token->pin) {
-		memset(token->pin, 0, strlen(token->pin));
-		free(token->pin);
+		fde_arena_free(token->pin);
 		token->pin = NULL;
 	}
+	if (token->pin_device) {
+		free(token->pin_device);
+		token->pin_device = NULL;
+	}
 }
 
 static void
 fde_token_set_pin(struct fde_token *token, const char *pin)
 {
 	fde_token_clear_pin(token);
-	token->pin = strdup(pin);
+	token->pin = fde_arena_strdup(pin);
 	if (token->pin == NULL)
 		fatal("%s: failed to allocate memory\n", __func__);
+
+	if (token->device_path && !(token->pin_device = strdup(token->device_path)))
+		fatal("%s: failed to allocate memory\n", __func__);
+}
+
+static fido_dev_t *
+fde_dev_new(const char *dev_path)
+{
+	fido_dev_t *dev;
+
+	if ((dev = fido_dev_new()) == NULL)
+		fatal("fido_dev_new: out of memory\n");
+
+	if (fde_token_dev_setup)
+		fde_token_dev_setup(dev, dev_path);
+
+	return dev;
+}
+
+static int
+fde_dev_info_manifest(fido_dev_info_t *devlist, size_t ilen, size_t *olen)
+{
+	if (fde_token_dev_manifest)
+		return fde_token_dev_manifest(devlist, ilen, olen);
+
+	return fido_dev_info_manifest(devlist, ilen, olen);
+}
+
+/*
+ * Make the opened device dev the one the token talks to. A PIN that was
+ * entered for another device is dropped; trying it here would use up
+ * one of the retries of this device.
+ */
+static void
+fde_token_set_device(struct fde_token *token, fido_dev_t *dev, const char *dev_path)
+{
+	if ((token->device_path = strdup(dev_path)) == NULL)
+		fatal("%s: failed to allocate memory\n", __func__);
+	token->dev = dev;
+
+	if (token->pin && (!token->pin_device || strcmp(token->pin_device, dev_path)))
+		fde_token_clear_pin(token);
 }
 
 static bool
@@ -295,20 +610,20 @@ fde_token_attach(struct fde_token *token, const char *dev_path)
 {
 	if (token->dev == NULL) {
 		fido_dev_t *dev;
+		uint64_t t_start;
 		int r;
 
-		if ((dev = fido_dev_new()) == NULL)
-			fatal("fido_dev_new: out of memory\n");
-
+		dev = fde_dev_new(dev_path);
+		t_start = fde_trace_begin();
 		r = fido_dev_open(dev, dev_path);
+		fde_trace_end(t_start, "open %s", dev_path);
 		if (r != FIDO_OK) {
 			fido_dev_close(dev);
 			fido_dev_free(&dev);
 			return false;
 		}
 
-		token->device_path = strdup(dev_path);
-		token->dev = dev;
+		fde_token_set_device(token, dev, dev_path);
 	}
 
 	return true;
@@ -322,7 +637,7 @@ fde_token_detach(struct fde_token *token)
 		fido_dev_free(&token->dev);
 	}
 
-	fde_token_clear_pin(token);
+	memset(&token->info, 0, sizeof(token->info));
 
 	if (token->device_path) {
 		free(token->device_path);
@@ -330,35 +645,79 @@ fde_token_detach(struct fde_token *token)
 	}
 }
 
+/*
+ * Obtain the PIN, from the command line or by prompting the user. This
+ * happens once per device; the PIN is then handed to every operation
+ * on that device.
+ */
 static bool
-fde_maybe_retry_with_pin(struct fde_token *token, int code)
+fde_token_get_pin(struct fde_token *token)
 {
 	char *pin;
 
-        if (!fido_dev_has_pin(token->dev))
-                return false;
-
-	if (token->pin || !token->params.allow_prompt)
-                return false;
-
-	/* It would have been nice to check for error codes like
-	 * FIDO_ERR_PIN_REQUIRED. Alas, fido_credman_get_dev_rk returns
-	 * INVALID_ARGUMENT when called w/o pin. */
-	debug("Operation returns error %d (%s) - let's retry with PIN\n", code, fido_strerr(code));
+	if (token->pin)
+		return true;
 
 	if (token->params.pin) {
 		fde_token_set_pin(token, token->params.pin);
 		return true;
 	}
 
-	pin = getpass("Please enter PIN for FIDO token: ");
-	if (pin == NULL)
+	if (!token->params.allow_prompt || token->pin_prompts >= FDE_MAX_PIN_PROMPTS)
+		return false;
+
+	token->pin_prompts++;
+	if (token->device_path) {
+		char prompt[PATH_MAX + 64];
+
+		snprintf(prompt, sizeof(prompt), "Please enter PIN for FIDO token %s: ", token->device_path);
+		pin = getpass(prompt);
+	} else {
+		pin = getpass("Please enter PIN for FIDO token: ");
+	}
+	if (pin == NULL || *pin == '\0')
 		return false;
 
 	fde_token_set_pin(token, pin);
+	memset(pin, 0, strlen(pin));
 	return true;
 }
 
+/*
+ * Operations that cannot succeed without the PIN on a token that has
+ * one get it right away. Trying without PIN first costs an extra round
+ * trip to the token for every operation.
+ */
+static void
+fde_token_provide_pin(struct fde_token *token)
+{
+	if (fido_dev_has_pin(token->dev))
+		fde_token_get_pin(token);
+}
+
+static bool
+fde_maybe_retry_with_pin(struct fde_token *token, int code)
+{
+        if (!fido_dev_has_pin(token->dev))
+                return false;
+
+	if (token->pin) {
+		/* Give the user another chance if they mistyped the PIN */
+		if (code != FIDO_ERR_PIN_INVALID || token->params.pin)
+			return false;
+
+		error("Wrong PIN\n");
+		fde_token_clear_pin(token);
+	}
+
+	/* It would have been nice to check for error codes like
+	 * FIDO_ERR_PIN_REQUIRED. Alas, fido_credman_get_dev_rk returns
+	 * INVALID_ARGUMENT when called w/o pin. */
+	debug("Operation returns error %d (%s) - let's retry with PIN\n", code, fido_strerr(code));
+
+	return fde_token_get_pin(token);
+}
+
 /*
  * Having attached to a token, check whether it contains credentials
  * for the relying party rp_id.
@@ -376,9 +735,14 @@ fde_find_credential(struct fde_token *token, const char *rp_id)
         if ((rk = fido_credman_rk_new()) == NULL)
 		return false;
 
-	/* debug("TP %d\n", __LINE__); */
+	/* Credential management always requires the PIN */
+	fde_token_provide_pin(token);
+
 	do {
+		uint64_t t_start = fde_trace_begin();
+
 		r = fido_credman_get_dev_rk(token->dev, rp_id, rk, token->pin);
+		fde_trace_end(t_start, "enumerate credentials on %s", token->device_path);
 	} while (r != FIDO_OK && fde_maybe_retry_with_pin(token, r));
 
         if (r != FIDO_OK) {
@@ -403,148 +767,473 @@ out:
 }
 
 /*
- * Enumerate FIDO devices.
- * If the user supplied a --device argument on the command line,
- * check just this device. Otherwise, loop over all available
- * tokens. The first valid one is returned in token->dev.
+ * The parts of authenticatorGetInfo we care about. Asking a token for
+ * it is one of the slower operations, so we cache it in a file below
+ * FDE_TOKEN_CACHE_DIR, keyed by the device path, USB vendor and product,
+ * and the device version reported by the token (which tracks the
+ * firmware version). The cache lives on a tmpfs and is discarded on
+ * reboot.
  */
 static bool
-fde_token_enumerate_devices(struct fde_token *token,
-		bool (*check_fn)(struct fde_token *))
+fde_dev_info_cache_path(const char *dev_path, char *buf, size_t size)
 {
-	fido_dev_info_t *devlist;
-	size_t i, ndevs;
-	int r;
+	char *s;
 
-	if (token->params.device_path) {
-		if (!fde_token_attach(token, token->params.device_path))
-			return false;
+	if (snprintf(buf, size, "%s/", FDE_TOKEN_CACHE_DIR) >= size)
+		return false;
 
-		if (check_fn && !check_fn(token)) {
-			fde_token_detach(token);
-			return false;
-		}
+	s = buf + strlen(buf);
+	if (snprintf(s, size - (s - buf), "%s", dev_path) >= size - (s - buf))
+		return false;
 
-		return true;
+	for (; *s; ++s) {
+		if (*s == '/')
+			*s = '_';
 	}
 
-	if ((devlist = fido_dev_info_new(64)) == NULL)
-		fatal("fido_dev_info_new failed\n");
+	return true;
+}
 
-	if ((r = fido_dev_info_manifest(devlist, 64, &ndevs)) != FIDO_OK)
-		fatal("unable to obtain list of FIDO capable devices: %s\n", fido_strerr(r));
+static void
+fde_dev_info_make_key(fido_dev_t *dev, int16_t vendor, int16_t product, char *buf, size_t size)
+{
+	snprintf(buf, size, "%04x:%04x-%u.%u.%u",
+			(uint16_t) vendor, (uint16_t) product,
+			fido_dev_major(dev), fido_dev_minor(dev), fido_dev_build(dev));
+}
 
-	for (i = 0; i < ndevs; i++) {
-		const fido_dev_info_t *dev_info = fido_dev_info_ptr(devlist, i);
-		const char *dev_path = fido_dev_info_path(dev_info);
+static bool
+fde_dev_info_load(const char *dev_path, const char *key, struct fde_dev_info *info)
+{
+	char path[PATH_MAX], line[256], value[128];
+	bool key_ok = false;
+	FILE *fp;
 
-		debug("Checking device %s (%s %s)\n", dev_path,
-				fido_dev_info_manufacturer_string(dev_info),
-				fido_dev_info_product_string(dev_info));
-		if (fde_token_attach(token, dev_path)) {
-			if (check_fn == NULL || check_fn(token))
-				break;
-		}
+	if (!fde_dev_info_cache_path(dev_path, path, sizeof(path)))
+		return false;
 
-		fde_token_detach(token);
+	if (!(fp = fopen(path, "r")))
+		return false;
+
+	memset(info, 0, sizeof(*info));
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "key %127s", value) == 1)
+			key_ok = !strcmp(value, key);
+		else if (sscanf(line, "hmac-secret %127s", value) == 1)
+			info->hmac_secret = !strcmp(value, "yes");
 	}
+	fclose(fp);
 
-	fido_dev_info_free(&devlist, ndevs);
-	return token->dev != NULL;
+	if (!key_ok) {
+		debug("Cached info for %s is stale\n", dev_path);
+		return false;
+	}
+
+	info->valid = true;
+	return true;
+}
+
+static void
+fde_dev_info_save(const char *dev_path, const char *key, const struct fde_dev_info *info)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+	FILE *fp;
+
+	if (!fde_dev_info_cache_path(dev_path, path, sizeof(path)))
+		return;
+
+	if (mkdir(FDE_TOKEN_CACHE_DIR, 0700) < 0 && errno != EEXIST) {
+		debug("Cannot create %s: %m\n", FDE_TOKEN_CACHE_DIR);
+		return;
+	}
+
+	/* Several probe threads may write at the same time, but never for the same device */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if (!(fp = fopen(tmp_path, "w"))) {
+		debug("Cannot write %s: %m\n", tmp_path);
+		return;
+	}
+
+	fprintf(fp, "key %s\n", key);
+	fprintf(fp, "hmac-secret %s\n", info->hmac_secret? "yes" : "no");
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) < 0) {
+		debug("Cannot write %s: %m\n", path);
+		unlink(tmp_path);
+	}
 }
 
 static bool
-__fde_token_has_extension(fido_dev_t *dev, const char *name)
+fde_dev_info_query(fido_dev_t *dev, const char *dev_path, struct fde_dev_info *info)
 {
 	fido_cbor_info_t *ci = NULL;
 	unsigned int count, i;
 	char * const * list;
+	uint64_t t_start;
 	int r;
-	bool ok;
+
+	memset(info, 0, sizeof(*info));
 
 	if ((ci = fido_cbor_info_new()) == NULL)
 		fatal("%s: cannot allocate CBOR info\n", __func__);
 
-	if ((r = fido_dev_get_cbor_info(dev, ci)) != FIDO_OK) {
-		debug("%s: fido_dev_get_cbor_info returns %s\n", __func__, fido_strerr(r));
-		goto out;
+	t_start = fde_trace_begin();
+	r = fido_dev_get_cbor_info(dev, ci);
+	fde_trace_end(t_start, "get info %s", dev_path);
+	if (r != FIDO_OK) {
+		debug("%s: fido_dev_get_cbor_info returns %s\n", dev_path, fido_strerr(r));
+		fido_cbor_info_free(&ci);
+		return false;
 	}
 
 	list = fido_cbor_info_extensions_ptr(ci);
 	count = fido_cbor_info_extensions_len(ci);
 	for (i = 0; i < count; ++i) {
-		const char *extension = list[i];
-
-		debug("  token has extension %s\n", extension);
-		if (!strcmp(extension, name)) {
-			ok = true;
-			break;
-		}
+		debug("  %s has extension %s\n", dev_path, list[i]);
+		if (!strcmp(list[i], "hmac-secret"))
+			info->hmac_secret = true;
 	}
 
-out:
 	fido_cbor_info_free(&ci);
-	return ok;
+	info->valid = true;
+	return true;
 }
 
+/*
+ * Obtain the authenticatorGetInfo data of an open device, from the
+ * cache if possible.
+ */
 static bool
-__fde_token_check_device(struct fde_token *token)
+fde_dev_info_get(fido_dev_t *dev, const char *dev_path, int16_t vendor, int16_t product,
+		struct fde_dev_info *info)
 {
-	fido_dev_t *dev = token->dev;
+	char key[64];
 
-	if (!fido_dev_is_fido2(dev)) {
-		debug("%s is not a FIDO2 device\n", token->device_path);
+	if (!fido_dev_is_fido2(dev))
 		return false;
+
+	fde_dev_info_make_key(dev, vendor, product, key, sizeof(key));
+	if (fde_dev_info_load(dev_path, key, info)) {
+		debug("Using cached info for %s (%s)\n", dev_path, key);
+		return true;
 	}
 
-	if (!__fde_token_has_extension(dev, "hmac-secret")) {
-		debug("%s lacks extension hmac-secret\n", token->device_path);
+	if (!fde_dev_info_query(dev, dev_path, info))
 		return false;
-	}
 
-	debug("nice device!\n");
+	fde_dev_info_save(dev_path, key, info);
 	return true;
 }
 
-static int
-fde_token_discover_devices(struct fde_token *token)
+/*
+ * Probing all devices happens in parallel, so that a single unresponsive
+ * device does not hold up the others. Each probe opens its device with a
+ * timeout and reads the device info; the main thread then runs the actual
+ * check on the devices in the order they finished probing.
+ *
+ * Once the main thread has found a match, it does not wait for the
+ * remaining probes. The probe set is reference counted so that whoever
+ * is last cleans it up.
+ */
+struct fde_probe {
+	char *			path;
+	int16_t			vendor;
+	int16_t			product;
+
+	fido_dev_t *		dev;
+	struct fde_dev_info	info;
+
+	struct fde_probe_set *	set;
+};
+
+struct fde_probe_set {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		refcount;
+	bool			abandoned;
+
+	unsigned int		nprobes;
+	unsigned int		ncompleted;
+	struct fde_probe *	completed[FDE_MAX_DEVICES];
+	struct fde_probe	probes[FDE_MAX_DEVICES];
+};
+
+static void
+fde_probe_close(struct fde_probe *probe)
 {
-	if (fde_token_enumerate_devices(token, __fde_token_check_device)) {
-		if (!opt_quiet)
-			printf("%s\n", token->device_path);
-		return 0;
+	if (probe->dev) {
+		fido_dev_close(probe->dev);
+		fido_dev_free(&probe->dev);
 	}
-
-	return 1;
 }
 
-static int
-fde_token_check_devices(struct fde_token *token)
+static void
+fde_probe_set_put(struct fde_probe_set *set)
 {
-	if (fde_token_enumerate_devices(token, __fde_token_check_device)) {
-		if (!opt_quiet) {
-			fido_dev_t *dev = token->dev;
+	unsigned int i;
 
-			printf("%s", token->device_path);
-			if (fido_dev_has_pin(dev))
-				printf(" pin");
-			printf("\n");
-		}
-		return 0;
+	/* called with set->lock held */
+	if (--(set->refcount) != 0) {
+		pthread_mutex_unlock(&set->lock);
+		return;
 	}
 
-	return 1;
+	pthread_mutex_unlock(&set->lock);
+
+	for (i = 0; i < set->nprobes; ++i) {
+		fde_probe_close(&set->probes[i]);
+		free(set->probes[i].path);
+	}
+
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->cond);
+	free(set);
 }
 
-static bool
-__fde_token_check_credential(struct fde_token *token)
+static void *
+fde_probe_thread(void *arg)
 {
-	if (fde_find_credential(token, FDE_FIDO2_RELYING_PARTY)) {
-		debug("Found \"%s\" on %s\n", FDE_FIDO2_RELYING_PARTY, token->device_path);
-		return true;
+	struct fde_probe *probe = arg;
+	struct fde_probe_set *set = probe->set;
+	fido_dev_t *dev;
+	uint64_t t_start;
+	int r;
+
+	dev = fde_dev_new(probe->path);
+	fido_dev_set_timeout(dev, FDE_PROBE_TIMEOUT_MS);
+
+	t_start = fde_trace_begin();
+	r = fido_dev_open(dev, probe->path);
+	fde_trace_end(t_start, "open %s", probe->path);
+	if (r != FIDO_OK) {
+		debug("Unable to open %s: %s\n", probe->path, fido_strerr(r));
+		fido_dev_free(&dev);
+	} else {
+		probe->dev = dev;
+		fde_dev_info_get(dev, probe->path, probe->vendor, probe->product, &probe->info);
 	}
 
-	return false;
+	pthread_mutex_lock(&set->lock);
+	if (set->abandoned)
+		fde_probe_close(probe);
+	set->completed[set->ncompleted++] = probe;
+	pthread_cond_signal(&set->cond);
+	fde_probe_set_put(set);
+
+	return NULL;
+}
+
+static bool
+fde_token_probe_devices(struct fde_token *token, const fido_dev_info_t *devlist, size_t ndevs,
+		bool (*check_fn)(struct fde_token *))
+{
+	struct fde_probe_set *set;
+	unsigned int i, next = 0;
+	pthread_attr_t attr;
+
+	if ((set = calloc(1, sizeof(*set))) == NULL)
+		fatal("%s: out of memory\n", __func__);
+
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->cond, NULL);
+	set->refcount = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; i < ndevs && i < FDE_MAX_DEVICES; i++) {
+		const fido_dev_info_t *dev_info = fido_dev_info_ptr(devlist, i);
+		struct fde_probe *probe = &set->probes[set->nprobes];
+		pthread_t thread;
+
+		debug("Probing device %s (%s %s)\n", fido_dev_info_path(dev_info),
+				fido_dev_info_manufacturer_string(dev_info),
+				fido_dev_info_product_string(dev_info));
+
+		probe->path = strdup(fido_dev_info_path(dev_info));
+		probe->vendor = fido_dev_info_vendor(dev_info);
+		probe->product = fido_dev_info_product(dev_info);
+		probe->set = set;
+
+		if (probe->path == NULL)
+			fatal("%s: out of memory\n", __func__);
+
+		if (pthread_create(&thread, &attr, fde_probe_thread, probe) != 0) {
+			error("Unable to create thread to probe %s\n", probe->path);
+			free(probe->path);
+			probe->path = NULL;
+			continue;
+		}
+
+		set->nprobes++;
+		set->refcount++;
+	}
+	pthread_attr_destroy(&attr);
+
+	while (next < set->nprobes) {
+		struct fde_probe *probe;
+
+		while (next >= set->ncompleted)
+			pthread_cond_wait(&set->cond, &set->lock);
+		probe = set->completed[next++];
+
+		if (probe->dev == NULL)
+			continue;
+
+		/* Run the check without holding the lock; it may prompt for a PIN */
+		pthread_mutex_unlock(&set->lock);
+
+		/* Operations requiring user presence must not time out */
+		fido_dev_set_timeout(probe->dev, -1);
+
+		fde_token_set_device(token, probe->dev, probe->path);
+		token->info = probe->info;
+		probe->dev = NULL;
+
+		if (check_fn == NULL || check_fn(token)) {
+			pthread_mutex_lock(&set->lock);
+			break;
+		}
+
+		fde_token_detach(token);
+		pthread_mutex_lock(&set->lock);
+	}
+
+	/* Devices still being probed are closed by their threads */
+	set->abandoned = true;
+	fde_probe_set_put(set);
+
+	return token->dev != NULL;
+}
+
+/*
+ * Enumerate FIDO devices.
+ * If the user supplied a --device argument on the command line,
+ * check just this device. Otherwise, probe all available
+ * tokens. The first valid one is returned in token->dev.
+ */
+static bool
+fde_token_enumerate_devices(struct fde_token *token,
+		bool (*check_fn)(struct fde_token *))
+{
+	fido_dev_info_t *devlist;
+	uint64_t t_start;
+	size_t ndevs;
+	bool found;
+	int r;
+
+	if (token->params.device_path) {
+		if (!fde_token_attach(token, token->params.device_path)) {
+			if (token->params.wait_timeout == 0)
+				return false;
+
+			debug("Waiting for device %s to appear\n", token->params.device_path);
+			if (udev_wait_for_device("hidraw", "DEVNAME", token->params.device_path,
+					token->params.wait_timeout < 0? UDEV_WAIT_FOREVER : token->params.wait_timeout * 1000,
+					NULL) < 0
+			 || !fde_token_attach(token, token->params.device_path))
+				return false;
+		}
+
+		fde_dev_info_get(token->dev, token->device_path, 0, 0, &token->info);
+
+		if (check_fn && !check_fn(token)) {
+			fde_token_detach(token);
+			return false;
+		}
+
+		return true;
+	}
+
+	if ((devlist = fido_dev_info_new(FDE_MAX_DEVICES)) == NULL)
+		fatal("fido_dev_info_new failed\n");
+
+	if ((r = fde_dev_info_manifest(devlist, FDE_MAX_DEVICES, &ndevs)) != FIDO_OK)
+		fatal("unable to obtain list of FIDO capable devices: %s\n", fido_strerr(r));
+
+	/* Early during boot, the token may not have been enumerated yet. Rather
+	 * than failing right away, wait for udev to announce a FIDO device. */
+	if (ndevs == 0 && token->params.wait_timeout != 0) {
+		debug("No FIDO devices yet, waiting up to %d seconds\n", token->params.wait_timeout);
+		r = udev_wait_for_device("hidraw", "ID_FIDO_TOKEN", "1",
+				token->params.wait_timeout < 0? UDEV_WAIT_FOREVER : token->params.wait_timeout * 1000,
+				NULL);
+		if (r == 0 && (r = fde_dev_info_manifest(devlist, FDE_MAX_DEVICES, &ndevs)) != FIDO_OK)
+			fatal("unable to obtain list of FIDO capable devices: %s\n", fido_strerr(r));
+	}
+
+	t_start = fde_trace_begin();
+	found = fde_token_probe_devices(token, devlist, ndevs, check_fn);
+	fde_trace_end(t_start, "probe %u devices", (unsigned int) ndevs);
+
+	fido_dev_info_free(&devlist, ndevs);
+	return found;
+}
+
+static bool
+__fde_token_check_device(struct fde_token *token)
+{
+	fido_dev_t *dev = token->dev;
+
+	if (!fido_dev_is_fido2(dev)) {
+		debug("%s is not a FIDO2 device\n", token->device_path);
+		return false;
+	}
+
+	if (!token->info.valid) {
+		debug("%s did not report its capabilities\n", token->device_path);
+		return false;
+	}
+
+	if (!token->info.hmac_secret) {
+		debug("%s lacks extension hmac-secret\n", token->device_path);
+		return false;
+	}
+
+	debug("nice device!\n");
+	return true;
+}
+
+static int
+fde_token_discover_devices(struct fde_token *token)
+{
+	if (fde_token_enumerate_devices(token, __fde_token_check_device)) {
+		if (!opt_quiet)
+			printf("%s\n", token->device_path);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+fde_token_check_devices(struct fde_token *token)
+{
+	if (fde_token_enumerate_devices(token, __fde_token_check_device)) {
+		if (!opt_quiet) {
+			fido_dev_t *dev = token->dev;
+
+			printf("%s", token->device_path);
+			if (fido_dev_has_pin(dev))
+				printf(" pin");
+			printf("\n");
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+static bool
+__fde_token_check_credential(struct fde_token *token)
+{
+	if (fde_find_credential(token, FDE_FIDO2_RELYING_PARTY)) {
+		debug("Found \"%s\" on %s\n", FDE_FIDO2_RELYING_PARTY, token->device_path);
+		return true;
+	}
+
+	return false;
 }
 
 static bool
@@ -553,6 +1242,35 @@ fde_token_discover_credential(struct fde_token *token)
 	return fde_token_enumerate_devices(token, __fde_token_check_credential);
 }
 
+/*
+ * Discover the token holding the credential token->cred_id, by simply
+ * asking each FIDO2 device for an assertion. A device that does not know
+ * the credential fails that with FIDO_ERR_NO_CREDENTIALS right away.
+ */
+static bool
+__fde_token_check_secret(struct fde_token *token)
+{
+	if (!fido_dev_is_fido2(token->dev)) {
+		debug("%s is not a FIDO2 device\n", token->device_path);
+		return false;
+	}
+
+	return fde_token_get_secret(token, token->uuid, &token->secret);
+}
+
+static bool
+fde_token_discover_secret(struct fde_token *token, const char *uuid, struct fde_blob *secret)
+{
+	token->uuid = uuid;
+	if (!fde_token_enumerate_devices(token, __fde_token_check_secret))
+		return false;
+
+	/* hand over the secret */
+	*secret = token->secret;
+	memset(&token->secret, 0, sizeof(token->secret));
+	return true;
+}
+
 /*
  * Discover a FIDO2 token that has no FDE credential yet
  */
@@ -600,15 +1318,80 @@ fde_hash_clientdata(const char *algo, const char *data, size_t len, unsigned cha
 }
 
 /*
- * Create a resident credential on the token
+ * The FIDO2 round trips, for tracing
+ */
+static int
+fde_dev_make_cred(struct fde_token *token, fido_cred_t *cred)
+{
+	uint64_t t_start = fde_trace_begin();
+	int r;
+
+	r = fido_dev_make_cred(token->dev, cred, token->pin);
+	fde_trace_end(t_start, "make credential on %s", token->device_path);
+	return r;
+}
+
+static int
+fde_dev_get_assert(struct fde_token *token, fido_assert_t *assert)
+{
+	uint64_t t_start = fde_trace_begin();
+	int r;
+
+	r = fido_dev_get_assert(token->dev, assert, token->pin);
+	fde_trace_end(t_start, "get assertion from %s", token->device_path);
+	return r;
+}
+
+/*
+ * Set up the assertion that yields the hmac-secret for the client data
+ * hash cdh, without user presence to begin with. This allocates nothing
+ * from the arena, so the enrollment threads can use it.
+ */
+static fido_assert_t *
+fde_assert_new(const unsigned char *cdh, int cdh_len, const unsigned char *cred_id, size_t cred_id_len,
+		const struct fde_blob *salt)
+{
+	static unsigned char zero_salt[32] = { 0, };
+	fido_assert_t *assert;
+	int r;
+
+	if ((assert = fido_assert_new()) == NULL)
+		return NULL;
+
+	r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_rp(assert, FDE_FIDO2_RELYING_PARTY);
+	if (r == FIDO_OK)
+		r = fido_assert_allow_cred(assert, cred_id, cred_id_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_extensions(assert, FIDO_EXT_HMAC_SECRET);
+	if (r == FIDO_OK) {
+		/* Tokens enrolled before the salt was recorded use all zeroes */
+		if (salt->len)
+			r = fido_assert_set_hmac_salt(assert, salt->data, salt->len);
+		else
+			r = fido_assert_set_hmac_salt(assert, zero_salt, sizeof(zero_salt));
+	}
+
+	fido_assert_set_up(assert, FIDO_OPT_FALSE);
+
+	if (r != FIDO_OK) {
+		error("Unable to set up assert parameters\n");
+		fido_assert_free(&assert);
+	}
+
+	return assert;
+}
+
+/*
+ * Set up the parameters of a new resident credential
  */
 static fido_cred_t *
-fde_token_make_credential(struct fde_token *token, const char *challenge, const char *username)
+fde_token_new_credential(const char *challenge, const char *username)
 {
 	fido_cred_t *cred = NULL;
 	unsigned char cdh[128], uh[128];
 	int r, cdh_len, uh_len;
-	bool allow_up = false;
 
 	if ((cdh_len = fde_hash_clientdata("sha256", challenge, strlen(challenge), cdh, sizeof(cdh))) < 0)
 		fatal("unable to hash challenge\n");
@@ -633,23 +1416,43 @@ fde_token_make_credential(struct fde_token *token, const char *challenge, const
 
 	if (r != FIDO_OK) {
                 error("unable to build FIDO2 credential: %s\n", fido_strerr(r));
-		goto out;
+		fido_cred_free(&cred);
+		return NULL;
 	}
 
+	return cred;
+}
+
+/*
+ * Create a resident credential on the token
+ */
+static fido_cred_t *
+fde_token_make_credential(struct fde_token *token, const char *challenge, const char *username)
+{
+	fido_cred_t *cred;
+	bool allow_up = false;
+	int r;
+
+	if ((cred = fde_token_new_credential(challenge, username)) == NULL)
+		return NULL;
+
 	/* For credentials, I haven't discovered a way to detect whether the operation requires user
 	 * presence or not. fido_cred_* does not seem to have anything analogous to fido_assert_set_up */
 
 	fprintf(stderr, "The token may require you to confirm user presence. Please watch out for any blinkenlights\n");
 	allow_up = true;
 
+	/* With a PIN set, makeCredential requires it */
+	fde_token_provide_pin(token);
+
 	do {
-		r = fido_dev_make_cred(token->dev, cred, token->pin);
+		r = fde_dev_make_cred(token, cred);
 		if (r == FIDO_ERR_UP_REQUIRED && !allow_up) {
 			fprintf(stderr, "FIDO token requires user presence, watch out for any blinkenlights\n");
 			/* fido_cred_set_up(cred, FIDO_OPT_TRUE); */
 			allow_up = true;
 
-			r = fido_dev_make_cred(token->dev, cred, token->pin);
+			r = fde_dev_make_cred(token, cred);
 		}
 	} while (r != FIDO_OK && fde_maybe_retry_with_pin(token, r));
 
@@ -665,8 +1468,57 @@ out:
 	return NULL;
 }
 
+/*
+ * Pick the salt for the hmac-secret extension of a new credential
+ */
+static bool
+fde_token_new_salt(struct fde_token *token)
+{
+	unsigned char salt[FDE_FIDO2_SALT_LEN];
+
+	if (getrandom(salt, sizeof(salt), 0) != sizeof(salt)) {
+		error("Unable to generate salt: %m\n");
+		return false;
+	}
+
+	fde_blob_set(&token->salt, salt, sizeof(salt));
+	memset(salt, 0, sizeof(salt));
+	return true;
+}
+
+/*
+ * Print what is needed to skip credential discovery in get-secret.
+ * The caller is expected to store this in the LUKS header, see
+ * "fdectl-grub-tpm2 add --token-type fde-fido2". When enrolling several
+ * tokens, each one is printed as a paragraph, including the device and,
+ * if there is an assertion, the key derived from it.
+ */
+static void
+fde_token_print_credential(struct fde_token *token, const fido_cred_t *cred, const fido_assert_t *assert,
+		bool multi)
+{
+	if (opt_quiet)
+		return;
+
+	if (multi)
+		printf("FIDO2_DEVICE=%s\n", token->device_path);
+	fde_print_hex("FIDO2_CREDENTIAL", fido_cred_id_ptr(cred), fido_cred_id_len(cred));
+	fde_print_hex("FIDO2_AAGUID", fido_cred_aaguid_ptr(cred), fido_cred_aaguid_len(cred));
+	fde_print_hex("FIDO2_SALT", token->salt.data, token->salt.len);
+	if (assert)
+		fde_print_hex("FIDO2_KEY", fido_assert_hmac_secret_ptr(assert, 0),
+				fido_assert_hmac_secret_len(assert, 0));
+	if (multi)
+		printf("\n");
+}
+
+/*
+ * Create the credential and, given a volume UUID, derive the key of
+ * the volume from it right away. The key has to be made with the salt
+ * printed here; get-secret without --salt would use a different one.
+ */
 static int
-fde_token_enroll(struct fde_token *token)
+fde_token_enroll(struct fde_token *token, const char *uuid, struct fde_blob *secret)
 {
 	fido_cred_t *cred;
 
@@ -676,14 +1528,245 @@ fde_token_enroll(struct fde_token *token)
 		return 1;
 	}
 
-	if (!__fde_token_check_credential(token)) {
-		error("Strange, I thought I enrolled a credential but now I cannot find it\n");
+	/* The credential ID comes with the new credential; looking it up
+	 * again with credential management would cost another PIN
+	 * exchange. */
+	fde_blob_set(&token->cred_id, fido_cred_id_ptr(cred), fido_cred_id_len(cred));
+
+	if (!fde_token_new_salt(token)
+	 || (uuid && !fde_token_get_secret(token, uuid, secret))) {
+		fido_cred_free(&cred);
 		return 1;
 	}
 
+	fde_token_print_credential(token, cred, NULL, false);
+	fido_cred_free(&cred);
 	return 0;
 }
 
+/*
+ * Enroll all fresh tokens at once, eg the primary one and its backups.
+ *
+ * Finding out whether a token is fresh, and obtaining its PIN, happens
+ * one device at a time, so that the user knows which token a PIN prompt
+ * is about. After that, makeCredential is started on all tokens
+ * concurrently, and the user can touch them in any order.
+ *
+ * Given a UUID, each thread goes on to derive the key of its new
+ * credential, so that the caller can add all keyslots at once. The
+ * arena is not thread safe, so the salts are picked beforehand and the
+ * key stays in the assertion until the main thread prints it.
+ */
+struct fde_enrollment {
+	struct fde_token	token;
+	fido_cred_t *		cred;
+	fido_assert_t *		assert;
+	const char *		uuid;
+	int			status;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		ncompleted;
+	struct fde_enrollment *	completed[FDE_MAX_DEVICES];
+} fde_enroll_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int
+fde_enroll_derive_key(struct fde_enrollment *enr)
+{
+	unsigned char cdh[128];
+	int r, cdh_len;
+
+	if ((cdh_len = fde_hash_clientdata("sha256", enr->uuid, strlen(enr->uuid), cdh, sizeof(cdh))) < 0)
+		return FIDO_ERR_INTERNAL;
+
+	enr->assert = fde_assert_new(cdh, cdh_len, fido_cred_id_ptr(enr->cred), fido_cred_id_len(enr->cred),
+			&enr->token.salt);
+	if (enr->assert == NULL)
+		return FIDO_ERR_INTERNAL;
+
+	r = fde_dev_get_assert(&enr->token, enr->assert);
+	if (r == FIDO_ERR_UP_REQUIRED) {
+		fido_assert_set_up(enr->assert, FIDO_OPT_TRUE);
+		r = fde_dev_get_assert(&enr->token, enr->assert);
+	}
+
+	if (r == FIDO_OK && fido_assert_hmac_secret_len(enr->assert, 0) == 0)
+		r = FIDO_ERR_UNSUPPORTED_EXTENSION;
+	if (r != FIDO_OK)
+		fido_assert_free(&enr->assert);
+	return r;
+}
+
+static void *
+fde_enroll_thread(void *arg)
+{
+	struct fde_enrollment *enr = arg;
+
+	/* The PIN, if any, was obtained beforehand. Do not prompt here; the
+	 * threads would fight over the terminal. */
+	enr->status = fde_dev_make_cred(&enr->token, enr->cred);
+	if (enr->status == FIDO_OK && enr->uuid)
+		enr->status = fde_enroll_derive_key(enr);
+
+	pthread_mutex_lock(&fde_enroll_state.lock);
+	fde_enroll_state.completed[fde_enroll_state.ncompleted++] = enr;
+	pthread_cond_signal(&fde_enroll_state.cond);
+	pthread_mutex_unlock(&fde_enroll_state.lock);
+
+	return NULL;
+}
+
+static int
+fde_token_enroll_all(struct fde_token *token, const char *uuid)
+{
+	struct fde_enrollment *enrollments;
+	pthread_t threads[FDE_MAX_DEVICES];
+	fido_dev_info_t *devlist;
+	unsigned int i, count = 0, nthreads = 0, failed = 0;
+	size_t ndevs;
+	int r;
+
+	if ((devlist = fido_dev_info_new(FDE_MAX_DEVICES)) == NULL)
+		fatal("fido_dev_info_new failed\n");
+
+	if ((r = fde_dev_info_manifest(devlist, FDE_MAX_DEVICES, &ndevs)) != FIDO_OK)
+		fatal("unable to obtain list of FIDO capable devices: %s\n", fido_strerr(r));
+
+	if ((enrollments = calloc(ndevs? ndevs : 1, sizeof(*enrollments))) == NULL)
+		fatal("%s: out of memory\n", __func__);
+
+	for (i = 0; i < ndevs; i++) {
+		const char *dev_path = fido_dev_info_path(fido_dev_info_ptr(devlist, i));
+		struct fde_enrollment *enr = &enrollments[count];
+
+		fde_token_init(&enr->token);
+		enr->token.params = token->params;
+
+		if (!fde_token_attach(&enr->token, dev_path))
+			continue;
+
+		fde_dev_info_get(enr->token.dev, dev_path,
+				fido_dev_info_vendor(fido_dev_info_ptr(devlist, i)),
+				fido_dev_info_product(fido_dev_info_ptr(devlist, i)),
+				&enr->token.info);
+
+		if (!__fde_token_check_fresh(&enr->token)) {
+			fde_token_detach(&enr->token);
+			fde_token_clear_pin(&enr->token);
+			continue;
+		}
+
+		/* With a PIN set, makeCredential requires it */
+		fde_token_provide_pin(&enr->token);
+
+		if ((enr->cred = fde_token_new_credential(FDE_FIDO2_RELYING_PARTY, FDE_FIDO2_USER_NAME)) == NULL)
+			fatal("Unable to set up credential\n");
+		if (!fde_token_new_salt(&enr->token))
+			fatal("Unable to set up credential\n");
+		enr->uuid = uuid;
+		count++;
+	}
+	fido_dev_info_free(&devlist, ndevs);
+
+	if (count == 0) {
+		error("No FIDO2 token without FDE credential found\n");
+		free(enrollments);
+		return 1;
+	}
+
+	fprintf(stderr, "Please confirm user presence on each of the %u tokens, in any order\n", count);
+	if (uuid)
+		fprintf(stderr, "Tokens that require it for every request will ask a second time\n");
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&threads[nthreads], NULL, fde_enroll_thread, &enrollments[i]) != 0) {
+			error("Unable to create thread to enroll %s\n", enrollments[i].token.device_path);
+			enrollments[i].status = FIDO_ERR_INTERNAL;
+			failed++;
+			continue;
+		}
+		nthreads++;
+	}
+
+	/* Report the tokens as they are touched */
+	pthread_mutex_lock(&fde_enroll_state.lock);
+	for (i = 0; i < nthreads; i++) {
+		struct fde_enrollment *enr;
+
+		while (i >= fde_enroll_state.ncompleted)
+			pthread_cond_wait(&fde_enroll_state.cond, &fde_enroll_state.lock);
+		enr = fde_enroll_state.completed[i];
+
+		if (enr->status == FIDO_OK) {
+			fprintf(stderr, "Enrolled %s\n", enr->token.device_path);
+		} else if (enr->cred == NULL || !fido_cred_id_len(enr->cred)) {
+			error("Unable to create resident credential on device %s: %s\n",
+					enr->token.device_path, fido_strerr(enr->status));
+			failed++;
+		} else {
+			error("Unable to derive key from device %s: %s\n",
+					enr->token.device_path, fido_strerr(enr->status));
+			failed++;
+		}
+	}
+	pthread_mutex_unlock(&fde_enroll_state.lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < count; i++) {
+		struct fde_enrollment *enr = &enrollments[i];
+
+		if (enr->status == FIDO_OK)
+			fde_token_print_credential(&enr->token, enr->cred, enr->assert, true);
+
+		fido_assert_free(&enr->assert);
+		fido_cred_free(&enr->cred);
+		fde_token_detach(&enr->token);
+		fde_token_clear_pin(&enr->token);
+	}
+
+	free(enrollments);
+	return failed? 1 : 0;
+}
+
+/*
+ * Check whether the device holds the credential without asking for the
+ * PIN or user presence. Without them, the token merely looks up the
+ * allowed credential. Returns false only if the device says it does not
+ * hold the credential.
+ */
+static bool
+fde_token_has_credential(struct fde_token *token, const unsigned char *cdh, int cdh_len)
+{
+	fido_assert_t *assert;
+	uint64_t t_start;
+	int r;
+
+	assert = fido_assert_new();
+
+	r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_rp(assert, FDE_FIDO2_RELYING_PARTY);
+	if (r == FIDO_OK)
+		r = fido_assert_allow_cred(assert, token->cred_id.data, token->cred_id.len);
+	if (r == FIDO_OK)
+		r = fido_assert_set_up(assert, FIDO_OPT_FALSE);
+	if (r == FIDO_OK) {
+		t_start = fde_trace_begin();
+		r = fido_dev_get_assert(token->dev, assert, NULL);
+		fde_trace_end(t_start, "look up credential on %s", token->device_path);
+	}
+
+	fido_assert_free(&assert);
+	return r != FIDO_ERR_NO_CREDENTIALS;
+}
+
 /*
  * Create a FIDO assert for the selected credentials and return it.
  * The sole purpose of doing that is to derive the 32byte key provided by the hmac-secret
@@ -692,44 +1775,48 @@ fde_token_enroll(struct fde_token *token)
 static fido_assert_t *
 fde_token_make_assert(struct fde_token *token, const char *uuid)
 {
-	static unsigned char zero_salt[32] = { 0, };
 	unsigned char cdh[128];
 	fido_assert_t *assert;
 	int r, cdh_len;
 	bool allow_up = false;
 
-	assert = fido_assert_new();
-
 	if ((cdh_len = fde_hash_clientdata("sha256", uuid, strlen(uuid), cdh, sizeof(cdh))) < 0)
 		fatal("unable to hash uuid\n");
 
-	r = fido_assert_set_clientdata_hash(assert, cdh, cdh_len);
-	if (r == FIDO_OK)
-		r = fido_assert_set_rp(assert, FDE_FIDO2_RELYING_PARTY);
-	if (r == FIDO_OK)
-		r = fido_assert_allow_cred(assert, token->cred_id.data, token->cred_id.len);
-	if (r == FIDO_OK)
-		r = fido_assert_set_extensions(assert, FIDO_EXT_HMAC_SECRET);
-	if (r == FIDO_OK)
-		r = fido_assert_set_hmac_salt(assert, zero_salt, sizeof(zero_salt));
-
-	fido_assert_set_up(assert, FIDO_OPT_FALSE);
+	assert = fde_assert_new(cdh, cdh_len, token->cred_id.data, token->cred_id.len, &token->salt);
+	if (assert == NULL)
+		return NULL;
 
-	if (r != FIDO_OK) {
-		error("Unable to set up assert parameters\n");
+	/* Do not ask for the PIN of a device that does not hold our
+	 * credential */
+	if (token->pin == NULL && fido_dev_has_pin(token->dev) &&
+	    !fde_token_has_credential(token, cdh, cdh_len)) {
+		debug("Device %s does not hold the FDE credential\n", token->device_path);
 		goto out;
 	}
 
+	/* The hmac-secret output depends on whether the assertion is made
+	 * with or without user verification. Always supply the PIN on a
+	 * token that has one, so that we derive the same key no matter
+	 * whether the credential was looked up via credential management
+	 * (which needs the PIN anyway) or given on the command line. */
+	fde_token_provide_pin(token);
+
 	do {
-		r = fido_dev_get_assert(token->dev, assert, token->pin);
+		r = fde_dev_get_assert(token, assert);
 		if (r == FIDO_ERR_UP_REQUIRED && !allow_up) {
 			fprintf(stderr, "FIDO token requires user presence, watch out for any blinkenlights\n");
 			fido_assert_set_up(assert, FIDO_OPT_TRUE);
 			allow_up = true;
 
-			r = fido_dev_get_assert(token->dev, assert, token->pin);
+			r = fde_dev_get_assert(token, assert);
 		}
-	} while (r != FIDO_OK && fde_maybe_retry_with_pin(token, r));
+	} while (r != FIDO_OK && r != FIDO_ERR_NO_CREDENTIALS && fde_maybe_retry_with_pin(token, r));
+
+	if (r == FIDO_ERR_NO_CREDENTIALS) {
+		debug("Device %s does not hold the FDE credential\n", token->device_path);
+		goto out;
+	}
 
 	if (r != FIDO_OK) {
 		error("Unable to get assert from device %s\n", token->device_path);
@@ -759,6 +1846,49 @@ fde_token_get_secret(struct fde_token *token, const char *uuid, struct fde_blob
 	return true;
 }
 
+/*
+ * In batch mode, the hmac-secret output of a single assertion serves as
+ * master secret, and the key of each volume is derived from it using
+ * HKDF-SHA256 with the volume's UUID as info. Volumes to be unlocked
+ * in batch mode must be enrolled with a key derived the same way, ie
+ * using get-secret --batch with just their UUID.
+ */
+static bool
+fde_derive_volume_secret(const struct fde_blob *master, const char *uuid, struct fde_blob *secret)
+{
+	unsigned char info[sizeof(FDE_VOLUME_KEY_INFO) + 64];
+	unsigned char key[FDE_VOLUME_KEY_LEN];
+	size_t info_len, key_len = sizeof(key);
+	EVP_PKEY_CTX *pctx;
+	bool ok = false;
+
+	info_len = snprintf((char *) info, sizeof(info), "%s%s", FDE_VOLUME_KEY_INFO, uuid);
+	if (info_len >= sizeof(info)) {
+		error("UUID \"%s\" is too long\n", uuid);
+		return false;
+	}
+
+	if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) == NULL)
+		fatal("%s: unable to create HKDF context\n", __func__);
+
+	if (EVP_PKEY_derive_init(pctx) <= 0
+	 || EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0
+	 || EVP_PKEY_CTX_set1_hkdf_key(pctx, master->data, master->len) <= 0
+	 || EVP_PKEY_CTX_add1_hkdf_info(pctx, info, info_len) <= 0
+	 || EVP_PKEY_derive(pctx, key, &key_len) <= 0) {
+		error("Unable to derive key for volume %s\n", uuid);
+		goto out;
+	}
+
+	fde_blob_set(secret, key, key_len);
+	ok = true;
+
+out:
+	memset(key, 0, sizeof(key));
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
 static bool
 __fde_token_write_key(const struct fde_blob *secret, FILE *fp)
 {
@@ -780,20 +1910,45 @@ __fde_token_write_key(const struct fde_blob *secret, FILE *fp)
 }
 
 static bool
-fde_token_write_key(const struct fde_blob *secret, const char *key_file)
+__fde_token_write_batch(const struct fde_blob *secrets, unsigned int count, FILE *fp)
 {
-	FILE *fp;
-	bool ok;
+	unsigned int i;
 
-	if (key_file == NULL)
-		return __fde_token_write_key(secret, stdout);
+	for (i = 0; i < count; ++i) {
+		uint32_t len = secrets[i].len;
+		unsigned char prefix[4] = { len >> 24, len >> 16, len >> 8, len };
+
+		if (fwrite(prefix, sizeof(prefix), 1, fp) != 1) {
+			error("Failed to write to key file: %m\n");
+			return false;
+		}
 
-	if (!(fp = fopen(key_file, "w"))) {
+		if (!__fde_token_write_key(&secrets[i], fp))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+fde_token_write_keys(const struct fde_blob *secrets, unsigned int count, bool batch, const char *key_file)
+{
+	FILE *fp = stdout;
+	bool ok;
+
+	if (key_file && !(fp = fopen(key_file, "w"))) {
 		error("Unable to open key file \"%s\": %m\n", key_file);
 		return false;
 	}
 
-	ok = __fde_token_write_key(secret, fp);
+	if (batch)
+		ok = __fde_token_write_batch(secrets, count, fp);
+	else
+		ok = __fde_token_write_key(secrets, fp);
+
+	if (key_file == NULL)
+		return ok && fflush(fp) == 0;
+
 	if (fclose(fp) != 0) {
 		error("Failed to write to key file: %m\n");
 		return false;
@@ -802,3 +1957,107 @@ fde_token_write_key(const struct fde_blob *secret, const char *key_file)
 	fprintf(stderr, "Wrote secret key to file %s\n", key_file);
 	return ok;
 }
+
+static bool
+fde_token_write_key(const struct fde_blob *secret, const char *key_file)
+{
+	return fde_token_write_keys(secret, 1, false, key_file);
+}
+
+/*
+ * Hand the keys to the kernel keyring directly, so that they never touch
+ * a file system. glibc has no wrappers for these, and we do not want to
+ * pull in libkeyutils for two system calls.
+ */
+static bool
+fde_token_write_keyring(const struct fde_blob *secrets, char * const *uuids, unsigned int count,
+		bool batch, const char *description, int timeout)
+{
+	char desc[256];
+	unsigned int i;
+	long serial;
+
+	for (i = 0; i < count; ++i) {
+		if (!batch)
+			snprintf(desc, sizeof(desc), "%s", description);
+		else if (snprintf(desc, sizeof(desc), "%s:%s", description, uuids[i]) >= sizeof(desc)) {
+			error("Key description for volume %s is too long\n", uuids[i]);
+			return false;
+		}
+
+		serial = syscall(SYS_add_key, "user", desc, secrets[i].data, secrets[i].len,
+				KEY_SPEC_USER_KEYRING);
+		if (serial < 0) {
+			error("Unable to add key \"%s\" to the user keyring: %m\n", desc);
+			return false;
+		}
+
+		if (timeout > 0 && syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, serial, timeout) < 0) {
+			error("Unable to set timeout of key \"%s\": %m\n", desc);
+			syscall(SYS_keyctl, KEYCTL_INVALIDATE, serial);
+			return false;
+		}
+
+		debug("Added key \"%s\" with ID %ld\n", desc, serial);
+		if (!opt_quiet)
+			printf("%ld\n", serial);
+	}
+
+	return true;
+}
+
+/*
+ * Write the keys to a sealed memfd and run the given command with it as
+ * standard input, eg "cryptsetup open --key-file - ...". On success, this
+ * does not return.
+ */
+static bool
+fde_token_exec_memfd(const struct fde_blob *secrets, unsigned int count, bool batch, const char *command)
+{
+	FILE *fp;
+	int fd;
+	bool ok;
+
+	if ((fd = memfd_create("fde-token-key", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		error("Unable to create memfd: %m\n");
+		return false;
+	}
+
+	if (!(fp = fdopen(dup(fd), "w"))) {
+		error("Unable to open memfd: %m\n");
+		close(fd);
+		return false;
+	}
+
+	/* no need to have the key linger in a stdio buffer */
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	if (batch)
+		ok = __fde_token_write_batch(secrets, count, fp);
+	else
+		ok = __fde_token_write_key(secrets, fp);
+
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok) {
+		close(fd);
+		return false;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+	 || lseek(fd, 0, SEEK_SET) < 0
+	 || dup2(fd, 0) < 0) {
+		error("Unable to seal memfd: %m\n");
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	debug("Executing %s\n", command);
+	execl("/bin/sh", "sh", "-c", command, NULL);
+
+	error("Unable to execute %s: %m\n", command);
+	return false;
+}
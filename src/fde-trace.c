@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "fde-trace.h"
+
+#define FDE_TRACE_ENV		"FDE_TRACE_FILE"
+
+static int		trace_fd = -1;
+static const char *	trace_tool;
+static char		trace_process[128];
+static uint64_t		trace_process_start;
+static int64_t		trace_clock_offset;	/* realtime - monotonic, usec */
+
+static uint64_t
+clock_usec(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+trace_now(void)
+{
+	return clock_usec(CLOCK_MONOTONIC) + trace_clock_offset;
+}
+
+/* Copy a span name, escaping it for JSON */
+static void
+trace_escape(char *out, size_t size, const char *name)
+{
+	size_t n = 0;
+
+	for (; *name && n + 7 < size; name++) {
+		unsigned char c = *name;
+
+		if (c == '"' || c == '\\') {
+			out[n++] = '\\';
+			out[n++] = c;
+		} else if (c < 0x20) {
+			n += snprintf(out + n, size - n, "\\u%04x", c);
+		} else {
+			out[n++] = c;
+		}
+	}
+	out[n] = '\0';
+}
+
+/*
+ * A single write to an O_APPEND file keeps lines from several
+ * processes and threads intact. Tracing never fails the tool, so
+ * callers may ignore the result.
+ */
+static bool
+trace_append(int fd, const char *data, size_t len)
+{
+	return write(fd, data, len) == (ssize_t) len;
+}
+
+static void
+trace_write(uint64_t start, const char *name)
+{
+	char escaped[512], line[768];
+	uint64_t end = trace_now();
+	int len;
+
+	trace_escape(escaped, sizeof(escaped), name);
+	len = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld},\n",
+			escaped, trace_tool,
+			(unsigned long long) start,
+			(unsigned long long) (end - start),
+			(int) getpid(), (long) syscall(SYS_gettid));
+	if (len <= 0 || (size_t) len >= sizeof(line))
+		return;
+
+	(void) trace_append(trace_fd, line, len);
+}
+
+static void
+trace_exit(void)
+{
+	trace_write(trace_process_start, trace_process);
+}
+
+void
+fde_trace_init(const char *tool, const char *action)
+{
+	const char *path;
+	int fd;
+
+	if (trace_fd >= 0 || (path = getenv(FDE_TRACE_ENV)) == NULL || *path == '\0')
+		return;
+
+	/* Whoever creates the file starts the JSON array. The closing
+	 * bracket is optional in the trace event format. */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		(void) trace_append(fd, "[\n", 2);
+	} else if (errno == EEXIST) {
+		fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	}
+	if (fd < 0)
+		return;
+
+	trace_fd = fd;
+	trace_tool = tool;
+	trace_clock_offset = clock_usec(CLOCK_REALTIME) - clock_usec(CLOCK_MONOTONIC);
+	trace_process_start = trace_now();
+
+	if (action)
+		snprintf(trace_process, sizeof(trace_process), "%s %s", tool, action);
+	else
+		snprintf(trace_process, sizeof(trace_process), "%s", tool);
+	atexit(trace_exit);
+}
+
+uint64_t
+fde_trace_begin(void)
+{
+	if (trace_fd < 0)
+		return 0;
+
+	return trace_now();
+}
+
+void
+fde_trace_end(uint64_t start, const char *fmt, ...)
+{
+	char name[256];
+	va_list ap;
+
+	if (trace_fd < 0 || start == 0)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+
+	trace_write(start, name);
+}
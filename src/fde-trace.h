@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FDE_TRACE_H
+#define FDE_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Timing instrumentation.
+ *
+ * If the environment variable FDE_TRACE_FILE names a file, spans are
+ * appended to it as Chrome trace events ("ph":"X"), one per line, for
+ * loading into chrome://tracing or ui.perfetto.dev. fdectl and all of
+ * our tools append to the same file, so a single trace covers e.g. an
+ * entire tpm-enable run. When FDE_TRACE_FILE is not set, each of the
+ * calls below costs a single test.
+ *
+ * Timestamps are in microseconds since the epoch, so that they line up
+ * with the spans written by the shell scripts (which use bash's
+ * EPOCHREALTIME), but durations are measured with the monotonic clock.
+ */
+
+/* Open the trace file. The whole process is recorded as one span named
+ * after tool and action (action may be NULL). */
+void		fde_trace_init(const char *tool, const char *action);
+
+/* Returns the start time of a span, or 0 if tracing is disabled */
+uint64_t	fde_trace_begin(void);
+
+/* Record a span started by fde_trace_begin, naming it printf-style */
+void		fde_trace_end(uint64_t start, const char *fmt, ...)
+			__attribute__ ((format (printf, 2, 3)));
+
+#endif /* FDE_TRACE_H */
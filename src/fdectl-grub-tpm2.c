@@ -16,6 +16,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,11 +25,25 @@
 #include <fcntl.h>
 #include <time.h>
 #include <argp.h>
+#include <dirent.h>
+#include <endian.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
 #include <json-c/json.h>
 #include <libcryptsetup.h>
+#include <openssl/evp.h>
 #include "nls.h"
+#include "udev-wait.h"
+#include "fde-arena.h"
+#include "fde-trace.h"
 
 #define TOKEN_NAME "grub-tpm2"
+#define FIDO2_TOKEN_NAME "fde-fido2"
+#define SYSTEMD_TPM2_TOKEN_NAME "systemd-tpm2"
 
 #define l_err(cd, x...) crypt_logf(cd, CRYPT_LOG_ERROR, x)
 #define l_dbg(cd, x...) crypt_logf(cd, CRYPT_LOG_DEBUG, x)
@@ -36,9 +52,115 @@
 #define OPT_DEBUG_JSON	2
 #define OPT_KEY_SLOT	3
 #define OPT_KEY_ONLY	4
+#define OPT_DEVICE_ONLY	5
+#define OPT_TIMEOUT	6
+#define OPT_KEY_FILE	7
+#define OPT_KEY_SLOTS	8
+#define OPT_KEEP	9
+#define OPT_JOURNAL	10
+#define OPT_TOKEN_TYPE	11
+#define OPT_FIDO2_CREDENTIAL	12
+#define OPT_FIDO2_AAGUID	13
+#define OPT_FIDO2_SALT	14
+#define OPT_FIDO2_PARAMS	15
+#define OPT_KEY_SIZE	16
+#define OPT_OUTPUT	17
+#define OPT_REPLACE	18
+#define OPT_BUDGET	19
+#define OPT_SLOWDOWN	20
+#define OPT_ROOT	21
+#define OPT_COUNT	22
+#define OPT_JOBS	23
+
+/* Default number of seconds the 'wait' action waits for a device */
+#define DEFAULT_WAIT_TIMEOUT	10
+
+/*
+ * Header journal, see journal_begin() below
+ */
+#define FDE_STATE_DIR		"/var/lib/fde"
+#define JOURNAL_DIR		FDE_STATE_DIR "/journal"
+#define JOURNAL_MAGIC		"FDEJRNL2"
+#define JOURNAL_EXPLICIT	0x0001	/* created by 'begin', covers several actions */
+#define JOURNAL_ID_ENV		"FDE_JOURNAL_ID"	/* set by fdectl for each run */
+#define JOURNAL_ID_LEN		40
+
+/* With --root, journals live in the image, below the given directory */
+static char	state_dir[PATH_MAX] = FDE_STATE_DIR;
+static char	journal_dir[PATH_MAX] = JOURNAL_DIR;
+
+/* Offsets into the LUKS2 binary header */
+#define LUKS2_MAGIC		"LUKS\xba\xbe"
+#define LUKS2_MAGIC_2ND		"SKUL\xba\xbe"
+#define LUKS2_MAGIC_LEN		6
+#define LUKS2_HDR_SIZE_OFFSET	8
+#define LUKS2_SEQID_OFFSET	16
+#define LUKS2_CSUM_ALG_OFFSET	72
+#define LUKS2_CSUM_ALG_LEN	32
+#define LUKS2_UUID_OFFSET	168
+#define LUKS2_UUID_LEN		40
+#define LUKS2_CSUM_OFFSET	448
+#define LUKS2_CSUM_LEN		64
+#define LUKS2_HDR_BIN_LEN	4096
+
+struct journal_header {
+	char		magic[8];
+	uint32_t	flags;
+	uint32_t	nregions;
+	char		uuid[LUKS2_UUID_LEN];
+	char		id[JOURNAL_ID_LEN];	/* FDE_JOURNAL_ID of the run that made it */
+};
+
+struct journal_region {
+	uint64_t	offset;
+	uint64_t	length;
+};
+
+/* Same limit as cryptsetup's default --keyfile-size */
+#define MAX_KEY_FILE_SIZE	(8 * 1024 * 1024)
+
+/* Size of the keys created by 'genkey'; the TPM cannot seal more than 128 bytes */
+#define DEFAULT_KEY_SIZE	128
+#define MAX_KEY_SIZE		256
+
+/* Random keys need no key stretching; this is the minimum cryptsetup accepts */
+#define RANDOM_KEY_ITERATIONS	1000
+
+/* The hmac-secret extension yields 32 bytes, or 64 with two salts */
+#define FIDO2_KEY_MAX		64
+
+/* Number of tokens a LUKS2 header can hold */
+#define LUKS2_TOKENS_MAX	32
+
+/*
+ * Defaults for 'calibrate': the time grub may spend on the PBKDF of a
+ * password at boot, and how much slower grub's pbkdf2 is than the one
+ * in libcryptsetup, which uses the optimized hash of the crypto backend.
+ */
+#define DEFAULT_UNLOCK_BUDGET_MS	2000
+#define DEFAULT_GRUB_SLOWDOWN		8.0
+#define DEFAULT_VOLUME_KEY_SIZE		64
+
+/*
+ * Layout of the volumes made by 'factory': an image with the LUKS2
+ * header in front, as cryptsetup luksFormat would make it, and the
+ * aes-xts-plain64 data after it. The data is encrypted without
+ * dm-crypt; plain64 counts sectors from the start of the data segment,
+ * so its offset does not change the IVs. The recovery password has the
+ * format of fde_random_password, with twice as many groups.
+ */
+#define FACTORY_HOST_DIR		"host-%04u"
+#define FACTORY_SECTOR_SIZE		512
+/* The default LUKS2 data offset, i.e. the header size; the file is sparse */
+#define FACTORY_HEADER_SIZE		(16 * 1024 * 1024)
+#define FACTORY_CHUNK_SIZE		(1024 * 1024)
+#define RECOVERY_PASSWORD_GROUPS	8
+
+/* LVM on top of MD on top of LUKS is about as deep as it gets */
+#define RESOLVE_MAX_DEPTH	16
 
 static int
-check_existing_tokens(struct crypt_device *cd, int keyslot, int *token_id)
+check_existing_tokens(struct crypt_device *cd, const char *token_type, int keyslot, int *token_id)
 {
 	const char *json;
 	json_object *jobj;
@@ -84,10 +206,10 @@ check_existing_tokens(struct crypt_device *cd, int keyslot, int *token_id)
 			continue;
 		}
 
-		if (strcmp(json_object_get_string(jobj_type), TOKEN_NAME) != 0)
+		if (strcmp(json_object_get_string(jobj_type), token_type) != 0)
 			continue;
 
-		l_dbg(cd, _("Token %s is %s."), slot, TOKEN_NAME);
+		l_dbg(cd, _("Token %s is %s."), slot, token_type);
 
 		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots)) {
 			l_err(cd, _("Failed to get keyslots for token %s."), slot);
@@ -122,88 +244,26 @@ out:
 
 }
 
+/*
+ * Record the token of the given type of every keyslot in token_of_slot,
+ * which must have room for crypt_keyslot_max(CRYPT_LUKS2) entries.
+ * Keyslots without such a token are set to CRYPT_ANY_TOKEN.
+ */
 static int
-add_new_token(struct crypt_device *cd, int keyslot)
-{
-	json_object *jobj = NULL;
-	json_object *jobj_keyslots = NULL;
-	json_object *jobj_timestamp = NULL;
-	time_t cur_time;
-	struct tm gmt_time;
-	char time_str[24];
-	const char *string_token;
-	int r, token;
-
-	jobj = json_object_new_object();
-	if (!jobj) {
-		r = -ENOMEM;
-		goto out;
-	}
-
-	/* type is mandatory field in all tokens and must match handler name member */
-	json_object_object_add(jobj, "type", json_object_new_string(TOKEN_NAME));
-
-	jobj_keyslots = json_object_new_array();
-	if (!jobj_keyslots) {
-		r = -ENOMEM;
-		goto out;
-	}
-
-	/* mandatory array field (may be empty and assigned later */
-	json_object_object_add(jobj, "keyslots", jobj_keyslots);
-
-	/* add timestamp */
-	cur_time = time(NULL);
-	gmtime_r(&cur_time, &gmt_time);
-	strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S UTC", &gmt_time);
-	jobj_timestamp = json_object_new_string(time_str);
-	if (!jobj_timestamp) {
-		r = -ENOMEM;
-		goto out;
-	}
-	json_object_object_add(jobj, "timestamp", jobj_timestamp);
-
-	string_token = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
-	if (!string_token) {
-		r = -EINVAL;
-		goto out;
-	}
-
-	l_dbg(cd, "Token JSON: %s", string_token);
-
-	r = crypt_token_json_set(cd, CRYPT_ANY_TOKEN, string_token);
-	if (r < 0) {
-		l_err(cd, _("Failed to write grub-tpm2 token json."));
-		goto out;
-	}
-
-	token = r;
-	r = crypt_token_assign_keyslot(cd, token, keyslot);
-	if (r != token) {
-		crypt_token_json_set(cd, token, NULL);
-		r = -EINVAL;
-		goto out;
-	}
-
-	r = 0;
-out:
-	json_object_put(jobj);
-	return r;
-}
-
-static int
-clean_empty_tokens (struct crypt_device *cd)
+collect_token_keyslots(struct crypt_device *cd, const char *token_type, int *token_of_slot)
 {
 	const char *json;
 	json_object *jobj;
 	json_object *jobj_tokens;
 	json_object *jobj_type;
 	json_object *jobj_keyslots;
-	int token;
+	int max_slots = crypt_keyslot_max(CRYPT_LUKS2);
+	int keyslot;
+	size_t i;
 	int r;
 
-	if (!cd)
-		return -1;
+	for (keyslot = 0; keyslot < max_slots; keyslot++)
+		token_of_slot[keyslot] = CRYPT_ANY_TOKEN;
 
 	r = crypt_dump_json(cd, &json, 0);
 	if (r) {
@@ -223,29 +283,20 @@ clean_empty_tokens (struct crypt_device *cd)
 		goto out;
 	}
 
-	if (json_object_object_length(jobj_tokens) == 0) {
-		r = 0;
-		goto out;
-	}
-
 	json_object_object_foreach(jobj_tokens, slot, val) {
-		if (!json_object_object_get_ex(val, "type", &jobj_type)) {
-			l_err(cd, _("Failed to get type for token %s."), slot);
+		if (!json_object_object_get_ex(val, "type", &jobj_type))
 			continue;
-		}
 
-		if (strcmp(json_object_get_string(jobj_type), TOKEN_NAME) != 0)
+		if (strcmp(json_object_get_string(jobj_type), token_type) != 0)
 			continue;
 
-		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots)) {
-			l_err(cd, _("Failed to get keyslots for token %s."), slot);
+		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots))
 			continue;
-		}
 
-		/* check 'keyslots' and remove this token if the array is empty */
-		if (json_object_array_length(jobj_keyslots) == 0) {
-			token = atoi(slot);
-			crypt_token_json_set(cd, token, NULL);
+		for (i = 0; i < json_object_array_length(jobj_keyslots); i++) {
+			keyslot = atoi(json_object_get_string(json_object_array_get_idx(jobj_keyslots, i)));
+			if (keyslot >= 0 && keyslot < max_slots)
+				token_of_slot[keyslot] = atoi(slot);
 		}
 	}
 
@@ -256,136 +307,2822 @@ out:
 }
 
 static int
-print_all_tokens(json_object *jobj_output)
+read_key_file(struct crypt_device *cd, const char *key_file, char **key, size_t *key_len)
 {
-	const char *string_out;
+	struct stat st;
+	ssize_t n;
+	size_t len = 0;
+	char *buf;
+	int fd, r = 0;
+
+	fd = open(key_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		l_err(cd, _("Failed to open key file %s."), key_file);
+		return -errno;
+	}
 
-	string_out = json_object_to_json_string_ext(jobj_output, JSON_C_TO_STRING_PRETTY);
-	if (!string_out)
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > MAX_KEY_FILE_SIZE) {
+		l_err(cd, _("Key file %s is not a regular file or too large."), key_file);
+		close(fd);
 		return -EINVAL;
-	printf ("%s\n", string_out);
+	}
+
+	buf = fde_arena_alloc(st.st_size + 1);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
 
+	while (len < (size_t) st.st_size) {
+		n = read(fd, buf + len, st.st_size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			l_err(cd, _("Failed to read key file %s."), key_file);
+			r = -EIO;
+			break;
+		}
+		len += n;
+	}
+	close(fd);
+
+	if (r < 0) {
+		fde_arena_free(buf);
+		return r;
+	}
+
+	*key = buf;
+	*key_len = len;
 	return 0;
 }
 
+static void
+free_key(char *key, size_t key_len)
+{
+	/* the arena zaps the key */
+	fde_arena_free(key);
+}
+
+/*
+ * Parse a list of keyslots separated by commas or white space
+ */
 static int
-print_token_keyslots(struct crypt_device *cd, json_object *jobj_output)
+parse_keyslot_list(struct crypt_device *cd, const char *list, bool *selected, int max_slots)
 {
-	json_object *jobj_keyslots;
-	json_object *jobj_keyslot;
-	struct array_list *keyslots;
-	const char *keyslot_str;
-	int i;
+	const char *p = list;
+	char *end;
+	long keyslot;
 
-	json_object_object_foreach(jobj_output, slot, val) {
-		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots)) {
-			l_err(cd, _("Failed to get keyslots for token %s."), slot);
+	while (*p) {
+		if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n') {
+			p++;
 			continue;
 		}
 
-		if (json_object_array_length(jobj_keyslots) == 0)
+		keyslot = strtol(p, &end, 10);
+		if (end == p || keyslot < 0 || keyslot >= max_slots) {
+			l_err(cd, _("Invalid keyslot list '%s'."), list);
+			return -EINVAL;
+		}
+
+		selected[keyslot] = true;
+		p = end;
+	}
+
+	return 0;
+}
+
+/*
+ * The header journal allows to undo changes to the LUKS2 metadata
+ * without a full luksHeaderBackup. Before modifying the header, we save
+ * both copies of the binary header and JSON area. That is usually a few
+ * dozen KiB instead of the full 16 MiB of metadata and keyslots. The
+ * areas of keyslots are saved only if 'begin --key-slots' asks for
+ * them, so that a journal never brings back a key that was revoked by
+ * removing its keyslot.
+ *
+ * A single action removes its journal once it has updated the header.
+ * A journal from 'begin' covers the following actions of the same
+ * fdectl run, as told by FDE_JOURNAL_ID, until 'commit' or 'rollback'.
+ *
+ * The journal file consists of a struct journal_header, followed by
+ * nregions pairs of struct journal_region and the saved data.
+ * Regions are appended before nregions is updated, so a journal
+ * interrupted while being extended is still consistent.
+ */
+static void
+journal_path(struct crypt_device *cd, const char *journal_file, char *buf, size_t size)
+{
+	if (journal_file)
+		snprintf(buf, size, "%s", journal_file);
+	else
+		snprintf(buf, size, "%s/%s.journal", journal_dir, crypt_get_uuid(cd));
+}
+
+static int
+write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
 			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		buf = (const char *) buf + n;
+		len -= n;
+		offset += n;
+	}
 
-		keyslots = json_object_get_array(jobj_keyslots);
-		if (keyslots == NULL) {
-			l_err(cd, _("Failed to get the keyslots array for token %s."), slot);
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		buf = (char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int
+journal_read_header(int jfd, struct journal_header *hdr)
+{
+	if (read_all(jfd, hdr, sizeof(*hdr), 0) < 0 ||
+	    memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Copy a region of the metadata device to the end of the journal,
+ * unless the journal already holds it.
+ */
+static int
+journal_save_region(int jfd, int devfd, struct journal_header *hdr,
+		    uint64_t offset, uint64_t length)
+{
+	struct journal_region region;
+	off_t pos = sizeof(*hdr);
+	char *buf;
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < hdr->nregions; i++) {
+		r = read_all(jfd, &region, sizeof(region), pos);
+		if (r < 0)
+			return r;
+		if (region.offset == offset && region.length == length)
+			return 0;
+		pos += sizeof(region) + region.length;
+	}
+
+	buf = malloc(length);
+	if (!buf)
+		return -ENOMEM;
+
+	region.offset = offset;
+	region.length = length;
+	r = read_all(devfd, buf, length, offset);
+	if (r == 0)
+		r = write_all(jfd, &region, sizeof(region), pos);
+	if (r == 0)
+		r = write_all(jfd, buf, length, pos + sizeof(region));
+	if (r == 0 && fdatasync(jfd) < 0)
+		r = -errno;
+
+	/* Only now make the new region part of the journal */
+	if (r == 0) {
+		hdr->nregions++;
+		r = write_all(jfd, hdr, sizeof(*hdr), 0);
+	}
+	if (r == 0 && fdatasync(jfd) < 0)
+		r = -errno;
+
+	free(buf);
+	return r;
+}
+
+static const char *
+metadata_device_name(struct crypt_device *cd)
+{
+	/* Without a detached header, the metadata device is not set */
+	const char *device = crypt_get_metadata_device_name(cd);
+
+	return device ? device : crypt_get_device_name(cd);
+}
+
+static const char *
+journal_id(void)
+{
+	const char *id = getenv(JOURNAL_ID_ENV);
+
+	return id ? id : "";
+}
+
+/*
+ * Open the journal of the device, creating it with a snapshot of the
+ * LUKS2 metadata if there is none yet. An existing journal from 'begin'
+ * in the same run is kept as is, so that a rollback returns to the
+ * state before the whole transaction. Any other journal is left over
+ * from an earlier run and is replaced.
+ */
+static int
+journal_open(struct crypt_device *cd, const char *journal_file, uint32_t flags, int *devfdp)
+{
+	struct journal_header hdr;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	uint64_t metadata_size, keyslots_size;
+	const char *uuid = crypt_get_uuid(cd);
+	const char *metadata_device;
+	int jfd, devfd, r;
+
+	if (!uuid)
+		return -EINVAL;
+
+	journal_path(cd, journal_file, path, sizeof(path));
+
+	metadata_device = metadata_device_name(cd);
+
+	devfd = open(metadata_device, O_RDONLY | O_CLOEXEC);
+	if (devfd < 0)
+		return -errno;
+
+	jfd = open(path, O_RDWR | O_CLOEXEC);
+	if (jfd >= 0) {
+		if (journal_read_header(jfd, &hdr) == 0 &&
+		    strncmp(hdr.uuid, uuid, sizeof(hdr.uuid)) == 0 &&
+		    strncmp(hdr.id, journal_id(), sizeof(hdr.id)) == 0 &&
+		    (hdr.flags & JOURNAL_EXPLICIT)) {
+			l_dbg(cd, "Using journal %s", path);
+			*devfdp = devfd;
+			return jfd;
+		}
+		l_dbg(cd, "Replacing journal %s of an earlier run", path);
+		close(jfd);
+	}
+
+	if (!journal_file) {
+		mkdir(state_dir, 0755);
+		mkdir(journal_dir, 0700);
+	}
+
+	r = crypt_get_metadata_size(cd, &metadata_size, &keyslots_size);
+	if (r < 0)
+		goto fail;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	jfd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (jfd < 0) {
+		r = -errno;
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.flags = flags;
+	strncpy(hdr.uuid, uuid, sizeof(hdr.uuid));
+	strncpy(hdr.id, journal_id(), sizeof(hdr.id));
+
+	/* Primary and secondary copy of binary header and JSON area */
+	r = write_all(jfd, &hdr, sizeof(hdr), 0);
+	if (r == 0)
+		r = journal_save_region(jfd, devfd, &hdr, 0, 2 * metadata_size);
+	if (r == 0 && rename(tmp_path, path) < 0)
+		r = -errno;
+	if (r < 0) {
+		close(jfd);
+		unlink(tmp_path);
+		goto fail;
+	}
+
+	l_dbg(cd, "Created journal %s", path);
+	*devfdp = devfd;
+	return jfd;
+
+fail:
+	close(devfd);
+	return r;
+}
+
+static void
+journal_close(int jfd, int devfd)
+{
+	if (jfd >= 0)
+		close(jfd);
+	if (devfd >= 0)
+		close(devfd);
+}
+
+/*
+ * Called before an action modifies the header. Failing to write the
+ * journal is not fatal here; it only means there is nothing to roll
+ * back to.
+ */
+static void
+journal_before_update(struct crypt_device *cd, const char *journal_file)
+{
+	int jfd, devfd;
+
+	jfd = journal_open(cd, journal_file, 0, &devfd);
+	if (jfd < 0) {
+		l_err(cd, _("Warning: unable to write header journal: %s"), strerror(-jfd));
+		return;
+	}
+
+	journal_close(jfd, devfd);
+}
+
+/*
+ * Called once an action has updated the header. The journal of a
+ * single action is no longer needed; a journal from 'begin' is kept
+ * for the rest of the transaction.
+ */
+static void
+journal_after_update(struct crypt_device *cd, const char *journal_file)
+{
+	struct journal_header hdr;
+	char path[PATH_MAX];
+	int jfd;
+
+	journal_path(cd, journal_file, path, sizeof(path));
+	jfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (jfd < 0)
+		return;
+
+	if (journal_read_header(jfd, &hdr) == 0 && !(hdr.flags & JOURNAL_EXPLICIT)) {
+		l_dbg(cd, "Removing journal %s", path);
+		unlink(path);
+	}
+	close(jfd);
+}
+
+/*
+ * Save the areas of the keyslots given to 'begin --key-slots', so
+ * that a rollback can bring back keyslots the transaction destroys.
+ */
+static int
+journal_save_keyslots(struct crypt_device *cd, const char *journal_file,
+		      const bool *selected, int max_slots)
+{
+	struct journal_header hdr;
+	uint64_t offset, length;
+	int jfd, devfd, keyslot, r;
+
+	jfd = journal_open(cd, journal_file, 0, &devfd);
+	if (jfd < 0)
+		return jfd;
+
+	r = journal_read_header(jfd, &hdr);
+	for (keyslot = 0; keyslot < max_slots && r == 0; keyslot++) {
+		if (!selected[keyslot])
+			continue;
+
+		r = crypt_keyslot_area(cd, keyslot, &offset, &length);
+		if (r == 0)
+			r = journal_save_region(jfd, devfd, &hdr, offset, length);
+	}
+
+	journal_close(jfd, devfd);
+	return r;
+}
+
+static int
+journal_begin(struct crypt_device *cd, const char *journal_file, const char *keyslot_list)
+{
+	int max_slots = crypt_keyslot_max(CRYPT_LUKS2);
+	bool selected[max_slots];
+	char path[PATH_MAX];
+	int jfd, devfd, r;
+
+	memset(selected, 0, sizeof(selected));
+	if (keyslot_list) {
+		r = parse_keyslot_list(cd, keyslot_list, selected, max_slots);
+		if (r < 0)
+			return r;
+	}
+
+	/* Starting a new transaction discards whatever was there before */
+	journal_path(cd, journal_file, path, sizeof(path));
+	unlink(path);
+
+	jfd = journal_open(cd, journal_file, JOURNAL_EXPLICIT, &devfd);
+	if (jfd < 0) {
+		l_err(cd, _("Failed to create header journal %s: %s"), path, strerror(-jfd));
+		return jfd;
+	}
+	journal_close(jfd, devfd);
+
+	return journal_save_keyslots(cd, journal_file, selected, max_slots);
+}
+
+/*
+ * Read the UUID straight from the primary binary header; the JSON
+ * metadata may be too damaged for crypt_load() to succeed.
+ */
+static int
+read_device_uuid(const char *device, char *uuid)
+{
+	struct crypt_device *cd = NULL;
+	char buf[LUKS2_UUID_OFFSET + LUKS2_UUID_LEN];
+	int fd, r;
+
+	if (crypt_init(&cd, device) == 0 && crypt_load(cd, CRYPT_LUKS2, NULL) == 0) {
+		strncpy(uuid, crypt_get_uuid(cd), LUKS2_UUID_LEN);
+		crypt_free(cd);
+		return 0;
+	}
+	if (cd)
+		crypt_free(cd);
+
+	fd = open(device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	r = read_all(fd, buf, sizeof(buf), 0);
+	close(fd);
+	if (r < 0)
+		return r;
+
+	if (memcmp(buf, LUKS2_MAGIC, LUKS2_MAGIC_LEN) != 0)
+		return -EINVAL;
+
+	memcpy(uuid, buf + LUKS2_UUID_OFFSET, LUKS2_UUID_LEN);
+	return 0;
+}
+
+static int
+journal_rollback(const char *device, const char *journal_file)
+{
+	struct journal_header hdr;
+	struct journal_region region;
+	char uuid[LUKS2_UUID_LEN + 1] = "";
+	char path[PATH_MAX];
+	off_t pos = sizeof(hdr);
+	char *buf;
+	uint32_t i;
+	int jfd, devfd, r;
+
+	r = read_device_uuid(device, uuid);
+	if (r < 0 && !journal_file) {
+		l_err(NULL, _("Cannot determine the UUID of %s, please specify the journal."), device);
+		return r;
+	}
+
+	if (journal_file)
+		snprintf(path, sizeof(path), "%s", journal_file);
+	else
+		snprintf(path, sizeof(path), "%s/%s.journal", journal_dir, uuid);
+
+	jfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (jfd < 0) {
+		l_err(NULL, _("No header journal %s."), path);
+		return -ENOENT;
+	}
+
+	r = journal_read_header(jfd, &hdr);
+	if (r < 0) {
+		l_err(NULL, _("%s is not a valid header journal."), path);
+		close(jfd);
+		return r;
+	}
+
+	if (uuid[0] && strncmp(hdr.uuid, uuid, LUKS2_UUID_LEN) != 0) {
+		l_err(NULL, _("Header journal %s does not belong to %s."), path, device);
+		close(jfd);
+		return -EINVAL;
+	}
+
+	devfd = open(device, O_RDWR | O_CLOEXEC);
+	if (devfd < 0) {
+		r = -errno;
+		close(jfd);
+		return r;
+	}
+
+	for (i = 0; i < hdr.nregions && r == 0; i++) {
+		r = read_all(jfd, &region, sizeof(region), pos);
+		if (r < 0)
+			break;
+
+		buf = malloc(region.length);
+		if (!buf) {
+			r = -ENOMEM;
+			break;
+		}
+
+		r = read_all(jfd, buf, region.length, pos + sizeof(region));
+		if (r == 0)
+			r = write_all(devfd, buf, region.length, region.offset);
+
+		explicit_bzero(buf, region.length);
+		free(buf);
+		pos += sizeof(region) + region.length;
+	}
+
+	if (r == 0 && fsync(devfd) < 0)
+		r = -errno;
+
+	close(devfd);
+	close(jfd);
+
+	if (r < 0) {
+		l_err(NULL, _("Failed to restore header from journal %s: %s"), path, strerror(-r));
+		return r;
+	}
+
+	unlink(path);
+	return 0;
+}
+
+static int
+journal_commit(struct crypt_device *cd, const char *journal_file)
+{
+	char path[PATH_MAX];
+
+	journal_path(cd, journal_file, path, sizeof(path));
+	if (unlink(path) < 0 && errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Check that both copies of the binary header are there, and return
+ * the higher of their sequence IDs.
+ */
+static int
+check_header_copies(struct crypt_device *cd, const char *buf, uint64_t metadata_size,
+		    uint64_t *seqid)
+{
+	static const char *magic[2] = { LUKS2_MAGIC, LUKS2_MAGIC_2ND };
+	uint64_t value;
+	int copy;
+
+	*seqid = 0;
+	for (copy = 0; copy < 2; copy++) {
+		const char *hdr = buf + copy * metadata_size;
+
+		memcpy(&value, hdr + LUKS2_HDR_SIZE_OFFSET, sizeof(value));
+		if (memcmp(hdr, magic[copy], LUKS2_MAGIC_LEN) != 0 || be64toh(value) != metadata_size) {
+			l_err(cd, _("The %s LUKS2 header is damaged, please repair it with cryptsetup."),
+			      copy ? "secondary" : "primary");
+			return -EINVAL;
+		}
+
+		memcpy(&value, hdr + LUKS2_SEQID_OFFSET, sizeof(value));
+		if (be64toh(value) > *seqid)
+			*seqid = be64toh(value);
+	}
+
+	return 0;
+}
+
+/*
+ * Put the JSON metadata into one copy of the header and update its
+ * sequence ID and checksum. The checksum covers the binary header,
+ * with the checksum field cleared, and the JSON area.
+ */
+static int
+seal_header_copy(struct crypt_device *cd, char *hdr, uint64_t metadata_size,
+		 uint64_t seqid, const char *json, size_t json_len)
+{
+	char alg[LUKS2_CSUM_ALG_LEN + 1];
+	unsigned int csum_len;
+	const EVP_MD *md;
+
+	memcpy(alg, hdr + LUKS2_CSUM_ALG_OFFSET, LUKS2_CSUM_ALG_LEN);
+	alg[LUKS2_CSUM_ALG_LEN] = '\0';
+	md = EVP_get_digestbyname(alg);
+	if (!md || EVP_MD_size(md) > LUKS2_CSUM_LEN) {
+		l_err(cd, _("Unsupported LUKS2 header checksum %s."), alg);
+		return -ENOTSUP;
+	}
+
+	seqid = htobe64(seqid);
+	memcpy(hdr + LUKS2_SEQID_OFFSET, &seqid, sizeof(seqid));
+
+	memset(hdr + LUKS2_HDR_BIN_LEN, 0, metadata_size - LUKS2_HDR_BIN_LEN);
+	memcpy(hdr + LUKS2_HDR_BIN_LEN, json, json_len);
+
+	memset(hdr + LUKS2_CSUM_OFFSET, 0, LUKS2_CSUM_LEN);
+	if (!EVP_Digest(hdr, metadata_size, (unsigned char *) hdr + LUKS2_CSUM_OFFSET,
+			&csum_len, md, NULL))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Replace the LUKS2 metadata with jobj in a single update of the header.
+ * libcryptsetup commits the header after each keyslot or token it
+ * changes, so actions that change many of them build the new metadata
+ * themselves and write it with this, the way libcryptsetup does: both
+ * copies with the next sequence ID, the primary one first. The result
+ * is loaded once more, and the old header put back if that fails.
+ * The crypt_device context is stale afterwards.
+ */
+static int
+write_metadata(struct crypt_device *cd, json_object *jobj)
+{
+	const char *device = metadata_device_name(cd);
+	struct crypt_device *cd_check = NULL;
+	uint64_t metadata_size, keyslots_size, seqid = 0;
+	const char *json;
+	size_t json_len;
+	char *old = NULL, *new = NULL;
+	uint64_t t_start;
+	int fd, copy, r;
+
+	r = crypt_get_metadata_size(cd, &metadata_size, &keyslots_size);
+	if (r < 0)
+		return r;
+
+	json = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+	if (!json)
+		return -ENOMEM;
+
+	json_len = strlen(json) + 1;
+	if (json_len > metadata_size - LUKS2_HDR_BIN_LEN) {
+		l_err(cd, _("The LUKS2 metadata does not fit into the header."));
+		return -ENOSPC;
+	}
+
+	fd = open(device, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		r = -errno;
+		l_err(cd, _("Failed to open %s."), device);
+		return r;
+	}
+
+	old = malloc(2 * metadata_size);
+	new = malloc(2 * metadata_size);
+	if (!old || !new) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	t_start = fde_trace_begin();
+	r = read_all(fd, old, 2 * metadata_size, 0);
+	if (r == 0)
+		r = check_header_copies(cd, old, metadata_size, &seqid);
+	if (r < 0)
+		goto out;
+
+	memcpy(new, old, 2 * metadata_size);
+	for (copy = 0; copy < 2 && r == 0; copy++)
+		r = seal_header_copy(cd, new + copy * metadata_size, metadata_size,
+				     seqid + 1, json, json_len);
+	if (r < 0)
+		goto out;
+
+	for (copy = 0; copy < 2 && r == 0; copy++) {
+		r = write_all(fd, new + copy * metadata_size, metadata_size, copy * metadata_size);
+		if (r == 0 && fdatasync(fd) < 0)
+			r = -errno;
+	}
+	fde_trace_end(t_start, "write metadata of %s", device);
+
+	if (r == 0) {
+		r = crypt_init(&cd_check, device);
+		if (r == 0)
+			r = crypt_load(cd_check, CRYPT_LUKS2, NULL);
+		crypt_free(cd_check);
+	}
+
+	if (r < 0) {
+		l_err(cd, _("Failed to write the LUKS2 metadata, restoring the old header."));
+		if (write_all(fd, old, 2 * metadata_size, 0) < 0 || fdatasync(fd) < 0)
+			l_err(cd, _("Failed to restore the header of %s."), device);
+	}
+
+out:
+	close(fd);
+	free(old);
+	free(new);
+	return r;
+}
+
+/*
+ * Check the passphrase against the keyslots one by one, so that every
+ * PBKDF run counts: keyslots marked as preferred (the recovery slot)
+ * go first, grub-tpm2 keyslots go last since they hold random keys.
+ * Returns the keyslot that matched.
+ */
+static int
+verify_passphrase(struct crypt_device *cd, const char *key_file)
+{
+	static const int order[] = {
+		CRYPT_SLOT_PRIORITY_PREFER,
+		CRYPT_SLOT_PRIORITY_NORMAL,
+	};
+	int max_slots = crypt_keyslot_max(CRYPT_LUKS2);
+	int token_of_slot[max_slots];
+	int systemd_token_of_slot[max_slots];
+	crypt_keyslot_info ki;
+	size_t key_len = 0;
+	char *key = NULL;
+	uint64_t t_start;
+	int pass, keyslot, r;
+
+	r = collect_token_keyslots(cd, TOKEN_NAME, token_of_slot);
+	if (r == 0)
+		r = collect_token_keyslots(cd, SYSTEMD_TPM2_TOKEN_NAME, systemd_token_of_slot);
+	if (r < 0)
+		return r;
+
+	/* Keyslots of systemd-cryptenroll hold random keys as well */
+	for (keyslot = 0; keyslot < max_slots; keyslot++)
+		if (token_of_slot[keyslot] == CRYPT_ANY_TOKEN)
+			token_of_slot[keyslot] = systemd_token_of_slot[keyslot];
+
+	r = read_key_file(cd, key_file, &key, &key_len);
+	if (r < 0)
+		return r;
+
+	r = -EPERM;
+	for (pass = 0; pass < 3 && r < 0; pass++) {
+		for (keyslot = 0; keyslot < max_slots; keyslot++) {
+			ki = crypt_keyslot_status(cd, keyslot);
+			if (ki != CRYPT_SLOT_ACTIVE && ki != CRYPT_SLOT_ACTIVE_LAST)
+				continue;
+
+			if (pass < 2) {
+				if (token_of_slot[keyslot] != CRYPT_ANY_TOKEN)
+					continue;
+				if (crypt_keyslot_get_priority(cd, keyslot) != order[pass])
+					continue;
+			} else if (token_of_slot[keyslot] == CRYPT_ANY_TOKEN) {
+				continue;
+			}
+
+			l_dbg(cd, "Trying keyslot %d", keyslot);
+			t_start = fde_trace_begin();
+			r = crypt_activate_by_passphrase(cd, NULL, keyslot, key, key_len, 0);
+			fde_trace_end(t_start, "unlock keyslot %d", keyslot);
+			if (r >= 0)
+				break;
+		}
+	}
+
+	free_key(key, key_len);
+
+	if (r < 0)
+		l_err(cd, _("No keyslot matches the passphrase."));
+	return r;
+}
+
+/*
+ * Mark the keyslot holding the recovery password as preferred. Both
+ * libcryptsetup and the 'verify' action try preferred keyslots first.
+ */
+static int
+set_recovery_keyslot(struct crypt_device *cd, int keyslot, const char *journal_file)
+{
+	int token_id;
+	int r;
+
+	r = check_existing_tokens(cd, TOKEN_NAME, keyslot, &token_id);
+	if (r < 0)
+		return r;
+
+	if (token_id != CRYPT_ANY_TOKEN) {
+		l_err(cd, _("Keyslot %d belongs to grub-tpm2 token %d."), keyslot, token_id);
+		return -EINVAL;
+	}
+
+	switch (crypt_keyslot_get_priority(cd, keyslot)) {
+	case CRYPT_SLOT_PRIORITY_PREFER:
+		/* Nothing to do, avoid rewriting the header */
+		return 0;
+	case CRYPT_SLOT_PRIORITY_NORMAL:
+		break;
+	default:
+		l_err(cd, _("Keyslot %d is not active."), keyslot);
+		return -EINVAL;
+	}
+
+	journal_before_update(cd, journal_file);
+	r = crypt_keyslot_set_priority(cd, keyslot, CRYPT_SLOT_PRIORITY_PREFER);
+	if (r == 0)
+		journal_after_update(cd, journal_file);
+
+	return r;
+}
+
+/*
+ * Build the JSON of a new token of the given type, with no keyslots yet
+ * and the fields of the optional jobj_params copied into it.
+ */
+static json_object *
+new_token_json(const char *token_type, json_object *jobj_params)
+{
+	json_object *jobj = NULL;
+	json_object *jobj_keyslots = NULL;
+	json_object *jobj_timestamp = NULL;
+	time_t cur_time;
+	struct tm gmt_time;
+	char time_str[24];
+
+	jobj = json_object_new_object();
+	if (!jobj)
+		return NULL;
+
+	/* type is mandatory field in all tokens and must match handler name member */
+	json_object_object_add(jobj, "type", json_object_new_string(token_type));
+
+	jobj_keyslots = json_object_new_array();
+	if (!jobj_keyslots)
+		goto fail;
+
+	/* mandatory array field (may be empty and assigned later */
+	json_object_object_add(jobj, "keyslots", jobj_keyslots);
+
+	/* add timestamp */
+	cur_time = time(NULL);
+	gmtime_r(&cur_time, &gmt_time);
+	strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S UTC", &gmt_time);
+	jobj_timestamp = json_object_new_string(time_str);
+	if (!jobj_timestamp)
+		goto fail;
+	json_object_object_add(jobj, "timestamp", jobj_timestamp);
+
+	if (jobj_params) {
+		json_object_object_foreach(jobj_params, key, val)
+			json_object_object_add(jobj, key, json_object_get(val));
+	}
+
+	return jobj;
+
+fail:
+	json_object_put(jobj);
+	return NULL;
+}
+
+/*
+ * Create a new token of the given type and assign keyslot to it. The
+ * optional jobj_params holds type specific fields; they are moved into
+ * the token and the object is released in any case.
+ */
+static int
+add_new_token(struct crypt_device *cd, const char *token_type, int keyslot,
+	      json_object *jobj_params)
+{
+	json_object *jobj = NULL;
+	const char *string_token;
+	uint64_t t_start;
+	int r, token;
+
+	jobj = new_token_json(token_type, jobj_params);
+	if (!jobj) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	string_token = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
+	if (!string_token) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	l_dbg(cd, "Token JSON: %s", string_token);
+
+	t_start = fde_trace_begin();
+	r = crypt_token_json_set(cd, CRYPT_ANY_TOKEN, string_token);
+	if (r < 0) {
+		l_err(cd, _("Failed to write %s token json."), token_type);
+		goto out;
+	}
+
+	token = r;
+	r = crypt_token_assign_keyslot(cd, token, keyslot);
+	fde_trace_end(t_start, "add %s token for keyslot %d", token_type, keyslot);
+	if (r != token) {
+		crypt_token_json_set(cd, token, NULL);
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = 0;
+out:
+	json_object_put(jobj);
+	if (jobj_params)
+		json_object_put(jobj_params);
+	return r;
+}
+
+/*
+ * Write the key to a new file next to path. The caller renames it into
+ * place once the LUKS header has been updated, so that a failure does
+ * not leave us with a key file that opens nothing, or with a keyslot
+ * whose key was lost.
+ */
+static int
+write_key_file(struct crypt_device *cd, const char *path, const char *key, size_t key_len,
+	       char *tmp_path, size_t size)
+{
+	int fd, r;
+
+	snprintf(tmp_path, size, "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		l_err(cd, _("Failed to create key file %s."), path);
+		return -errno;
+	}
+
+	r = write_all(fd, key, key_len, 0);
+	if (r == 0 && fsync(fd) < 0)
+		r = -errno;
+	close(fd);
+
+	if (r < 0) {
+		l_err(cd, _("Failed to write key file %s."), path);
+		unlink(tmp_path);
+	}
+	return r;
+}
+
+static int
+get_random_bytes(struct crypt_device *cd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size) {
+		n = getrandom(buf + len, size - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			l_err(cd, _("Failed to obtain random bytes."));
+			return -EIO;
+		}
+		len += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a random key, unlock the volume key with the passphrase in
+ * key_file and enroll the new key into a fresh keyslot assigned to a
+ * grub-tpm2 token. With replace, the key replaces the one in key_file
+ * in the keyslot it opens instead, which keeps the token assignment.
+ * The new key only ever lives in locked memory and in the output file.
+ * Returns the keyslot holding the new key.
+ */
+static int
+generate_key(struct crypt_device *cd, const char *key_file, size_t key_size,
+	     const char *output, bool replace, const char *journal_file)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+		.iterations	= RANDOM_KEY_ITERATIONS,
+		.flags		= CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	char tmp_path[PATH_MAX];
+	char *pass = NULL, *key = NULL, *vk = NULL;
+	size_t pass_len = 0, vk_len;
+	uint64_t t_start;
+	int keyslot, r;
+
+	vk_len = crypt_get_volume_key_size(cd);
+	key = fde_arena_alloc(key_size);
+	vk = fde_arena_alloc(vk_len);
+	if (!key || !vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = get_random_bytes(cd, key, key_size);
+	if (r < 0)
+		goto out;
+
+	r = read_key_file(cd, key_file, &pass, &pass_len);
+	if (r < 0)
+		goto out;
+
+	t_start = fde_trace_begin();
+	r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, vk, &vk_len, pass, pass_len);
+	fde_trace_end(t_start, "unlock volume key");
+	if (r < 0) {
+		l_err(cd, _("No keyslot matches the passphrase."));
+		goto out;
+	}
+	keyslot = r;
+
+	r = write_key_file(cd, output, key, key_size, tmp_path, sizeof(tmp_path));
+	if (r < 0)
+		goto out;
+
+	r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (r < 0)
+		goto fail;
+
+	journal_before_update(cd, journal_file);
+
+	t_start = fde_trace_begin();
+	if (replace) {
+		r = crypt_keyslot_change_by_passphrase(cd, keyslot, keyslot,
+				pass, pass_len, key, key_size);
+	} else {
+		r = crypt_keyslot_add_by_key(cd, CRYPT_ANY_SLOT, vk, vk_len,
+				key, key_size, 0);
+		if (r >= 0) {
+			keyslot = r;
+			r = add_new_token(cd, TOKEN_NAME, keyslot, NULL);
+			if (r < 0)
+				crypt_keyslot_destroy(cd, keyslot);
+		}
+	}
+	fde_trace_end(t_start, "enroll random key in keyslot %d", keyslot);
+	if (r < 0) {
+		l_err(cd, _("Failed to enroll the new key."));
+		goto fail;
+	}
+	journal_after_update(cd, journal_file);
+
+	if (rename(tmp_path, output) < 0) {
+		r = -errno;
+		l_err(cd, _("Keyslot %d was updated, but the key could not be moved from %s to %s."),
+		      keyslot, tmp_path, output);
+		goto out;
+	}
+
+	r = keyslot;
+	goto out;
+
+fail:
+	unlink(tmp_path);
+out:
+	if (pass)
+		free_key(pass, pass_len);
+	fde_arena_free(key);
+	fde_arena_free(vk);
+	return r;
+}
+
+/*
+ * Find the number of PBKDF2 iterations that grub can process within
+ * budget_ms when unlocking a keyslot at boot. grub is not available to
+ * measure, so we benchmark libcryptsetup for the budget scaled down by
+ * the factor between the two. The derived key has the size of the
+ * volume key, which affects the cost of PBKDF2 as well.
+ */
+static int
+calibrate_pbkdf(struct crypt_device *cd, int budget_ms, double slowdown)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+	};
+	static const char salt[32] = "fdectl-grub-tpm2 calibration";
+	size_t vk_size = DEFAULT_VOLUME_KEY_SIZE;
+	uint64_t t_start;
+	int r;
+
+	if (crypt_get_type(cd))
+		vk_size = crypt_get_volume_key_size(cd);
+
+	pbkdf.time_ms = budget_ms / slowdown;
+	if (pbkdf.time_ms == 0)
+		pbkdf.time_ms = 1;
+
+	t_start = fde_trace_begin();
+	r = crypt_benchmark_pbkdf(cd, &pbkdf, "fde", 3, salt, sizeof(salt), vk_size, NULL, NULL);
+	fde_trace_end(t_start, "benchmark pbkdf2 for %u ms", pbkdf.time_ms);
+	if (r < 0) {
+		l_err(cd, _("PBKDF2 benchmark failed."));
+		return r;
+	}
+
+	l_dbg(cd, "%u PBKDF2 iterations take %u ms here, about %d ms in grub",
+	      pbkdf.iterations, pbkdf.time_ms, budget_ms);
+
+	if (pbkdf.iterations < RANDOM_KEY_ITERATIONS)
+		pbkdf.iterations = RANDOM_KEY_ITERATIONS;
+	if (pbkdf.iterations > INT_MAX)
+		pbkdf.iterations = INT_MAX;
+	return pbkdf.iterations;
+}
+
+struct factory_params {
+	const char *	image;
+	const char *	output;
+	const char *	firstboot_key_file;
+	size_t		key_size;
+	uint32_t	iterations;
+	off_t		image_size;
+};
+
+/*
+ * Encrypt the plaintext image into the data segment of disk, which
+ * starts at data_offset, the way dm-crypt does for aes-xts-plain64:
+ * every sector separately, with its number within the segment as IV.
+ */
+static int
+encrypt_payload(const struct factory_params *fp, const char *disk, off_t data_offset,
+		const char *vk, size_t vk_len)
+{
+	unsigned char iv[16];
+	unsigned char *in = NULL, *out = NULL;
+	EVP_CIPHER_CTX *ctx = NULL;
+	uint64_t sector = 0, t_start;
+	off_t offset;
+	size_t len, i;
+	int ifd = -1, ofd = -1, outl, r = 0;
+
+	t_start = fde_trace_begin();
+
+	if ((ifd = open(fp->image, O_RDONLY | O_CLOEXEC)) < 0
+	 || (ofd = open(disk, O_WRONLY | O_CLOEXEC)) < 0) {
+		r = -errno;
+		l_err(NULL, _("Failed to open %s: %s"), ifd < 0? fp->image : disk, strerror(-r));
+		goto out;
+	}
+
+	in = malloc(FACTORY_CHUNK_SIZE);
+	out = malloc(FACTORY_CHUNK_SIZE);
+	ctx = EVP_CIPHER_CTX_new();
+	if (!in || !out || !ctx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (vk_len != (size_t) EVP_CIPHER_key_length(EVP_aes_256_xts())
+	 || !EVP_EncryptInit_ex(ctx, EVP_aes_256_xts(), NULL, (const unsigned char *) vk, NULL)) {
+		l_err(NULL, _("Cannot set up aes-xts-plain64 encryption."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (offset = 0; offset < fp->image_size; offset += len) {
+		len = fp->image_size - offset;
+		if (len > FACTORY_CHUNK_SIZE)
+			len = FACTORY_CHUNK_SIZE;
+
+		r = read_all(ifd, in, len, offset);
+		if (r < 0) {
+			l_err(NULL, _("Failed to read %s: %s"), fp->image, strerror(-r));
+			goto out;
+		}
+
+		for (i = 0; i < len; i += FACTORY_SECTOR_SIZE, sector++) {
+			/* plain64: the sector number, little endian */
+			memset(iv, 0, sizeof(iv));
+			iv[0] = sector;
+			iv[1] = sector >> 8;
+			iv[2] = sector >> 16;
+			iv[3] = sector >> 24;
+			iv[4] = sector >> 32;
+			iv[5] = sector >> 40;
+			iv[6] = sector >> 48;
+			iv[7] = sector >> 56;
+
+			if (!EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv)
+			 || !EVP_EncryptUpdate(ctx, out + i, &outl, in + i, FACTORY_SECTOR_SIZE)) {
+				l_err(NULL, _("Failed to encrypt sector %llu."), (unsigned long long) sector);
+				r = -EIO;
+				goto out;
+			}
+		}
+
+		r = write_all(ofd, out, len, data_offset + offset);
+		if (r < 0) {
+			l_err(NULL, _("Failed to write %s: %s"), disk, strerror(-r));
+			goto out;
+		}
+	}
+
+	if (fsync(ofd) < 0)
+		r = -errno;
+	fde_trace_end(t_start, "encrypt payload into %s", disk);
+
+out:
+	if (ctx)
+		EVP_CIPHER_CTX_free(ctx);
+	free(in);
+	free(out);
+	if (ifd >= 0)
+		close(ifd);
+	if (ofd >= 0)
+		close(ofd);
+	return r;
+}
+
+/*
+ * Random recovery password in the format of fde_random_password,
+ * xxxx-xxxx-... in hex.
+ */
+static int
+make_recovery_password(char *buf, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char bytes[2 * RECOVERY_PASSWORD_GROUPS];
+	size_t i, len = 0;
+	int r;
+
+	if (size < 5 * RECOVERY_PASSWORD_GROUPS)
+		return -EINVAL;
+
+	r = get_random_bytes(NULL, (char *) bytes, sizeof(bytes));
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < sizeof(bytes); i++) {
+		if (i && i % 2 == 0)
+			buf[len++] = '-';
+		buf[len++] = hex[bytes[i] >> 4];
+		buf[len++] = hex[bytes[i] & 0xf];
+	}
+	buf[len] = '\0';
+
+	explicit_bzero(bytes, sizeof(bytes));
+	return len;
+}
+
+static int
+install_key_file(struct crypt_device *cd, const char *dir, const char *name,
+		 const char *key, size_t key_len)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	int r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	r = write_key_file(cd, path, key, key_len, tmp_path, sizeof(tmp_path));
+	if (r < 0)
+		return r;
+
+	if (rename(tmp_path, path) < 0) {
+		r = -errno;
+		l_err(cd, _("Failed to create key file %s."), path);
+		unlink(tmp_path);
+	}
+	return r;
+}
+
+/*
+ * Create the files for one host in <output>/host-NNNN:
+ *   disk.img		LUKS2 volume with a volume key of its own, holding
+ *			the plaintext image encrypted with that key
+ *   recovery.key	the recovery password, in the preferred keyslot
+ *   root.key		a random key in a keyslot of a grub-tpm2 token,
+ *			to be sealed on first boot
+ * and, with a firstboot key, a keyslot for that passphrase.
+ */
+static int
+factory_make_host(const struct factory_params *fp, unsigned int host,
+		  const char *firstboot_pass, size_t firstboot_len)
+{
+	struct crypt_pbkdf_type pbkdf_pass = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+		.iterations	= fp->iterations,
+		.flags		= CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	struct crypt_pbkdf_type pbkdf_key = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+		.iterations	= RANDOM_KEY_ITERATIONS,
+		.flags		= CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	struct crypt_params_luks2 params = {
+		.pbkdf		= &pbkdf_pass,
+		.data_alignment	= FACTORY_HEADER_SIZE / 512,
+		.sector_size	= FACTORY_SECTOR_SIZE,
+	};
+	char dir[PATH_MAX], disk[PATH_MAX];
+	char *vk = NULL, *key = NULL, *recovery = NULL;
+	size_t vk_len = DEFAULT_VOLUME_KEY_SIZE, recovery_len;
+	struct crypt_device *cd = NULL;
+	off_t data_offset;
+	uint64_t t_start;
+	int fd, keyslot, r;
+
+	snprintf(dir, sizeof(dir), "%s/" FACTORY_HOST_DIR, fp->output, host);
+	snprintf(disk, sizeof(disk), "%s/disk.img", dir);
+
+	if (mkdir(dir, 0700) < 0) {
+		r = -errno;
+		l_err(NULL, _("Failed to create %s: %s"), dir, strerror(-r));
+		return r;
+	}
+
+	if ((fd = open(disk, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0
+	 || ftruncate(fd, FACTORY_HEADER_SIZE + fp->image_size) < 0) {
+		r = -errno;
+		l_err(NULL, _("Failed to create %s: %s"), disk, strerror(-r));
+		if (fd >= 0)
+			close(fd);
+		return r;
+	}
+	close(fd);
+
+	vk = fde_arena_alloc(vk_len);
+	key = fde_arena_alloc(fp->key_size);
+	recovery = fde_arena_alloc(5 * RECOVERY_PASSWORD_GROUPS);
+	if (!vk || !key || !recovery) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if ((r = get_random_bytes(NULL, vk, vk_len)) < 0
+	 || (r = get_random_bytes(NULL, key, fp->key_size)) < 0
+	 || (r = make_recovery_password(recovery, 5 * RECOVERY_PASSWORD_GROUPS)) < 0)
+		goto out;
+	recovery_len = r;
+
+	r = crypt_init(&cd, disk);
+	if (r < 0) {
+		l_err(NULL, _("Failed to initialize %s."), disk);
+		goto out;
+	}
+
+	t_start = fde_trace_begin();
+	r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, vk, vk_len, &params);
+	fde_trace_end(t_start, "format %s", disk);
+	if (r < 0) {
+		l_err(cd, _("Failed to format %s."), disk);
+		goto out;
+	}
+
+	/* In 512 byte sectors, whatever the sector size of the volume */
+	data_offset = crypt_get_data_offset(cd) * 512;
+	if (data_offset != FACTORY_HEADER_SIZE) {
+		l_err(cd, _("Unexpected data offset %lld in %s."), (long long) data_offset, disk);
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = crypt_set_pbkdf_type(cd, &pbkdf_pass);
+	if (r < 0)
+		goto out;
+
+	r = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, vk, vk_len, recovery, recovery_len);
+	if (r < 0) {
+		l_err(cd, _("Failed to add the recovery password."));
+		goto out;
+	}
+	keyslot = r;
+
+	r = crypt_keyslot_set_priority(cd, keyslot, CRYPT_SLOT_PRIORITY_PREFER);
+	if (r < 0)
+		goto out;
+
+	if (firstboot_pass) {
+		r = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, vk, vk_len,
+						    firstboot_pass, firstboot_len);
+		if (r < 0) {
+			l_err(cd, _("Failed to add the firstboot key."));
+			goto out;
+		}
+	}
+
+	r = crypt_set_pbkdf_type(cd, &pbkdf_key);
+	if (r < 0)
+		goto out;
+
+	r = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, vk, vk_len, key, fp->key_size);
+	if (r < 0) {
+		l_err(cd, _("Failed to add the random key."));
+		goto out;
+	}
+	keyslot = r;
+
+	r = add_new_token(cd, TOKEN_NAME, keyslot, NULL);
+	if (r < 0)
+		goto out;
+
+	if ((r = install_key_file(cd, dir, "recovery.key", recovery, recovery_len)) < 0
+	 || (r = install_key_file(cd, dir, "root.key", key, fp->key_size)) < 0)
+		goto out;
+
+	r = encrypt_payload(fp, disk, data_offset, vk, vk_len);
+	if (r < 0)
+		goto out;
+
+	/* One line per host, short enough to be written atomically */
+	printf("%s %s\n", dir, crypt_get_uuid(cd));
+	fflush(stdout);
+	r = 0;
+
+out:
+	if (cd)
+		crypt_free(cd);
+	fde_arena_free(vk);
+	fde_arena_free(key);
+	fde_arena_free(recovery);
+	return r;
+}
+
+/*
+ * Worker number worker of jobs takes every jobs'th host. It runs in a
+ * child process; the memory locks of the arena are not inherited across
+ * fork(), so all secrets are allocated here rather than in the parent.
+ */
+static int
+factory_worker(const struct factory_params *fp, unsigned int worker,
+	       unsigned int jobs, unsigned int count)
+{
+	char *firstboot_pass = NULL;
+	size_t firstboot_len = 0;
+	unsigned int host;
+	int r = 0;
+
+	if (fp->firstboot_key_file) {
+		r = read_key_file(NULL, fp->firstboot_key_file, &firstboot_pass, &firstboot_len);
+		if (r < 0)
+			return r;
+	}
+
+	for (host = worker; host < count; host += jobs) {
+		r = factory_make_host(fp, host, firstboot_pass, firstboot_len);
+		if (r < 0)
+			break;
+	}
+
+	if (firstboot_pass)
+		free_key(firstboot_pass, firstboot_len);
+	return r;
+}
+
+/*
+ * Make count hosts' worth of LUKS2 images and keys from the plaintext
+ * image, in jobs parallel processes.
+ */
+static int
+factory(struct factory_params *fp, unsigned int count, unsigned int jobs,
+	int budget_ms, double slowdown)
+{
+	struct crypt_device *cd = NULL;
+	unsigned int worker, failed = 0;
+	int fd, status, r;
+	pid_t pid;
+
+	if ((fd = open(fp->image, O_RDONLY | O_CLOEXEC)) < 0) {
+		l_err(NULL, _("Failed to open %s: %s"), fp->image, strerror(errno));
+		return -errno;
+	}
+	fp->image_size = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	if (fp->image_size <= 0 || fp->image_size % FACTORY_SECTOR_SIZE) {
+		l_err(NULL, _("The size of %s is not a multiple of %d bytes."), fp->image, FACTORY_SECTOR_SIZE);
+		return -EINVAL;
+	}
+
+	if (mkdir(fp->output, 0700) < 0 && errno != EEXIST) {
+		l_err(NULL, _("Failed to create %s: %s"), fp->output, strerror(errno));
+		return -errno;
+	}
+
+	/* Every host gets the same cost for the passwords grub has to unlock */
+	r = crypt_init(&cd, NULL);
+	if (r < 0)
+		return r;
+	r = calibrate_pbkdf(cd, budget_ms, slowdown);
+	crypt_free(cd);
+	if (r < 0)
+		return r;
+	fp->iterations = r;
+
+	if (jobs > count)
+		jobs = count;
+
+	fflush(stdout);
+	for (worker = 0; worker < jobs; worker++) {
+		pid = fork();
+		if (pid < 0) {
+			l_err(NULL, _("Failed to start worker %u: %s"), worker, strerror(errno));
+			failed++;
+			break;
+		}
+		if (pid == 0)
+			_exit(factory_worker(fp, worker, jobs, count) < 0? EXIT_FAILURE : 0);
+	}
+
+	while ((pid = wait(&status)) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	return failed? -EIO : 0;
+}
+
+static bool
+is_hex_string(const char *str, size_t min_len)
+{
+	size_t len = strlen(str);
+
+	if (len < min_len || len % 2)
+		return false;
+
+	return strspn(str, "0123456789abcdefABCDEF") == len;
+}
+
+/*
+ * The fde-fido2 token caches what fde-token needs to ask the FIDO2
+ * authenticator for the volume secret directly: the ID of the resident
+ * credential, the salt passed to the hmac-secret extension and the
+ * AAGUID of the authenticator holding the credential. Without it,
+ * fde-token has to enumerate the resident credentials on every device
+ * with credential management, which is slow and usually needs the PIN.
+ */
+static json_object *
+fido2_token_params(struct crypt_device *cd, const char *credential,
+		   const char *aaguid, const char *salt)
+{
+	json_object *jobj_params;
+
+	if (!credential || !salt) {
+		l_err(cd, _("Both the FIDO2 credential and salt must be specified."));
+		return NULL;
+	}
+
+	if (!is_hex_string(credential, 2)) {
+		l_err(cd, _("Invalid FIDO2 credential ID %s."), credential);
+		return NULL;
+	}
+
+	/* The hmac-secret extension takes a 32 byte salt */
+	if (!is_hex_string(salt, 64) || strlen(salt) != 64) {
+		l_err(cd, _("Invalid FIDO2 salt %s."), salt);
+		return NULL;
+	}
+
+	if (aaguid && (!is_hex_string(aaguid, 32) || strlen(aaguid) != 32)) {
+		l_err(cd, _("Invalid FIDO2 AAGUID %s."), aaguid);
+		return NULL;
+	}
+
+	jobj_params = json_object_new_object();
+	if (!jobj_params)
+		return NULL;
+
+	json_object_object_add(jobj_params, "fido2-credential", json_object_new_string(credential));
+	json_object_object_add(jobj_params, "fido2-salt", json_object_new_string(salt));
+	if (aaguid)
+		json_object_object_add(jobj_params, "fido2-aaguid", json_object_new_string(aaguid));
+
+	return jobj_params;
+}
+
+static int
+add_fido2_token(struct crypt_device *cd, int keyslot, const char *credential,
+		const char *aaguid, const char *salt)
+{
+	json_object *jobj_params;
+
+	jobj_params = fido2_token_params(cd, credential, aaguid, salt);
+	if (!jobj_params)
+		return -EINVAL;
+
+	return add_new_token(cd, FIDO2_TOKEN_NAME, keyslot, jobj_params);
+}
+
+struct fido2_record {
+	int	keyslot;
+	char	credential[2 * 1024 + 1];
+	char	aaguid[2 * 16 + 1];
+	char	salt[2 * 32 + 1];
+	char	key[2 * FIDO2_KEY_MAX + 1];
+};
+
+/*
+ * Store one line of a FIDO2 record, refusing values that do not fit
+ * and fields given twice.
+ */
+static int
+set_fido2_field(char *field, size_t size, const char *value)
+{
+	if (field[0] != '\0' || strlen(value) >= size)
+		return -EINVAL;
+
+	strcpy(field, value);
+	return 0;
+}
+
+/*
+ * Destroy the keyslots created for the FIDO2 keys of the first nrecords
+ * records
+ */
+static void
+remove_fido2_keyslots(struct crypt_device *cd, const struct fido2_record *records, int nrecords)
+{
+	int i;
+
+	for (i = 0; i < nrecords; i++) {
+		if (records[i].key[0] && records[i].keyslot >= 0)
+			crypt_keyslot_destroy(cd, records[i].keyslot);
+	}
+}
+
+/*
+ * Create a keyslot for the FIDO2_KEY of each record that has one, using
+ * the volume key unlocked with the passphrase in key_file. The key is
+ * the hmac-secret output of the authenticator, a random 32 bytes, so it
+ * gets the cheap PBKDF of the keys made by genkey. libcryptsetup has to
+ * encrypt the volume key into the keyslot area, which it does with one
+ * header update per keyslot; the keyslots created so far are destroyed
+ * again if a later one fails.
+ */
+static int
+add_fido2_keyslots(struct crypt_device *cd, const char *key_file,
+		   struct fido2_record *records, int nrecords)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type		= CRYPT_KDF_PBKDF2,
+		.hash		= "sha256",
+		.iterations	= RANDOM_KEY_ITERATIONS,
+		.flags		= CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	char *pass = NULL, *key = NULL, *vk = NULL;
+	size_t pass_len = 0, key_len, vk_len;
+	uint64_t t_start;
+	int i, r;
+
+	vk_len = crypt_get_volume_key_size(cd);
+	key = fde_arena_alloc(FIDO2_KEY_MAX);
+	vk = fde_arena_alloc(vk_len);
+	if (!key || !vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = read_key_file(cd, key_file, &pass, &pass_len);
+	if (r < 0)
+		goto out;
+
+	t_start = fde_trace_begin();
+	r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, vk, &vk_len, pass, pass_len);
+	fde_trace_end(t_start, "unlock volume key");
+	if (r < 0) {
+		l_err(cd, _("No keyslot matches the passphrase."));
+		goto out;
+	}
+
+	r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < nrecords; i++) {
+		if (!records[i].key[0])
+			continue;
+
+		for (key_len = 0; records[i].key[2 * key_len]; key_len++)
+			sscanf(records[i].key + 2 * key_len, "%2hhx", (unsigned char *) &key[key_len]);
+
+		t_start = fde_trace_begin();
+		r = crypt_keyslot_add_by_key(cd, CRYPT_ANY_SLOT, vk, vk_len, key, key_len, 0);
+		fde_trace_end(t_start, "enroll FIDO2 key of record %d", i + 1);
+		if (r < 0) {
+			l_err(cd, _("Failed to enroll the FIDO2 key of record %d."), i + 1);
+			remove_fido2_keyslots(cd, records, i);
+			goto out;
+		}
+		records[i].keyslot = r;
+	}
+	r = 0;
+
+out:
+	if (pass)
+		free_key(pass, pass_len);
+	fde_arena_free(key);
+	fde_arena_free(vk);
+	return r;
+}
+
+/*
+ * Add the fde-fido2 tokens of all records in a single header update,
+ * each one with the lowest free token ID.
+ */
+static int
+write_fido2_tokens(struct crypt_device *cd, const struct fido2_record *records, int nrecords)
+{
+	json_object *jobj, *jobj_tokens, *jobj_token, *jobj_keyslots, *jobj_params;
+	const char *json;
+	char token_id[16], keyslot[16];
+	int i, id = 0, r;
+
+	r = crypt_dump_json(cd, &json, 0);
+	if (r) {
+		l_err(cd, _("Failed to dump json."));
+		return -EINVAL;
+	}
+
+	jobj = json_tokener_parse(json);
+	if (!jobj) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	if (!json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
+		l_err(cd, _("Failed to get tokens."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < nrecords; i++) {
+		jobj_params = fido2_token_params(cd, records[i].credential,
+				records[i].aaguid[0]? records[i].aaguid : NULL, records[i].salt);
+		if (!jobj_params) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		jobj_token = new_token_json(FIDO2_TOKEN_NAME, jobj_params);
+		json_object_put(jobj_params);
+		if (!jobj_token) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		snprintf(keyslot, sizeof(keyslot), "%d", records[i].keyslot);
+		json_object_object_get_ex(jobj_token, "keyslots", &jobj_keyslots);
+		json_object_array_add(jobj_keyslots, json_object_new_string(keyslot));
+
+		do
+			snprintf(token_id, sizeof(token_id), "%d", id++);
+		while (json_object_object_get_ex(jobj_tokens, token_id, NULL));
+
+		if (id > LUKS2_TOKENS_MAX) {
+			l_err(cd, _("No free token for keyslot %d."), records[i].keyslot);
+			json_object_put(jobj_token);
+			r = -ENOSPC;
+			goto out;
+		}
+
+		l_dbg(cd, "Adding token %s for keyslot %s", token_id, keyslot);
+		json_object_object_add(jobj_tokens, token_id, jobj_token);
+	}
+
+	r = write_metadata(cd, jobj);
+
+out:
+	json_object_put(jobj);
+	return r;
+}
+
+/*
+ * Add the fde-fido2 tokens for several FIDO2 keys, eg as enrolled by
+ * "fde-token enroll --all UUID". The file holds one paragraph per key as
+ * printed by fde-token. A paragraph with FIDO2_KEY gets a new keyslot
+ * for that key, which needs the passphrase in key_file; otherwise the
+ * caller adds FIDO2_KEYSLOT to name the keyslot already holding it.
+ * The whole file is checked before the header is touched, and all
+ * tokens are written in one header update after the keyslots exist.
+ */
+static int
+add_fido2_tokens(struct crypt_device *cd, const char *params_file, const char *key_file,
+		 const char *journal_file)
+{
+	int max_slots = crypt_keyslot_max(CRYPT_LUKS2);
+	struct fido2_record *records, *rec = NULL;
+	char line[4096], *value, *end;
+	int i, j, nrecords = 0, nkeys = 0, token_id;
+	FILE *fp;
+	int r = 0;
+
+	if (!(fp = fopen(params_file, "r"))) {
+		l_err(cd, _("Failed to open %s."), params_file);
+		return -errno;
+	}
+
+	records = calloc(max_slots, sizeof(*records));
+	if (!records) {
+		fclose(fp);
+		return -ENOMEM;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strchr(line, '\n') && !feof(fp)) {
+			l_err(cd, _("Line too long in %s."), params_file);
+			r = -EINVAL;
+			goto out;
+		}
+		line[strcspn(line, "\n")] = '\0';
+
+		if (line[0] == '\0') {
+			rec = NULL;
+			continue;
+		}
+
+		if (!(value = strchr(line, '='))) {
+			l_err(cd, _("Malformed line in %s: %s"), params_file, line);
+			r = -EINVAL;
+			goto out;
+		}
+		*value++ = '\0';
+
+		if (!rec) {
+			if (nrecords >= max_slots) {
+				l_err(cd, _("Too many records in %s."), params_file);
+				r = -EINVAL;
+				goto out;
+			}
+			rec = &records[nrecords++];
+			rec->keyslot = CRYPT_ANY_SLOT;
+		}
+
+		if (!strcmp(line, "FIDO2_KEYSLOT")) {
+			if (rec->keyslot != CRYPT_ANY_SLOT)
+				r = -EINVAL;
+			rec->keyslot = strtol(value, &end, 10);
+			if (end == value || *end != '\0' || rec->keyslot < 0)
+				r = -EINVAL;
+		} else if (!strcmp(line, "FIDO2_CREDENTIAL")) {
+			r = set_fido2_field(rec->credential, sizeof(rec->credential), value);
+		} else if (!strcmp(line, "FIDO2_AAGUID")) {
+			r = set_fido2_field(rec->aaguid, sizeof(rec->aaguid), value);
+		} else if (!strcmp(line, "FIDO2_SALT")) {
+			r = set_fido2_field(rec->salt, sizeof(rec->salt), value);
+		} else if (!strcmp(line, "FIDO2_KEY")) {
+			r = set_fido2_field(rec->key, sizeof(rec->key), value);
+		} else if (strcmp(line, "FIDO2_DEVICE") != 0) {
+			/* fde-token prints FIDO2_DEVICE for information only */
+			l_err(cd, _("Unknown field %s in %s."), line, params_file);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (r < 0) {
+			l_err(cd, _("Invalid or repeated %s in record %d of %s."), line, nrecords, params_file);
+			goto out;
+		}
+	}
+
+	if (nrecords == 0) {
+		l_err(cd, _("No FIDO2 records in %s."), params_file);
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < nrecords; i++) {
+		rec = &records[i];
+
+		if (rec->key[0]) {
+			if (rec->keyslot != CRYPT_ANY_SLOT || !is_hex_string(rec->key, 2)) {
+				l_err(cd, _("Record %d in %s needs either FIDO2_KEY or FIDO2_KEYSLOT."),
+				      i + 1, params_file);
+				r = -EINVAL;
+				goto out;
+			}
+			if (!key_file) {
+				l_err(cd, _("FIDO2_KEY in %s requires --key-file."), params_file);
+				r = -EINVAL;
+				goto out;
+			}
+			nkeys++;
+		} else if (rec->keyslot < 0 || rec->keyslot >= max_slots
+		 || crypt_keyslot_status(cd, rec->keyslot) < CRYPT_SLOT_ACTIVE) {
+			l_err(cd, _("Record %d in %s lacks a valid FIDO2_KEYSLOT."), i + 1, params_file);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (!is_hex_string(rec->credential, 2) || strlen(rec->salt) != 64
+		 || !is_hex_string(rec->salt, 64)
+		 || (rec->aaguid[0] && !is_hex_string(rec->aaguid, 32))) {
+			l_err(cd, _("Record %d in %s has malformed FIDO2 parameters."), i + 1, params_file);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (rec->key[0])
+			continue;
+
+		for (j = 0; j < i; j++) {
+			if (records[j].keyslot == rec->keyslot) {
+				l_err(cd, _("Records %d and %d in %s are both for keyslot %d."),
+				      j + 1, i + 1, params_file, rec->keyslot);
+				r = -EINVAL;
+				goto out;
+			}
+		}
+
+		r = check_existing_tokens(cd, FIDO2_TOKEN_NAME, rec->keyslot, &token_id);
+		if (r < 0)
+			goto out;
+		if (token_id != CRYPT_ANY_TOKEN) {
+			l_err(cd, _("Keyslot %d already in token %d."), rec->keyslot, token_id);
+			r = -EEXIST;
+			goto out;
+		}
+	}
+
+	journal_before_update(cd, journal_file);
+
+	if (nkeys) {
+		r = add_fido2_keyslots(cd, key_file, records, nrecords);
+		if (r < 0)
+			goto out;
+	}
+
+	r = write_fido2_tokens(cd, records, nrecords);
+	if (r < 0) {
+		remove_fido2_keyslots(cd, records, nrecords);
+		goto out;
+	}
+	journal_after_update(cd, journal_file);
+
+out:
+	fclose(fp);
+	explicit_bzero(records, max_slots * sizeof(*records));
+	free(records);
+	return r;
+}
+
+/*
+ * Print the parameters of the fde-fido2 token assigned to keyslot (or of
+ * the first one with a keyslot) as shell variable assignments, for
+ * consumption by fde-token. All values are verified to be plain hex
+ * strings, so the output is safe to eval.
+ */
+static int
+print_fido2_params(struct crypt_device *cd, int keyslot)
+{
+	const char *json;
+	json_object *jobj;
+	json_object *jobj_tokens;
+	json_object *jobj_type;
+	json_object *jobj_keyslots;
+	json_object *jobj_credential;
+	json_object *jobj_salt;
+	json_object *jobj_aaguid;
+	const char *credential, *salt, *aaguid;
+	int i, token_keyslot;
+	int r;
+
+	r = crypt_dump_json(cd, &json, 0);
+	if (r) {
+		l_err(cd, _("Failed to dump json."));
+		return -EINVAL;
+	}
+
+	jobj = json_tokener_parse(json);
+	if (!jobj) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	if (!json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
+		l_err(cd, _("Failed to get tokens."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = -ENOENT;
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		if (!json_object_object_get_ex(val, "type", &jobj_type))
+			continue;
+
+		if (strcmp(json_object_get_string(jobj_type), FIDO2_TOKEN_NAME) != 0)
+			continue;
+
+		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots))
+			continue;
+
+		token_keyslot = CRYPT_ANY_SLOT;
+		for (i = 0; i < json_object_array_length(jobj_keyslots); i++) {
+			int ks = atoi(json_object_get_string(json_object_array_get_idx(jobj_keyslots, i)));
+
+			if (keyslot == CRYPT_ANY_SLOT || ks == keyslot) {
+				token_keyslot = ks;
+				break;
+			}
+		}
+
+		if (token_keyslot == CRYPT_ANY_SLOT)
+			continue;
+
+		if (!json_object_object_get_ex(val, "fido2-credential", &jobj_credential)
+		 || !json_object_object_get_ex(val, "fido2-salt", &jobj_salt)) {
+			l_err(cd, _("Token %s lacks the FIDO2 credential or salt."), slot);
+			r = -EINVAL;
+			goto out;
+		}
+
+		credential = json_object_get_string(jobj_credential);
+		salt = json_object_get_string(jobj_salt);
+		aaguid = NULL;
+		if (json_object_object_get_ex(val, "fido2-aaguid", &jobj_aaguid))
+			aaguid = json_object_get_string(jobj_aaguid);
+
+		if (!is_hex_string(credential, 2) || !is_hex_string(salt, 64)
+		 || (aaguid && !is_hex_string(aaguid, 32))) {
+			l_err(cd, _("Token %s has malformed FIDO2 parameters."), slot);
+			r = -EINVAL;
+			goto out;
+		}
+
+		printf("FIDO2_TOKEN=%s\n", slot);
+		printf("FIDO2_KEYSLOT=%d\n", token_keyslot);
+		printf("FIDO2_CREDENTIAL=%s\n", credential);
+		printf("FIDO2_SALT=%s\n", salt);
+		if (aaguid)
+			printf("FIDO2_AAGUID=%s\n", aaguid);
+		r = 0;
+		break;
+	}
+
+	if (r == -ENOENT)
+		l_err(cd, _("No %s token found."), FIDO2_TOKEN_NAME);
+out:
+	json_object_put(jobj);
+	return r;
+}
+
+static int
+clean_empty_tokens (struct crypt_device *cd, const char *token_type)
+{
+	const char *json;
+	json_object *jobj;
+	json_object *jobj_tokens;
+	json_object *jobj_type;
+	json_object *jobj_keyslots;
+	int token;
+	int r;
+
+	if (!cd)
+		return -1;
+
+	r = crypt_dump_json(cd, &json, 0);
+	if (r) {
+		l_err(cd, _("Failed to dump json."));
+		return -EINVAL;
+	}
+
+	jobj = json_tokener_parse(json);
+	if (!jobj) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	if (!json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
+		l_err(cd, _("Failed to get tokens."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (json_object_object_length(jobj_tokens) == 0) {
+		r = 0;
+		goto out;
+	}
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		if (!json_object_object_get_ex(val, "type", &jobj_type)) {
+			l_err(cd, _("Failed to get type for token %s."), slot);
+			continue;
+		}
+
+		if (strcmp(json_object_get_string(jobj_type), token_type) != 0)
+			continue;
+
+		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots)) {
+			l_err(cd, _("Failed to get keyslots for token %s."), slot);
+			continue;
+		}
+
+		/* check 'keyslots' and remove this token if the array is empty */
+		if (json_object_array_length(jobj_keyslots) == 0) {
+			token = atoi(slot);
+			crypt_token_json_set(cd, token, NULL);
+		}
+	}
+
+	r = 0;
+out:
+	json_object_put(jobj);
+	return r;
+}
+
+/*
+ * Select all but the 'keep' newest keyslots with a token, based on the
+ * timestamp of their tokens. Timestamps have a fixed format, so they
+ * compare correctly as strings; the token ID breaks ties, and is all
+ * there is for tokens without a timestamp, such as systemd-tpm2.
+ */
+static int
+select_stale_keyslots(struct crypt_device *cd, const int *token_of_slot,
+		      bool *selected, int max_slots, int keep)
+{
+	const char *stamps[max_slots];
+	const char *json;
+	json_object *jobj_token;
+	json_object *jobj_timestamp;
+	json_object *jobjs[max_slots];
+	int keyslot, other, newer;
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++) {
+		stamps[keyslot] = "";
+		jobjs[keyslot] = NULL;
+
+		if (token_of_slot[keyslot] == CRYPT_ANY_TOKEN)
+			continue;
+		if (crypt_token_json_get(cd, token_of_slot[keyslot], &json) < 0)
+			continue;
+		if (!(jobj_token = json_tokener_parse(json)))
+			continue;
+
+		jobjs[keyslot] = jobj_token;
+		if (json_object_object_get_ex(jobj_token, "timestamp", &jobj_timestamp))
+			stamps[keyslot] = json_object_get_string(jobj_timestamp);
+	}
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++) {
+		if (token_of_slot[keyslot] == CRYPT_ANY_TOKEN)
+			continue;
+
+		newer = 0;
+		for (other = 0; other < max_slots; other++) {
+			int cmp;
+
+			if (other == keyslot || token_of_slot[other] == CRYPT_ANY_TOKEN)
+				continue;
+
+			cmp = strcmp(stamps[other], stamps[keyslot]);
+			if (cmp > 0 || (cmp == 0 && token_of_slot[other] > token_of_slot[keyslot]))
+				newer++;
+		}
+
+		if (newer >= keep)
+			selected[keyslot] = true;
+	}
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++)
+		if (jobjs[keyslot])
+			json_object_put(jobjs[keyslot]);
+
+	return 0;
+}
+
+/*
+ * Remove the selected keyslots from a "keyslots" array of a digest or
+ * token, and return how many are left.
+ */
+static size_t
+drop_keyslot_refs(json_object *jobj_keyslots, const bool *selected, int max_slots)
+{
+	size_t i = json_object_array_length(jobj_keyslots);
+	int keyslot;
+
+	while (i-- > 0) {
+		keyslot = atoi(json_object_get_string(json_object_array_get_idx(jobj_keyslots, i)));
+		if (keyslot >= 0 && keyslot < max_slots && selected[keyslot])
+			json_object_array_del_idx(jobj_keyslots, i, 1);
+	}
+
+	return json_object_array_length(jobj_keyslots);
+}
+
+/*
+ * Drop the selected keyslots from the LUKS2 metadata, as well as the
+ * tokens of token_type that are left without a keyslot. This is what
+ * crypt_keyslot_destroy() and clean_empty_tokens() do, minus the
+ * header write after each of them.
+ */
+static int
+drop_keyslots(struct crypt_device *cd, json_object *jobj, const char *token_type,
+	      const bool *selected, int max_slots)
+{
+	json_object *jobj_keyslots, *jobj_digests, *jobj_tokens;
+	json_object *jobj_refs, *jobj_type;
+	char key[16];
+	char *empty[max_slots];
+	int keyslot, nempty = 0, i;
+
+	if (!json_object_object_get_ex(jobj, "keyslots", &jobj_keyslots)
+	 || !json_object_object_get_ex(jobj, "digests", &jobj_digests)
+	 || !json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++) {
+		if (!selected[keyslot])
+			continue;
+		snprintf(key, sizeof(key), "%d", keyslot);
+		json_object_object_del(jobj_keyslots, key);
+	}
+
+	json_object_object_foreach(jobj_digests, digest, jobj_digest) {
+		(void) digest;
+		if (json_object_object_get_ex(jobj_digest, "keyslots", &jobj_refs))
+			drop_keyslot_refs(jobj_refs, selected, max_slots);
+	}
+
+	json_object_object_foreach(jobj_tokens, token, jobj_token) {
+		if (!json_object_object_get_ex(jobj_token, "keyslots", &jobj_refs))
+			continue;
+		if (drop_keyslot_refs(jobj_refs, selected, max_slots) != 0)
+			continue;
+		if (json_object_object_get_ex(jobj_token, "type", &jobj_type)
+		 && strcmp(json_object_get_string(jobj_type), token_type) == 0
+		 && nempty < max_slots)
+			empty[nempty++] = token;
+	}
+
+	/* Not while iterating over the tokens */
+	for (i = 0; i < nempty; i++)
+		json_object_object_del(jobj_tokens, empty[i]);
+
+	return 0;
+}
+
+/*
+ * Overwrite the areas of destroyed keyslots with random data
+ */
+static int
+wipe_keyslot_areas(struct crypt_device *cd, const uint64_t *offsets, const uint64_t *lengths,
+		   const bool *selected, int max_slots)
+{
+	const char *device = metadata_device_name(cd);
+	uint64_t t_start;
+	char *buf;
+	int fd, keyslot, r = 0;
+
+	fd = open(device, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	for (keyslot = 0; keyslot < max_slots && r == 0; keyslot++) {
+		if (!selected[keyslot])
+			continue;
+
+		if (!(buf = malloc(lengths[keyslot]))) {
+			r = -ENOMEM;
+			break;
+		}
+
+		t_start = fde_trace_begin();
+		r = get_random_bytes(cd, buf, lengths[keyslot]);
+		if (r == 0)
+			r = write_all(fd, buf, lengths[keyslot], offsets[keyslot]);
+		fde_trace_end(t_start, "wipe keyslot %d", keyslot);
+		free(buf);
+	}
+
+	if (r == 0 && fdatasync(fd) < 0)
+		r = -errno;
+	close(fd);
+
+	if (r < 0)
+		l_err(cd, _("Failed to wipe the areas of the removed keyslots."));
+	return r;
+}
+
+/*
+ * Remove a set of keyslots of the given token type together with their
+ * tokens. All checks are done up front, so that either all keyslots are
+ * removed, or nothing is touched at all. The keyslots and tokens are
+ * dropped from the metadata in one header update, and their areas are
+ * wiped afterwards.
+ */
+static int
+prune_keyslots(struct crypt_device *cd, const char *token_type, const char *keyslot_list,
+	       int keep, const char *journal_file)
+{
+	int max_slots = crypt_keyslot_max(CRYPT_LUKS2);
+	int token_of_slot[max_slots];
+	bool selected[max_slots];
+	uint64_t offsets[max_slots], lengths[max_slots];
+	crypt_keyslot_info ki;
+	json_object *jobj;
+	const char *json;
+	int keyslot, active = 0, remove = 0;
+	int r;
+
+	memset(selected, 0, sizeof(selected));
+
+	r = collect_token_keyslots(cd, token_type, token_of_slot);
+	if (r < 0)
+		return r;
+
+	if (keyslot_list) {
+		r = parse_keyslot_list(cd, keyslot_list, selected, max_slots);
+		if (r < 0)
+			return r;
+	} else {
+		for (keyslot = 0; keyslot < max_slots; keyslot++)
+			selected[keyslot] = token_of_slot[keyslot] != CRYPT_ANY_TOKEN;
+	}
+
+	if (keep > 0) {
+		bool stale[max_slots];
+
+		memset(stale, 0, sizeof(stale));
+		r = select_stale_keyslots(cd, token_of_slot, stale, max_slots, keep);
+		if (r < 0)
+			return r;
+
+		for (keyslot = 0; keyslot < max_slots; keyslot++)
+			selected[keyslot] = selected[keyslot] && stale[keyslot];
+	}
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++) {
+		ki = crypt_keyslot_status(cd, keyslot);
+		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST)
+			active++;
+		else
+			selected[keyslot] = false;
+
+		if (!selected[keyslot])
+			continue;
+
+		if (token_of_slot[keyslot] == CRYPT_ANY_TOKEN) {
+			l_err(cd, _("Keyslot %d is not a %s keyslot, refusing to remove it."), keyslot, token_type);
+			return -EPERM;
+		}
+
+		r = crypt_keyslot_area(cd, keyslot, &offsets[keyslot], &lengths[keyslot]);
+		if (r < 0)
+			return r;
+		remove++;
+	}
+
+	if (remove == 0)
+		return 0;
+
+	if (remove >= active) {
+		l_err(cd, _("Refusing to remove the last usable keyslot."));
+		return -EPERM;
+	}
+
+	r = crypt_dump_json(cd, &json, 0);
+	if (r) {
+		l_err(cd, _("Failed to dump json."));
+		return -EINVAL;
+	}
+
+	jobj = json_tokener_parse(json);
+	if (!jobj) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	for (keyslot = 0; keyslot < max_slots; keyslot++)
+		if (selected[keyslot])
+			l_dbg(cd, "Removing keyslot %d (token %d)", keyslot, token_of_slot[keyslot]);
+
+	r = drop_keyslots(cd, jobj, token_type, selected, max_slots);
+	if (r < 0)
+		goto out;
+
+	/* Only the metadata; the areas of the keyslots are wiped for good */
+	journal_before_update(cd, journal_file);
+
+	r = write_metadata(cd, jobj);
+	if (r < 0)
+		goto out;
+
+	r = wipe_keyslot_areas(cd, offsets, lengths, selected, max_slots);
+	if (r == 0)
+		journal_after_update(cd, journal_file);
+
+out:
+	json_object_put(jobj);
+	return r;
+}
+
+static int
+print_all_tokens(json_object *jobj_output)
+{
+	const char *string_out;
+
+	string_out = json_object_to_json_string_ext(jobj_output, JSON_C_TO_STRING_PRETTY);
+	if (!string_out)
+		return -EINVAL;
+	printf ("%s\n", string_out);
+
+	return 0;
+}
+
+static int
+print_token_keyslots(struct crypt_device *cd, json_object *jobj_output)
+{
+	json_object *jobj_keyslots;
+	json_object *jobj_keyslot;
+	struct array_list *keyslots;
+	const char *keyslot_str;
+	int i;
+
+	json_object_object_foreach(jobj_output, slot, val) {
+		if (!json_object_object_get_ex(val, "keyslots", &jobj_keyslots)) {
+			l_err(cd, _("Failed to get keyslots for token %s."), slot);
+			continue;
+		}
+
+		if (json_object_array_length(jobj_keyslots) == 0)
+			continue;
+
+		keyslots = json_object_get_array(jobj_keyslots);
+		if (keyslots == NULL) {
+			l_err(cd, _("Failed to get the keyslots array for token %s."), slot);
+			continue;
+		}
+
+		for (i = 0; i < array_list_length(keyslots); i++) {
+			jobj_keyslot = array_list_get_idx(keyslots, i);
+			keyslot_str = json_object_get_string(jobj_keyslot);
+			printf("%s ", keyslot_str);
+		}
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static int
+list_tokens(struct crypt_device *cd, const char *token_type, int key_only)
+{
+	const char *json;
+	json_object *jobj;
+	json_object *jobj_tokens;
+	json_object *jobj_type;
+	json_object *jobj_output = NULL;
+	int r;
+
+	if (!cd)
+		return -1;
+
+	r = crypt_dump_json(cd, &json, 0);
+	if (r) {
+		l_err(cd, _("Failed to dump json."));
+		return -EINVAL;
+	}
+
+	jobj = json_tokener_parse(json);
+	if (!jobj) {
+		l_err(cd, _("Failed to parse LUKS2 json metadata"));
+		return -EINVAL;
+	}
+
+	if (!json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
+		l_err(cd, _("Failed to get tokens."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (json_object_object_length(jobj_tokens) == 0) {
+		r = 0;
+		goto out;
+	}
+
+	jobj_output = json_object_new_object();
+	if (!jobj_output) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		if (!json_object_object_get_ex(val, "type", &jobj_type)) {
+			l_err(cd, _("Failed to get type for token %s."), slot);
+			continue;
+		}
+
+		if (strcmp(json_object_get_string(jobj_type), token_type) != 0)
+			continue;
+
+		json_object_object_add(jobj_output, slot, json_object_get(val));
+	}
+
+	/* Nothing to print */
+	if (json_object_object_length(jobj_output) == 0) {
+		r = 0;
+		goto out;
+	}
+
+	if (key_only == 0)
+		r = print_all_tokens(jobj_output);
+	else
+		r = print_token_keyslots(cd, jobj_output);
+
+out:
+	json_object_put(jobj);
+	if (jobj_output)
+		json_object_put(jobj_output);
+	return r;
+
+}
+
+static int
+read_sysfs_attr(const char *sysfs_dev, const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_dev, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+/*
+ * Turn a kernel block device name (sda2, dm-3, md127) into the path
+ * users expect to see. DM devices are reported by their mapper name
+ * so that the output matches what lsblk -p used to print.
+ */
+static void
+sysfs_dev_to_node(const char *sysfs_dev, const char *kname, char *buf, size_t size)
+{
+	char dm_name[NAME_MAX + 1];
+
+	if (read_sysfs_attr(sysfs_dev, "dm/name", dm_name, sizeof(dm_name)) == 0 && dm_name[0])
+		snprintf(buf, size, "/dev/mapper/%s", dm_name);
+	else
+		snprintf(buf, size, "/dev/%s", kname);
+}
+
+/*
+ * Walk down the device stack starting at the given sysfs block device.
+ * Every dm-crypt mapping backed by LUKS is recorded in jobj_devices
+ * together with the device(s) it sits on. Other stacked devices (LVM,
+ * MD, nested dm) are traversed via their "slaves" directory. Only the
+ * branches of the stack below the starting device are visited, so the
+ * cost does not depend on the number of devices in the system.
+ */
+static int
+resolve_sysfs_dev(const char *sysfs_dev, json_object *jobj_devices, int depth)
+{
+	char dm_uuid[256];
+	char dm_name[NAME_MAX + 1];
+	char path[PATH_MAX];
+	char node[PATH_MAX];
+	struct dirent **slaves;
+	json_object *jobj_dev;
+	const char *type = NULL;
+	int i, n, r = 0;
+
+	if (depth > RESOLVE_MAX_DEPTH) {
+		l_err(NULL, _("Device stack below %s is too deep."), sysfs_dev);
+		return -ELOOP;
+	}
+
+	if (read_sysfs_attr(sysfs_dev, "dm/uuid", dm_uuid, sizeof(dm_uuid)) == 0) {
+		if (strncmp(dm_uuid, "CRYPT-LUKS2-", 12) == 0)
+			type = "LUKS2";
+		else if (strncmp(dm_uuid, "CRYPT-LUKS1-", 12) == 0)
+			type = "LUKS1";
+	}
+
+	snprintf(path, sizeof(path), "%s/slaves", sysfs_dev);
+	n = scandir(path, &slaves, NULL, alphasort);
+	if (n < 0)
+		return 0;	/* partitions and whole disks have no slaves */
+
+	for (i = 0; i < n; i++) {
+		const char *kname = slaves[i]->d_name;
+
+		if (kname[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/slaves/%s", sysfs_dev, kname);
+
+		if (type == NULL) {
+			if (r == 0)
+				r = resolve_sysfs_dev(path, jobj_devices, depth + 1);
+			continue;
+		}
+
+		jobj_dev = json_object_new_object();
+		if (!jobj_dev) {
+			r = -ENOMEM;
+			continue;
+		}
+
+		sysfs_dev_to_node(path, kname, node, sizeof(node));
+		json_object_object_add(jobj_dev, "device", json_object_new_string(node));
+		json_object_object_add(jobj_dev, "type", json_object_new_string(type));
+		if (read_sysfs_attr(sysfs_dev, "dm/name", dm_name, sizeof(dm_name)) == 0)
+			json_object_object_add(jobj_dev, "name", json_object_new_string(dm_name));
+		json_object_array_add(jobj_devices, jobj_dev);
+	}
+
+	for (i = 0; i < n; i++)
+		free(slaves[i]);
+	free(slaves);
+
+	return r;
+}
+
+/*
+ * Find the device number of the block device backing a path.
+ * For block device nodes, this is the device itself. For anything
+ * else, look up the mount the path lives on; file systems like btrfs
+ * report anonymous device numbers in st_dev, so prefer the mount source
+ * from mountinfo whenever it is a block device.
+ */
+static int
+path_to_devnum(const char *path, dev_t *devnum, char *source, size_t size)
+{
+	struct stat st, st_src;
+	unsigned int maj, min;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int r;
+
+	if (stat(path, &st) < 0) {
+		r = -errno;
+		l_err(NULL, _("Cannot stat %s: %s"), path, strerror(-r));
+		return r;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		*devnum = st.st_rdev;
+		snprintf(source, size, "%s", path);
+		return 0;
+	}
+
+	*devnum = st.st_dev;
+	snprintf(source, size, "%u:%u", major(st.st_dev), minor(st.st_dev));
+
+	fp = fopen("/proc/self/mountinfo", "re");
+	if (!fp)
+		return 0;
+
+	while (getline(&line, &len, fp) > 0) {
+		char *sep, *mnt_src;
+
+		if (sscanf(line, "%*u %*u %u:%u", &maj, &min) != 2)
+			continue;
+		if (makedev(maj, min) != st.st_dev)
 			continue;
-		}
 
-		for (i = 0; i < array_list_length(keyslots); i++) {
-			jobj_keyslot = array_list_get_idx(keyslots, i);
-			keyslot_str = json_object_get_string(jobj_keyslot);
-			printf("%s ", keyslot_str);
+		/* The optional fields end with " - ", followed by fstype and source */
+		sep = strstr(line, " - ");
+		if (!sep)
+			continue;
+		mnt_src = strchr(sep + 3, ' ');
+		if (!mnt_src)
+			continue;
+		mnt_src++;
+		mnt_src[strcspn(mnt_src, " \n")] = '\0';
+
+		/* Stacked mounts are listed in order; keep looking for the last one */
+		if (stat(mnt_src, &st_src) == 0 && S_ISBLK(st_src.st_mode)) {
+			*devnum = st_src.st_rdev;
+			snprintf(source, size, "%s", mnt_src);
 		}
 	}
-	printf("\n");
 
+	free(line);
+	fclose(fp);
 	return 0;
 }
 
 static int
-list_tokens(struct crypt_device *cd, int key_only)
+resolve_luks_devices(const char *path, int device_only)
 {
-	const char *json;
-	json_object *jobj;
-	json_object *jobj_tokens;
-	json_object *jobj_type;
-	json_object *jobj_output = NULL;
+	char sysfs_dev[PATH_MAX];
+	char source[PATH_MAX];
+	json_object *jobj_output;
+	json_object *jobj_devices;
+	const char *string_out;
+	uint64_t t_start;
+	dev_t devnum;
+	size_t i;
 	int r;
 
-	if (!cd)
-		return -1;
-
-	r = crypt_dump_json(cd, &json, 0);
-	if (r) {
-		l_err(cd, _("Failed to dump json."));
-		return -EINVAL;
-	}
+	r = path_to_devnum(path, &devnum, source, sizeof(source));
+	if (r < 0)
+		return r;
 
-	jobj = json_tokener_parse(json);
-	if (!jobj) {
-		l_err(cd, _("Failed to parse LUKS2 json metadata"));
-		return -EINVAL;
+	snprintf(sysfs_dev, sizeof(sysfs_dev), "/sys/dev/block/%u:%u",
+		 major(devnum), minor(devnum));
+	if (access(sysfs_dev, F_OK) < 0) {
+		l_err(NULL, _("%s is not backed by a block device."), path);
+		return -ENODEV;
 	}
 
-	if (!json_object_object_get_ex(jobj, "tokens", &jobj_tokens)) {
-		l_err(cd, _("Failed to get tokens."));
-		r = -EINVAL;
+	jobj_output = json_object_new_object();
+	jobj_devices = json_object_new_array();
+	if (!jobj_output || !jobj_devices) {
+		r = -ENOMEM;
 		goto out;
 	}
+	json_object_object_add(jobj_output, "source", json_object_new_string(source));
+	json_object_object_add(jobj_output, "devices", jobj_devices);
 
-	if (json_object_object_length(jobj_tokens) == 0) {
-		r = 0;
+	t_start = fde_trace_begin();
+	r = resolve_sysfs_dev(sysfs_dev, jobj_devices, 0);
+	fde_trace_end(t_start, "resolve %s", path);
+	if (r < 0)
 		goto out;
-	}
 
-	jobj_output = json_object_new_object();
-	if (!jobj_output) {
-		r = -ENOMEM;
+	if (json_object_array_length(jobj_devices) == 0) {
+		l_dbg(NULL, "No LUKS device found below %s", source);
+		r = -ENOENT;
 		goto out;
 	}
 
-	json_object_object_foreach(jobj_tokens, slot, val) {
-		if (!json_object_object_get_ex(val, "type", &jobj_type)) {
-			l_err(cd, _("Failed to get type for token %s."), slot);
-			continue;
-		}
-
-		if (strcmp(json_object_get_string(jobj_type), TOKEN_NAME) != 0)
-			continue;
-
-		json_object_object_add(jobj_output, slot, json_object_get(val));
-	}
+	if (device_only) {
+		for (i = 0; i < json_object_array_length(jobj_devices); i++) {
+			json_object *jobj_dev = json_object_array_get_idx(jobj_devices, i);
+			json_object *jobj_node;
 
-	/* Nothing to print */
-	if (json_object_object_length(jobj_output) == 0) {
+			if (json_object_object_get_ex(jobj_dev, "device", &jobj_node))
+				printf("%s\n", json_object_get_string(jobj_node));
+		}
 		r = 0;
 		goto out;
 	}
 
-	if (key_only == 0)
-		r = print_all_tokens(jobj_output);
-	else
-		r = print_token_keyslots(cd, jobj_output);
-
+	string_out = json_object_to_json_string_ext(jobj_output, JSON_C_TO_STRING_PRETTY);
+	if (!string_out) {
+		r = -EINVAL;
+		goto out;
+	}
+	printf("%s\n", string_out);
+	r = 0;
 out:
-	json_object_put(jobj);
 	if (jobj_output)
 		json_object_put(jobj_output);
+	else if (jobj_devices)
+		json_object_put(jobj_devices);
 	return r;
+}
 
+/*
+ * Wait for a block device given as PARTLABEL=<label> or UUID=<uuid>
+ * to show up, and print its device node.
+ */
+static int
+wait_for_device(const char *spec, int timeout)
+{
+	const char *property;
+	const char *value;
+	char *devnode = NULL;
+	uint64_t t_start;
+	int r;
+
+	if (strncmp(spec, "PARTLABEL=", 10) == 0) {
+		property = "ID_PART_ENTRY_NAME";
+		value = spec + 10;
+	} else if (strncmp(spec, "UUID=", 5) == 0) {
+		property = "ID_FS_UUID";
+		value = spec + 5;
+	} else {
+		l_err(NULL, _("Unsupported device specification %s."), spec);
+		return -EINVAL;
+	}
+
+	t_start = fde_trace_begin();
+	r = udev_wait_for_device("block", property, value,
+				 timeout < 0 ? UDEV_WAIT_FOREVER : timeout * 1000,
+				 &devnode);
+	fde_trace_end(t_start, "wait %s", spec);
+	if (r == -ETIMEDOUT) {
+		l_err(NULL, _("Timed out waiting for %s."), spec);
+		return r;
+	} else if (r < 0) {
+		l_err(NULL, _("Failed to wait for %s: %s"), spec, strerror(-r));
+		return r;
+	}
+
+	printf("%s\n", devnode);
+	free(devnode);
+	return 0;
 }
 
 static int
 init_luks2_device(const char *device, struct crypt_device **cd)
 {
+	uint64_t t_start;
 	int r;
 
+	t_start = fde_trace_begin();
 	r = crypt_init(cd, device);
 	if (r)
 		return r;
 
 	r = crypt_load(*cd, CRYPT_LUKS2, NULL);
+	fde_trace_end(t_start, "load %s", device);
 	if (r) {
 		l_err(*cd, _("Device %s is not a valid LUKS2 device."), device);
 		return r;
@@ -397,17 +3134,58 @@ init_luks2_device(const char *device, struct crypt_device **cd)
 static char doc[] = N_("fdectl utility to manage LUKS2 keyslots\v"
 		       "This utility program helps fdectl to manage LUKS2 keyslots.\n"
 		       "Actions:\n"
-		       "  add\tadd the specified keyslot into a new grub-tpm2 token.\n"
-		       "  list\tshow all the grub-tpm2 tokens in the device.\n"
-		       "  clean\tremove all the grub-tpm2 tokens without any keyslot assigned.");
-
-static char args_doc[] = N_("<action> <device>");
+		       "  add\tadd the specified keyslot into a new grub-tpm2 (or --token-type) token.\n"
+		       "  list\tshow all the grub-tpm2 (or --token-type) tokens in the device.\n"
+		       "  fido2-params\tprint the parameters of the fde-fido2 token as shell variables.\n"
+		       "  clean\tremove all the grub-tpm2 (or --token-type) tokens without any keyslot assigned.\n"
+		       "  resolve\tshow the LUKS devices backing the given mount point or block device.\n"
+		       "  wait\twait for the device PARTLABEL=<label> or UUID=<uuid> to appear.\n"
+		       "  verify\tcheck the passphrase in the key file and print the matching keyslot.\n"
+		       "  calibrate\tprint the PBKDF2 iterations that grub can process within --budget.\n"
+		       "  genkey\tenroll a new random key into a grub-tpm2 keyslot, write it to --output and print the keyslot.\n"
+		       "  factory\tmake --count encrypted copies of the image, each with its own LUKS2 header and keys, in the --output directory.\n"
+		       "  recovery\tmark the specified keyslot as the recovery keyslot to be tried first.\n"
+		       "  prune\tremove grub-tpm2 (or --token-type) keyslots and their tokens in one header update.\n"
+		       "  begin\tsave the LUKS2 metadata (and the areas of --key-slots) to the header journal.\n"
+		       "  rollback\trestore the LUKS2 metadata saved in the header journal.\n"
+		       "  commit\tdiscard the header journal.");
+
+static char args_doc[] = N_("<action> <device|path>");
 
 static struct argp_option options[] = {
-	{0,		0,		0,	  0, N_("Options for the 'add' action:")},
+	{0,		0,		0,	  0, N_("Options for the 'add', 'recovery' and 'fido2-params' actions:")},
 	{"key-slot",	OPT_KEY_SLOT,	"NUM",	  0, N_("Keyslot to assign the token to.")},
+	{0,		0,		0,	  0, N_("Options for the 'add', 'list', 'clean' and 'prune' actions:")},
+	{"token-type",	OPT_TOKEN_TYPE,	"TYPE",	  0, N_("Token type, grub-tpm2 (default), fde-fido2 or systemd-tpm2 (not for 'add').")},
+	{0,		0,		0,	  0, N_("Options for adding a fde-fido2 token:")},
+	{"fido2-credential", OPT_FIDO2_CREDENTIAL, "HEX", 0, N_("ID of the resident FIDO2 credential.")},
+	{"fido2-aaguid", OPT_FIDO2_AAGUID, "HEX",  0, N_("AAGUID of the FIDO2 authenticator.")},
+	{"fido2-salt",	OPT_FIDO2_SALT,	"HEX",	  0, N_("32 byte salt for the hmac-secret extension.")},
+	{"fido2-params", OPT_FIDO2_PARAMS, "FILE", 0, N_("Add one token per paragraph in FILE, with a new keyslot for each FIDO2_KEY.")},
+	{0,		0,		0,	  0, N_("Options for the 'prune' action:")},
+	{"key-slots",	OPT_KEY_SLOTS,	"LIST",	  0, N_("Keyslots to remove (default: all keyslots of --token-type).")},
+	{"keep",	OPT_KEEP,	"NUM",	  0, N_("Keep the NUM newest grub-tpm2 keyslots.")},
+	{0,		0,		0,	  0, N_("Options for the 'begin', 'rollback' and 'commit' actions:")},
+	{"journal",	OPT_JOURNAL,	"FILE",	  0, N_("Header journal to use (default: " JOURNAL_DIR "/<uuid>.journal).")},
+	{"root",	OPT_ROOT,	"DIR",	  0, N_("Keep the default journal below DIR, the root of the system image the device belongs to.")},
+	{0,		0,		0,	  0, N_("Options for the 'verify', 'genkey', 'factory' and 'add' actions:")},
+	{"key-file",	OPT_KEY_FILE,	"FILE",	  0, N_("Read the passphrase (with 'factory', the firstboot passphrase) from file.")},
+	{0,		0,		0,	  0, N_("Options for the 'genkey' action:")},
+	{"output",	OPT_OUTPUT,	"FILE",	  0, N_("Write the new key to file.")},
+	{"key-size",	OPT_KEY_SIZE,	"BYTES",  0, N_("Size of the new key (default: 128).")},
+	{"replace",	OPT_REPLACE,	0,	  0, N_("Replace the key in --key-file rather than adding a keyslot.")},
+	{0,		0,		0,	  0, N_("Options for the 'factory' action (also --output, --key-size, --budget and --slowdown):")},
+	{"count",	OPT_COUNT,	"NUM",	  0, N_("Number of hosts to make headers for.")},
+	{"jobs",	OPT_JOBS,	"NUM",	  0, N_("Number of parallel workers (default: number of CPUs).")},
+	{0,		0,		0,	  0, N_("Options for the 'calibrate' action:")},
+	{"budget",	OPT_BUDGET,	"MS",	  0, N_("Time grub may take to unlock a keyslot (default: 2000).")},
+	{"slowdown",	OPT_SLOWDOWN,	"FACTOR", 0, N_("How much slower grub's pbkdf2 is than ours (default: 8).")},
 	{0,		0,		0,	  0, N_("Options for the 'list' action:")},
-	{"key-only",	OPT_KEY_ONLY,	0,	  0, N_("List the keyslots assigned to grub-tpm2 tokens.")},
+	{"key-only",	OPT_KEY_ONLY,	0,	  0, N_("List the keyslots assigned to the tokens.")},
+	{0,		0,		0,	  0, N_("Options for the 'resolve' action:")},
+	{"device-only",	OPT_DEVICE_ONLY, 0,	  0, N_("List only the paths of the LUKS devices, one per line.")},
+	{0,		0,		0,	  0, N_("Options for the 'wait' action:")},
+	{"timeout",	OPT_TIMEOUT,	"SECS",	  0, N_("Give up after this many seconds (-1 waits forever).")},
 	{0,		0,		0,	  0, N_("Generic options:")},
 	{"verbose",	'v',		0,	  0, N_("Shows more detailed error messages")},
 	{"debug",	OPT_DEBUG,	0,	  0, N_("Show debug messages")},
@@ -418,8 +3196,27 @@ static struct argp_option options[] = {
 struct arguments {
 	char *device;
 	char *action;
+	char *keyfile;
+	char *keyslots;
+	char *journal;
+	char *root;
+	char *token_type;
+	char *fido2_credential;
+	char *fido2_aaguid;
+	char *fido2_salt;
+	char *fido2_params;
+	char *output;
 	int keyslot;
+	int keysize;
+	int replace;
+	int budget;
+	double slowdown;
+	int count;
+	int jobs;
+	int keep;
 	int keyonly;
+	int deviceonly;
+	int timeout;
 	int verbose;
 	int debug;
 	int debug_json;
@@ -436,6 +3233,63 @@ parse_opt (int key, char *arg, struct argp_state *state) {
 	case OPT_KEY_ONLY:
 		arguments->keyonly = 1;
 		break;
+	case OPT_KEY_FILE:
+		arguments->keyfile = arg;
+		break;
+	case OPT_KEY_SLOTS:
+		arguments->keyslots = arg;
+		break;
+	case OPT_KEEP:
+		arguments->keep = atoi(arg);
+		break;
+	case OPT_JOURNAL:
+		arguments->journal = arg;
+		break;
+	case OPT_ROOT:
+		arguments->root = arg;
+		break;
+	case OPT_TOKEN_TYPE:
+		arguments->token_type = arg;
+		break;
+	case OPT_FIDO2_CREDENTIAL:
+		arguments->fido2_credential = arg;
+		break;
+	case OPT_FIDO2_AAGUID:
+		arguments->fido2_aaguid = arg;
+		break;
+	case OPT_FIDO2_SALT:
+		arguments->fido2_salt = arg;
+		break;
+	case OPT_FIDO2_PARAMS:
+		arguments->fido2_params = arg;
+		break;
+	case OPT_OUTPUT:
+		arguments->output = arg;
+		break;
+	case OPT_KEY_SIZE:
+		arguments->keysize = atoi(arg);
+		break;
+	case OPT_REPLACE:
+		arguments->replace = 1;
+		break;
+	case OPT_BUDGET:
+		arguments->budget = atoi(arg);
+		break;
+	case OPT_SLOWDOWN:
+		arguments->slowdown = strtod(arg, NULL);
+		break;
+	case OPT_COUNT:
+		arguments->count = atoi(arg);
+		break;
+	case OPT_JOBS:
+		arguments->jobs = atoi(arg);
+		break;
+	case OPT_DEVICE_ONLY:
+		arguments->deviceonly = 1;
+		break;
+	case OPT_TIMEOUT:
+		arguments->timeout = atoi(arg);
+		break;
 	case 'v':
 		arguments->verbose = 1;
 		break;
@@ -498,6 +3352,12 @@ int main(int argc, char *argv[])
 	int token_id = CRYPT_ANY_TOKEN;
 
 	arguments.keyslot = CRYPT_ANY_SLOT;
+	arguments.timeout = DEFAULT_WAIT_TIMEOUT;
+	arguments.keysize = DEFAULT_KEY_SIZE;
+	arguments.budget = DEFAULT_UNLOCK_BUDGET_MS;
+	arguments.slowdown = DEFAULT_GRUB_SLOWDOWN;
+	arguments.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	arguments.token_type = TOKEN_NAME;
 
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
@@ -509,6 +3369,15 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	fde_trace_init("fdectl-grub-tpm2", arguments.action);
+
+	/* Images cloned from one template share their LUKS UUID, so their
+	 * journals must not go to the host's state directory */
+	if (arguments.root) {
+		snprintf(state_dir, sizeof(state_dir), "%s" FDE_STATE_DIR, arguments.root);
+		snprintf(journal_dir, sizeof(journal_dir), "%s" JOURNAL_DIR, arguments.root);
+	}
+
 	crypt_set_log_callback(NULL, _log, &arguments);
 	if (arguments.debug)
 		crypt_set_debug_level(CRYPT_DEBUG_ALL);
@@ -520,7 +3389,35 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (strcmp("add", arguments.action) == 0) {
+	if (strcmp(arguments.token_type, TOKEN_NAME) != 0
+	 && strcmp(arguments.token_type, FIDO2_TOKEN_NAME) != 0
+	 && strcmp(arguments.token_type, SYSTEMD_TPM2_TOKEN_NAME) != 0) {
+		printf(_("Unsupported token type %s.\n"), arguments.token_type);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(arguments.token_type, SYSTEMD_TPM2_TOKEN_NAME) == 0
+	 && strcmp("add", arguments.action) == 0) {
+		printf(_("Tokens of type %s are created by systemd-cryptenroll.\n"), arguments.token_type);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp("add", arguments.action) == 0 && arguments.fido2_params) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = add_fido2_tokens(cd, arguments.fido2_params, arguments.keyfile, arguments.journal);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	} else if (strcmp("add", arguments.action) == 0) {
 		if (!arguments.device) {
 			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
 			return EXIT_FAILURE;
@@ -536,7 +3433,7 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 
 		/* check existing tokens with the same keyslot */
-		ret = check_existing_tokens(cd, arguments.keyslot, &token_id);
+		ret = check_existing_tokens(cd, arguments.token_type, arguments.keyslot, &token_id);
 		if (ret != 0) {
 			return EXIT_FAILURE;
 		} else if (token_id != CRYPT_ANY_TOKEN) {
@@ -544,7 +3441,14 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 
-		ret = add_new_token(cd, arguments.keyslot);
+		journal_before_update(cd, arguments.journal);
+		if (strcmp(arguments.token_type, FIDO2_TOKEN_NAME) == 0)
+			ret = add_fido2_token(cd, arguments.keyslot, arguments.fido2_credential,
+					      arguments.fido2_aaguid, arguments.fido2_salt);
+		else
+			ret = add_new_token(cd, TOKEN_NAME, arguments.keyslot, NULL);
+		if (ret >= 0)
+			journal_after_update(cd, arguments.journal);
 	} else if (strcmp("clean", arguments.action) == 0) {
 		if (!arguments.device) {
 			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
@@ -555,7 +3459,66 @@ int main(int argc, char *argv[])
 		if (ret < 0)
 			return EXIT_FAILURE;
 
-		ret = clean_empty_tokens(cd);
+		journal_before_update(cd, arguments.journal);
+		ret = clean_empty_tokens(cd, arguments.token_type);
+		if (ret == 0)
+			journal_after_update(cd, arguments.journal);
+	} else if (strcmp("prune", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = prune_keyslots(cd, arguments.token_type, arguments.keyslots,
+				     arguments.keep, arguments.journal);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	} else if (strcmp("begin", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = journal_begin(cd, arguments.journal, arguments.keyslots);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	} else if (strcmp("rollback", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		/* The header may be too broken to load, so do not use init_luks2_device */
+		ret = journal_rollback(arguments.device, arguments.journal);
+		if (ret < 0)
+			return EXIT_FAILURE;
+	} else if (strcmp("commit", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = journal_commit(cd, arguments.journal);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
 	} else if (strcmp("list", arguments.action) == 0) {
 		if (!arguments.device) {
 			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
@@ -566,7 +3529,164 @@ int main(int argc, char *argv[])
 		if (ret < 0)
 			return EXIT_FAILURE;
 
-		ret = list_tokens(cd, arguments.keyonly);
+		ret = list_tokens(cd, arguments.token_type, arguments.keyonly);
+	} else if (strcmp("fido2-params", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = print_fido2_params(cd, arguments.keyslot);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	} else if (strcmp("verify", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		if (!arguments.keyfile) {
+			printf (_("Please specify the key file to verify\n"));
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = verify_passphrase(cd, arguments.keyfile);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		printf("%d\n", ret);
+		ret = 0;
+	} else if (strcmp("calibrate", arguments.action) == 0) {
+		if (arguments.budget <= 0 || !(arguments.slowdown > 0)) {
+			printf (_("Budget and slowdown must be positive\n"));
+			return EXIT_FAILURE;
+		}
+
+		/* The device is optional; it provides the volume key size */
+		if (arguments.device)
+			ret = init_luks2_device(arguments.device, &cd);
+		else
+			ret = crypt_init(&cd, NULL);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = calibrate_pbkdf(cd, arguments.budget, arguments.slowdown);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		printf("%d\n", ret);
+		ret = 0;
+	} else if (strcmp("genkey", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		if (!arguments.keyfile || !arguments.output) {
+			printf (_("Please specify the key file and the output file\n"));
+			return EXIT_FAILURE;
+		}
+
+		if (arguments.keysize <= 0 || arguments.keysize > MAX_KEY_SIZE) {
+			printf (_("Key size must be between 1 and %d bytes\n"), MAX_KEY_SIZE);
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = generate_key(cd, arguments.keyfile, arguments.keysize, arguments.output,
+				   arguments.replace, arguments.journal);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		printf("%d\n", ret);
+		ret = 0;
+	} else if (strcmp("factory", arguments.action) == 0) {
+		struct factory_params fp = { 0 };
+
+		if (!arguments.device) {
+			printf(_("Plaintext image must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		if (!arguments.output || arguments.count <= 0) {
+			printf (_("Please specify the output directory and the number of hosts\n"));
+			return EXIT_FAILURE;
+		}
+
+		if (arguments.keysize <= 0 || arguments.keysize > MAX_KEY_SIZE) {
+			printf (_("Key size must be between 1 and %d bytes\n"), MAX_KEY_SIZE);
+			return EXIT_FAILURE;
+		}
+
+		if (arguments.budget <= 0 || !(arguments.slowdown > 0)) {
+			printf (_("Budget and slowdown must be positive\n"));
+			return EXIT_FAILURE;
+		}
+
+		fp.image = arguments.device;
+		fp.output = arguments.output;
+		fp.firstboot_key_file = arguments.keyfile;
+		fp.key_size = arguments.keysize;
+
+		ret = factory(&fp, arguments.count, arguments.jobs > 0? arguments.jobs : 1,
+			      arguments.budget, arguments.slowdown);
+		if (ret < 0) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	} else if (strcmp("recovery", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		if (arguments.keyslot == CRYPT_ANY_SLOT) {
+			printf (_("Please specify the key slot of the recovery password\n"));
+			return EXIT_FAILURE;
+		}
+
+		ret = init_luks2_device(arguments.device, &cd);
+		if (ret < 0)
+			return EXIT_FAILURE;
+
+		ret = set_recovery_keyslot(cd, arguments.keyslot, arguments.journal);
+	} else if (strcmp("resolve", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = resolve_luks_devices(arguments.device, arguments.deviceonly);
+		if (ret < 0)
+			return EXIT_FAILURE;
+	} else if (strcmp("wait", arguments.action) == 0) {
+		if (!arguments.device) {
+			printf(_("Device must be specified for '%s' action.\n"), arguments.action);
+			return EXIT_FAILURE;
+		}
+
+		ret = wait_for_device(arguments.device, arguments.timeout);
+		if (ret < 0)
+			return EXIT_FAILURE;
 	} else {
 		printf(_("Unsupported action.\n"));
 		ret = EXIT_FAILURE;
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Event driven waiting for devices, used instead of polling lsblk or
+ * retrying device enumeration in a loop.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <libudev.h>
+#include "udev-wait.h"
+
+static bool
+__udev_device_matches(struct udev_device *dev, const char *property, const char *value)
+{
+	const char *prop_value;
+
+	if (udev_device_get_devnode(dev) == NULL)
+		return false;
+
+	if (property == NULL)
+		return true;
+
+	prop_value = udev_device_get_property_value(dev, property);
+	if (prop_value == NULL)
+		return false;
+
+	return value == NULL || strcmp(prop_value, value) == 0;
+}
+
+static int
+__udev_set_devnode(struct udev_device *dev, char **devnode)
+{
+	if (devnode == NULL)
+		return 0;
+
+	*devnode = strdup(udev_device_get_devnode(dev));
+	return *devnode ? 0 : -ENOMEM;
+}
+
+/*
+ * Look through the devices udev already knows about
+ */
+static int
+__udev_find_existing(struct udev *udev, const char *subsystem,
+		     const char *property, const char *value, char **devnode)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	int r = -ENOENT;
+
+	enumerate = udev_enumerate_new(udev);
+	if (enumerate == NULL)
+		return -ENOMEM;
+
+	udev_enumerate_add_match_subsystem(enumerate, subsystem);
+	if (property)
+		udev_enumerate_add_match_property(enumerate, property, value);
+
+	if (udev_enumerate_scan_devices(enumerate) < 0)
+		goto out;
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *dev;
+
+		dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+		if (dev == NULL)
+			continue;
+
+		if (__udev_device_matches(dev, property, value))
+			r = __udev_set_devnode(dev, devnode);
+
+		udev_device_unref(dev);
+		if (r != -ENOENT)
+			break;
+	}
+
+out:
+	udev_enumerate_unref(enumerate);
+	return r;
+}
+
+static int
+__udev_remaining_ms(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? (int) ms : 0;
+}
+
+int
+udev_wait_for_device(const char *subsystem, const char *property,
+		     const char *value, int timeout_ms, char **devnode)
+{
+	struct udev *udev;
+	struct udev_monitor *mon = NULL;
+	struct timespec deadline;
+	struct pollfd pfd;
+	int r;
+
+	if ((udev = udev_new()) == NULL)
+		return -ENOMEM;
+
+	/* Set up the monitor before enumerating existing devices, so
+	 * that we do not miss a device showing up in between. */
+	if (timeout_ms != 0) {
+		mon = udev_monitor_new_from_netlink(udev, "udev");
+		if (mon && (udev_monitor_filter_add_match_subsystem_devtype(mon, subsystem, NULL) < 0 ||
+			    udev_monitor_enable_receiving(mon) < 0)) {
+			udev_monitor_unref(mon);
+			mon = NULL;
+		}
+	}
+
+	r = __udev_find_existing(udev, subsystem, property, value, devnode);
+	if (r != -ENOENT)
+		goto out;
+
+	if (mon == NULL) {
+		r = -ETIMEDOUT;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout_ms > 0) {
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pfd.fd = udev_monitor_get_fd(mon);
+	pfd.events = POLLIN;
+
+	r = -ETIMEDOUT;
+	while (true) {
+		struct udev_device *dev;
+		const char *action;
+		int wait_ms = -1;
+		int n;
+
+		if (timeout_ms > 0 && (wait_ms = __udev_remaining_ms(&deadline)) == 0)
+			break;
+
+		n = poll(&pfd, 1, wait_ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			r = -errno;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		if ((dev = udev_monitor_receive_device(mon)) == NULL)
+			continue;
+
+		action = udev_device_get_action(dev);
+		if (action && strcmp(action, "remove") != 0 &&
+		    __udev_device_matches(dev, property, value)) {
+			r = __udev_set_devnode(dev, devnode);
+			udev_device_unref(dev);
+			break;
+		}
+
+		udev_device_unref(dev);
+	}
+
+out:
+	if (mon)
+		udev_monitor_unref(mon);
+	udev_unref(udev);
+	return r;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2023 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef FDE_UDEV_WAIT_H
+#define FDE_UDEV_WAIT_H
+
+/* Block until the device shows up; a negative timeout waits forever */
+#define UDEV_WAIT_FOREVER	-1
+
+/*
+ * Wait for a device in the given subsystem whose udev property
+ * matches value. If property is NULL, any device in the subsystem
+ * matches.
+ *
+ * Returns 0 on success and stores a malloc'ed copy of the device node
+ * in *devnode (if devnode is not NULL). Returns -ETIMEDOUT if no
+ * matching device appeared before the deadline, or another negative
+ * errno value on failure.
+ */
+int udev_wait_for_device(const char *subsystem, const char *property,
+			 const char *value, int timeout_ms, char **devnode);
+
+#endif /* FDE_UDEV_WAIT_H */